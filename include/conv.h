@@ -4,42 +4,14 @@
 #include <locale>
 #include <string>
 #include <memory>
+#include <string.h>
+
+/* strict RFC 3629 check, SIMD dispatched at runtime (luaos_utf8.cpp) */
+bool utf8_validate(const char* data, size_t size);
 
 inline static bool is_utf8(const char* p, size_t n = 0)
 {
-  unsigned char chr;
-  size_t i = 0, follow = 0;
-  for (; n ? (i < n) : (p[i] != 0); i++) {
-    chr = p[i];
-    if (follow == 0) {
-      if (chr > 0x80) {
-        if (chr == 0xfc || chr == 0xfd) {
-          follow = 5;
-        }
-        else if (chr >= 0xf8) {
-          follow = 4;
-        }
-        else if (chr >= 0xf0) {
-          follow = 3;
-        }
-        else if (chr >= 0xe0) {
-          follow = 2;
-        }
-        else if (chr >= 0xc0) {
-          follow = 1;
-        }
-        else {
-          return false;
-        }
-      }
-    } else {
-      follow--;
-      if ((chr & 0xC0) != 0x80) {
-        return false;
-      }
-    }
-  }
-  return (follow == 0);
+  return utf8_validate(p, n ? n : strlen(p));
 }
 
 inline static std::string wcs_to_mbs(const std::wstring& wstr, const char* locale = 0)
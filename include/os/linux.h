@@ -36,6 +36,13 @@
 #include <dirent.h>
 #include <linux/kernel.h>
 
+#if defined(os_linux)
+# include <sched.h>       //cpu_set_t
+# include <pthread.h>     //pthread_setaffinity_np
+# include <sys/syscall.h> //SYS_gettid
+# include <sys/resource.h>//setpriority
+#endif
+
 /***********************************************************************************/
 
 typedef long long __int64;
@@ -92,6 +99,51 @@ namespace os
       std::chrono::steady_clock::now().time_since_epoch()
     ).count();
   }
+  /* bind the calling thread to the given cpus */
+  inline static bool affinity(const int* cpus, size_t count)
+  {
+#if defined(os_linux)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (size_t i = 0; i < count; i++) {
+      if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+        return false;
+      }
+      CPU_SET(cpus[i], &mask);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    return false;
+#endif
+  }
+  /* get the cpus the calling thread may run on, returns the count */
+  inline static size_t get_affinity(int* cpus, size_t size)
+  {
+    size_t count = 0;
+#if defined(os_linux)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(mask), &mask) != 0) {
+      return 0;
+    }
+    for (int i = 0; i < CPU_SETSIZE && count < size; i++) {
+      if (CPU_ISSET(i, &mask)) {
+        cpus[count++] = i;
+      }
+    }
+#endif
+    return count;
+  }
+  /* -1: low, 0: normal, 1: high (may need privileges) */
+  inline static bool priority(int level)
+  {
+#if defined(os_linux)
+    int nice = level < 0 ? 10 : (level > 0 ? -10 : 0);
+    return setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) == 0;
+#else
+    return false;
+#endif
+  }
 }
 
 namespace dir
@@ -83,6 +83,51 @@ namespace os
       std::chrono::steady_clock::now().time_since_epoch()
     ).count();
   }
+  /* bind the calling thread to the given cpus */
+  inline static bool affinity(const int* cpus, size_t count)
+  {
+    DWORD_PTR mask = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (cpus[i] < 0 || cpus[i] >= (int)(sizeof(mask) * 8)) {
+        return false;
+      }
+      mask |= (DWORD_PTR)1 << cpus[i];
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+  }
+  /* get the cpus the calling thread may run on, returns the count */
+  inline static size_t get_affinity(int* cpus, size_t size)
+  {
+    DWORD_PTR mask = 0, system = 0;
+    HANDLE thread = GetCurrentThread();
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &system)) {
+      return 0;
+    }
+    DWORD_PTR previous = SetThreadAffinityMask(thread, mask);
+    if (previous) {
+      SetThreadAffinityMask(thread, previous);
+      mask = previous;
+    }
+    size_t count = 0;
+    for (int i = 0; i < (int)(sizeof(mask) * 8) && count < size; i++) {
+      if (mask & ((DWORD_PTR)1 << i)) {
+        cpus[count++] = i;
+      }
+    }
+    return count;
+  }
+  /* -1: low, 0: normal, 1: high */
+  inline static bool priority(int level)
+  {
+    int value = THREAD_PRIORITY_NORMAL;
+    if (level < 0) {
+      value = THREAD_PRIORITY_BELOW_NORMAL;
+    }
+    else if (level > 0) {
+      value = THREAD_PRIORITY_ABOVE_NORMAL;
+    }
+    return SetThreadPriority(GetCurrentThread(), value) != 0;
+  }
 }
 
 namespace dir
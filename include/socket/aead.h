@@ -0,0 +1,234 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#pragma once
+
+#include <string.h>
+
+#ifdef TLS_SSL_ENABLE
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#endif
+
+/*******************************************************************************/
+
+namespace eth
+{
+  enum {
+    cipher_none     = 0,
+    cipher_rc4      = 1,
+    cipher_aes_gcm  = 2, /* AES-128-GCM */
+    cipher_chacha20 = 3, /* ChaCha20-Poly1305 */
+  };
+
+  //---------------------------------------------------------------------
+  // AEAD frame cipher, the EVP context is set up once and only the key
+  // (per salt) and the nonce change
+  //---------------------------------------------------------------------
+
+  class aead_cipher final
+  {
+  public:
+    enum { nonce_size = 12, tag_size = 16, salt_size = 8 };
+
+    inline aead_cipher()
+      : _type(cipher_none), _seq(0), _opened(false) {
+#ifdef TLS_SSL_ENABLE
+      _ctx = 0;
+#endif
+    }
+
+    inline ~aead_cipher() {
+#ifdef TLS_SSL_ENABLE
+      if (_ctx) {
+        EVP_CIPHER_CTX_free(_ctx);
+      }
+#endif
+    }
+
+    inline int type() const {
+      return _type;
+    }
+
+    inline void clear() {
+      _type = cipher_none;
+    }
+
+    /*
+    ** The nonce is a random salt(8) plus a frame sequence(4), the salt is
+    ** drawn when a stream starts and redrawn when the sequence wraps. Each
+    ** salt has its own key sha256(sha256(key) + salt), so connections which
+    ** share the codec key never share a cipher key.
+    */
+    inline bool reset(int type, const void* key, size_t size)
+    {
+#ifdef TLS_SSL_ENABLE
+      const EVP_CIPHER* cipher = 0;
+      switch (type) {
+      case cipher_aes_gcm:
+        cipher = EVP_aes_128_gcm();
+        break;
+      case cipher_chacha20:
+        cipher = EVP_chacha20_poly1305();
+        break;
+      }
+      if (!cipher) {
+        return false;
+      }
+      if (!_ctx && !(_ctx = EVP_CIPHER_CTX_new())) {
+        return false;
+      }
+      if (EVP_CipherInit_ex(_ctx, cipher, 0, 0, 0, -1) != 1) {
+        _type = cipher_none;
+        return false;
+      }
+      SHA256((const unsigned char*)key, size, _base);
+      _seq    = 0;
+      _opened = false;
+      _type   = type;
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /* encrypt in place, writes the nonce and the tag */
+    inline bool seal(const void* aad, size_t aadlen, char* data, size_t size, char* nonce, char* tag)
+    {
+#ifdef TLS_SSL_ENABLE
+      if (_seq == 0)
+      {
+        if (RAND_bytes(_salt, sizeof(_salt)) != 1) {
+          return false;
+        }
+        if (!rekey(_salt)) {
+          return false;
+        }
+      }
+      memcpy(nonce, _salt, sizeof(_salt));
+      unsigned int seq = _seq++;
+      for (size_t i = sizeof(_salt); i < nonce_size; i++, seq >>= 8) {
+        nonce[i] = (char)(seq & 0xff);
+      }
+      int n = 0;
+      if (EVP_EncryptInit_ex(_ctx, 0, 0, 0, (const unsigned char*)nonce) != 1) {
+        return false;
+      }
+      if (EVP_EncryptUpdate(_ctx, 0, &n, (const unsigned char*)aad, (int)aadlen) != 1) {
+        return false;
+      }
+      if (size && EVP_EncryptUpdate(_ctx, (unsigned char*)data, &n, (const unsigned char*)data, (int)size) != 1) {
+        return false;
+      }
+      if (EVP_EncryptFinal_ex(_ctx, (unsigned char*)data + size, &n) != 1) {
+        return false;
+      }
+      return EVP_CIPHER_CTX_ctrl(_ctx, EVP_CTRL_AEAD_GET_TAG, tag_size, tag) == 1;
+#else
+      return false;
+#endif
+    }
+
+    /*
+    ** decrypt in place, false if the frame was tampered with, replayed or
+    ** reordered: a stream starts at sequence 0, the sequence has to grow
+    ** and the salt may only change where the sender wraps around
+    */
+    inline bool open(const void* aad, size_t aadlen, char* data, size_t size, const char* nonce, const char* tag)
+    {
+#ifdef TLS_SSL_ENABLE
+      unsigned int seq = 0;
+      for (size_t i = nonce_size; i > salt_size; i--) {
+        seq = (seq << 8) | (unsigned char)nonce[i - 1];
+      }
+      bool rekeyed = false;
+      if (!_opened || memcmp(nonce, _salt, sizeof(_salt)))
+      {
+        if (seq != 0 || (_opened && _seq != 0xffffffff)) {
+          return false;
+        }
+        if (!rekey((const unsigned char*)nonce)) {
+          return false;
+        }
+        rekeyed = true;
+      }
+      else if (seq <= _seq) {
+        return false;
+      }
+      if (!decrypt(aad, aadlen, data, size, nonce, tag))
+      {
+        if (rekeyed && _opened) {
+          rekey(_salt);
+        }
+        return false;
+      }
+      memcpy(_salt, nonce, sizeof(_salt));
+      _seq    = seq;
+      _opened = true;
+      return true;
+#else
+      return false;
+#endif
+    }
+
+  private:
+    aead_cipher(const aead_cipher&) = delete;
+    aead_cipher& operator=(const aead_cipher&) = delete;
+
+#ifdef TLS_SSL_ENABLE
+    inline bool rekey(const unsigned char* salt)
+    {
+      unsigned char input[sizeof(_base) + salt_size];
+      unsigned char digest[EVP_MAX_MD_SIZE];
+      memcpy(input, _base, sizeof(_base));
+      memcpy(input + sizeof(_base), salt, salt_size);
+      if (EVP_Digest(input, sizeof(input), digest, 0, EVP_sha256(), 0) != 1) {
+        return false;
+      }
+      return EVP_CipherInit_ex(_ctx, 0, 0, digest, 0, -1) == 1;
+    }
+
+    inline bool decrypt(const void* aad, size_t aadlen, char* data, size_t size, const char* nonce, const char* tag)
+    {
+      int n = 0;
+      if (EVP_DecryptInit_ex(_ctx, 0, 0, 0, (const unsigned char*)nonce) != 1) {
+        return false;
+      }
+      if (EVP_DecryptUpdate(_ctx, 0, &n, (const unsigned char*)aad, (int)aadlen) != 1) {
+        return false;
+      }
+      if (size && EVP_DecryptUpdate(_ctx, (unsigned char*)data, &n, (const unsigned char*)data, (int)size) != 1) {
+        return false;
+      }
+      if (EVP_CIPHER_CTX_ctrl(_ctx, EVP_CTRL_AEAD_SET_TAG, tag_size, (void*)tag) != 1) {
+        return false;
+      }
+      return EVP_DecryptFinal_ex(_ctx, (unsigned char*)data + size, &n) == 1;
+    }
+#endif
+
+    int _type;
+    unsigned int _seq;  /* next to seal, or last opened */
+    bool _opened;       /* a frame was opened since reset */
+    unsigned char _salt[salt_size];
+#ifdef TLS_SSL_ENABLE
+    unsigned char _base[SHA256_DIGEST_LENGTH];
+    EVP_CIPHER_CTX* _ctx;
+#endif
+  };
+}
+
+/*******************************************************************************/
@@ -0,0 +1,241 @@
+
+/************************************************************************************
+**
+** Copyright 2021 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+************************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <stdlib.h>
+#include <cstring>
+#include "circular_buffer.h"
+
+/*******************************************************************************/
+
+/*
+** A chain of fixed size blocks. Writes append to the last block and reads
+** free whole blocks from the front, nothing is ever moved. Free blocks go
+** back to a small per-thread pool, so an idle connection holds no memory.
+*/
+
+class buffer_chain final
+{
+public:
+  enum {
+    block_size = 8192,  /* data bytes per block */
+    pool_limit = 128,   /* blocks cached per thread */
+  };
+
+private:
+  struct block {
+    block* next;
+    size_t rd, wr;
+    char   data[block_size];
+  };
+
+  struct block_pool {
+    block* head;
+    size_t count;
+    block_pool() : head(0), count(0) {}
+    ~block_pool() {
+      while (head) {
+        block* next = head->next;
+        free(head);
+        head = next;
+      }
+      count = pool_limit; //chains destroyed later free their blocks directly
+    }
+  };
+
+  static block_pool& pool()
+  {
+    static thread_local block_pool _pool;
+    return _pool;
+  }
+
+  static block* alloc()
+  {
+    block_pool& p = pool();
+    block* b = p.head;
+    if (b) {
+      p.head = b->next;
+      p.count--;
+    }
+    else if (!(b = (block*)malloc(sizeof(block)))) {
+      throw("no memory");
+    }
+    b->next = 0;
+    b->rd = b->wr = 0;
+    return b;
+  }
+
+  static void release(block* b)
+  {
+    block_pool& p = pool();
+    if (p.count < pool_limit) {
+      b->next = p.head;
+      p.head = b;
+      p.count++;
+      return;
+    }
+    free(b);
+  }
+
+  block* _head;
+  block* _tail;
+  size_t _size;
+  std::vector<char> _line; //frames which straddle blocks, kept until drained
+  buffer_chain(const buffer_chain&) = delete;
+
+public:
+  inline buffer_chain()
+    : _head(0), _tail(0), _size(0) {
+  }
+  inline ~buffer_chain() {
+    clear();
+  }
+  inline bool empty() const {
+    return _size == 0;
+  }
+  inline size_t size() const {
+    return _size;
+  }
+  inline void clear()
+  {
+    while (_head) {
+      block* next = _head->next;
+      release(_head);
+      _head = next;
+    }
+    _tail = 0;
+    _size = 0;
+    std::vector<char>().swap(_line);
+  }
+
+  /* writable space at the tail, at least 1 byte, at most len */
+  inline char* prepare(size_t& len)
+  {
+    if (!_tail || _tail->wr == block_size) {
+      block* b = alloc();
+      _tail ? (_tail->next = b) : (_head = b);
+      _tail = b;
+    }
+    len = _min_size(len, block_size - _tail->wr);
+    return _tail->data + _tail->wr;
+  }
+
+  inline void commit(size_t len)
+  {
+    assert(_tail && _tail->wr + len <= block_size);
+    _tail->wr += len;
+    _size += len;
+  }
+
+  size_t write(const char* data, size_t len)
+  {
+    size_t total = len;
+    while (len > 0)
+    {
+      size_t n = len;
+      char* p = prepare(n);
+      memcpy(p, data, n);
+      commit(n);
+      data += n;
+      len  -= n;
+    }
+    return total;
+  }
+
+  size_t write(const std::string& data)
+  {
+    return write(data.c_str(), data.size());
+  }
+
+  size_t erase(size_t len)
+  {
+    len = _min_size(len, _size);
+    size_t left = len;
+    while (left > 0)
+    {
+      size_t n = _min_size(left, _head->wr - _head->rd);
+      _head->rd += n;
+      left -= n;
+      if (_head->rd == _head->wr && (_head != _tail || _head->wr == block_size)) {
+        block* next = _head->next;
+        release(_head);
+        if (!(_head = next)) {
+          _tail = 0;
+        }
+      }
+    }
+    if ((_size -= len) == 0) {
+      if (_head) {
+        release(_head);
+        _head = _tail = 0;
+      }
+      std::vector<char>().swap(_line); //drained, an idle chain keeps nothing
+    }
+    return len;
+  }
+
+  size_t read(char* buffer, size_t len)
+  {
+    len = _min_size(len, _size);
+    size_t copied = 0;
+    for (block* b = _head; copied < len; b = b->next) {
+      size_t n = _min_size(len - copied, b->wr - b->rd);
+      memcpy(buffer + copied, b->data + b->rd, n);
+      copied += n;
+    }
+    return erase(len);
+  }
+
+  /* the first len bytes in one piece, copied only if they straddle blocks */
+  char* peek(size_t len)
+  {
+    assert(len <= _size);
+    if (!_head) {
+      return 0;
+    }
+    if (_head->wr - _head->rd >= len) {
+      return _head->data + _head->rd;
+    }
+    if (_line.size() < len) {
+      _line.resize(len);
+    }
+    size_t copied = 0;
+    for (block* b = _head; copied < len; b = b->next) {
+      size_t n = _min_size(len - copied, b->wr - b->rd);
+      memcpy(&_line[copied], b->data + b->rd, n);
+      copied += n;
+    }
+    return _line.data();
+  }
+
+  /* gather view, handler(const char*, size_t) for each piece, up to len bytes */
+  template <typename Handler>
+  size_t visit(size_t len, Handler handler) const
+  {
+    size_t total = 0;
+    for (block* b = _head; b && total < len; b = b->next) {
+      size_t n = _min_size(len - total, b->wr - b->rd);
+      if (n > 0) {
+        handler(b->data + b->rd, n);
+        total += n;
+      }
+    }
+    return total;
+  }
+};
+
+/*******************************************************************************/
@@ -0,0 +1,139 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32C_TARGET
+#else
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+#endif
+
+/*******************************************************************************/
+
+namespace eth
+{
+  //---------------------------------------------------------------------
+  // CRC-32C (Castagnoli), hardware crc32 instruction when available
+  //---------------------------------------------------------------------
+
+  struct crc32c_table final
+  {
+    unsigned int t[8][256];
+    crc32c_table()
+    {
+      for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int j = 0; j < 8; j++) {
+          crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        t[0][i] = crc;
+      }
+      for (unsigned int i = 0; i < 256; i++) {
+        for (int j = 1; j < 8; j++) {
+          t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+        }
+      }
+    }
+  };
+
+  /* slicing by 8, for cpus without the crc32 instruction */
+  static __inline unsigned int crc32c_sw(unsigned int crc, const unsigned char* p, size_t n)
+  {
+    static const crc32c_table table;
+    const unsigned int (*t)[256] = table.t;
+    while (n >= 8)
+    {
+      unsigned int lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+      unsigned int hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+      crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+          ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+      p += 8;
+      n -= 8;
+    }
+    while (n--) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+  }
+
+#ifdef CRC32C_X86
+  CRC32C_TARGET
+  static unsigned int crc32c_hw(unsigned int crc, const unsigned char* p, size_t n)
+  {
+#if defined(__x86_64__) || defined(_M_X64)
+    unsigned long long crc64 = crc;
+    while (n >= 8) {
+      unsigned long long v;
+      memcpy(&v, p, 8);
+      crc64 = _mm_crc32_u64(crc64, v);
+      p += 8;
+      n -= 8;
+    }
+    crc = (unsigned int)crc64;
+#endif
+    while (n >= 4) {
+      unsigned int v;
+      memcpy(&v, p, 4);
+      crc = _mm_crc32_u32(crc, v);
+      p += 4;
+      n -= 4;
+    }
+    while (n--) {
+      crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+  }
+
+  static __inline bool crc32c_detect()
+  {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+  }
+
+  static __inline bool crc32c_hw_supported()
+  {
+    static const bool yes = crc32c_detect();
+    return yes;
+  }
+#endif
+
+  static __inline unsigned int crc32c(const void* data, size_t size)
+  {
+    const unsigned char* p = (const unsigned char*)data;
+#ifdef CRC32C_X86
+    if (crc32c_hw_supported()) {
+      return ~crc32c_hw(0xffffffff, p, size);
+    }
+#endif
+    return ~crc32c_sw(0xffffffff, p, size);
+  }
+}
+
+/*******************************************************************************/
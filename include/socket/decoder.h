@@ -15,9 +15,13 @@
 
 #pragma once
 
+#include <vector>
 #include "rc4.h"
+#include "aead.h"
 #include "quicklz.h"
+#include "crc32c.h"
 #include "circular_buffer.h"
+#include "buffer_chain.h"
 
 /*******************************************************************************
 
@@ -39,6 +43,18 @@
 |                   Payload Data continued ...                  |
 +---------------------------------------------------------------+
 
+HASH = 0            : no hash-value (trusted links)
+HASH = 1, RSV3 = 0  : hash32 (murmur), understood by every peer
+HASH = 1, RSV3 = 1  : crc32c, only send it to peers known to decode it
+RSV1 = 1, RSV3 = 1, HASH = 0 : AEAD cipher, the payload is laid out as
+
++---------------+-----------------------+-------------------+-----------+
+| cipher id (8) | nonce (96)            | Payload Data      | tag (128) |
++---------------+-----------------------+-------------------+-----------+
+
+the tag also covers the frame header up to and including the cipher id,
+so no hash-value is sent. Payload len only counts the Payload Data.
+
 ********************************************************************************/
 
 #ifndef IWORDS_BIG_ENDIAN
@@ -189,6 +205,24 @@ namespace eth
     return h;
   }
 
+  enum {
+    hash_none   = 0,
+    hash_murmur = 1,
+    hash_crc32c = 2,
+  };
+
+  static __inline unsigned int frame_hash(int type, const void* key, size_t len)
+  {
+    return type == hash_crc32c ? crc32c(key, len) : hash32(key, len);
+  }
+
+  enum {
+    max_head_size      = 2 + 2 + 4 + 1 + aead_cipher::nonce_size,
+    compress_threshold = 128,     /* smaller payloads are sent as is */
+    compress_probe     = 1024,    /* larger payloads try their head first */
+    compress_reuse     = 1 << 20, /* larger buffers are freed after use */
+  };
+
   //---------------------------------------------------------------------
 
   class decoder final
@@ -198,6 +232,7 @@ namespace eth
       char fin;
       char rsv1, rsv2, rsv3;
       char hash, opcode;
+      char cipher;
       u16  cnt;
       u32  size;
     };
@@ -206,6 +241,10 @@ namespace eth
       clear();
       if (key) {
         _rc4.reset(key, size);
+        _key.assign(key, size);
+      }
+      else {
+        _key.assign(rc4_encoder::default_key());
       }
     }
     inline size_t size() const {
@@ -213,7 +252,7 @@ namespace eth
     }
 
     inline const char* data() {
-      return _buf.data();
+      return _buf.peek(_buf.size());
     }
 
     inline size_t write(const char* data, size_t size) {
@@ -229,12 +268,13 @@ namespace eth
 
     template <typename Handler> int decode(Handler handler)
     {
-      size_t size = _buf.size();
-      const char* data = _buf.data();
       u8 byte1 = 0, byte2 = 0;
 
-      while (size > 1)
+      while (_buf.size() > 1)
       {
+        /* parse the header first, the frame is only made contiguous once complete */
+        size_t size = _buf.size();
+        const char* data = _buf.peek(_min_size(size, (size_t)max_head_size));
         const char* begin = data;
         size -= 2;
         data = decode8u(data, &byte1);
@@ -248,9 +288,20 @@ namespace eth
         _head.hash     = (byte2 >> 7);
         _head.opcode   = (byte1 & 0x0f);
 
+        bool aead = false;
         if (_head.rsv3) {
-          return 1;
+          if (_head.hash) {
+            _head.hash = hash_crc32c;
+          }
+          else if (_head.rsv1) {
+            aead = true;
+          }
+          else {
+            return 1;
+          }
+          _head.rsv3 = 0;
         }
+        _head.cipher = _head.rsv1 ? cipher_rc4 : cipher_none;
 
         u16 length = (byte2 & 0x7f);
         if (length == 127)
@@ -272,18 +323,52 @@ namespace eth
           data = decode32u(data, &hash);
         }
 
-        if (size < length) {
+        size_t nonce = 0;
+        if (aead)
+        {
+          if (size < 1 + aead_cipher::nonce_size) {
+            break;
+          }
+          u8 cipher = 0;
+          data = decode8u(data, &cipher);
+          nonce = data - begin;
+          data += aead_cipher::nonce_size;
+          size -= 1 + aead_cipher::nonce_size;
+          _head.cipher = (char)cipher;
+        }
+
+        size_t tail = aead ? (size_t)aead_cipher::tag_size : 0;
+        if (size < length + tail) {
           break;
         }
 
-        if (_head.rsv1) {
+        size_t head = data - begin;
+        begin = _buf.peek(head + length + tail);
+        data  = begin + head;
+
+        if (aead)
+        {
+          if (_aead.type() != _head.cipher) {
+            /* a stream can't move to another aead cipher and start over */
+            if (_aead.type() != cipher_none) {
+              return 6;
+            }
+            if (!_aead.reset(_head.cipher, _key.c_str(), _key.size())) {
+              return 6;
+            }
+          }
+          if (!_aead.open(begin, nonce, (char*)data, length, begin + nonce, data + length)) {
+            return 2;
+          }
+        }
+        else if (_head.rsv1) {
           _rc4.convert(
             data, length, (char*)data
           );
         }
 
         if (_head.hash){
-          if (hash32(data, length) != hash) {
+          if (frame_hash(_head.hash, data, length) != hash) {
             return 2;
           }
         }
@@ -300,7 +385,6 @@ namespace eth
             packet = _cache.data();
           }
 
-          char* buff = 0;
           if (_head.rsv2)
           {
             size_t n = qlz_size_compressed(packet);
@@ -309,42 +393,46 @@ namespace eth
             }
 
             n = qlz_size_decompressed(packet);
-            buff = (char*)malloc(n);
-            if (!buff) {
-              return 4;
+            if (_unzip.size() < n) {
+              try {
+                _unzip.resize(n);
+              }
+              catch (...) {
+                return 4;
+              }
             }
 
-            size_t x = qlz_decompress(packet, buff, &st);
+            size_t x = qlz_decompress(packet, _unzip.data(), &st);
             if (x != n) {
-              free(buff);
               return 5;
             }
 
-            packet = buff;
+            packet = _unzip.data();
             _head.size = (u32)n;
           }
 
           handler(packet, _head.size, &_head);
-          if (buff) {
-            free(buff);
+          if (_unzip.size() > compress_reuse) {
+            std::vector<char>().swap(_unzip);
           }
 
           _cache.clear();
           memset(&_head, 0, sizeof(_head));
         }
 
-        size = size - length;
-        data = data + length;
-        _buf.erase(data - begin);
+        _buf.erase(head + length + tail);
       }
       return 0;
     }
 
   private:
     header _head;           //head of packet
+    std::string     _key;   //key of aead cipher
+    aead_cipher     _aead;  //aead cipher, set up by the first frame
     rc4_encoder     _rc4;   //rc4 encoder
-    circular_buffer _buf;   //data received
+    buffer_chain    _buf;   //data received
     circular_buffer _cache; //packet of decoded
+    std::vector<char> _unzip; //decompressed packet, reused
     qlz_state_decompress st;
   };
 
@@ -352,43 +440,90 @@ namespace eth
 
   class encoder final {
     rc4_encoder _rc4;       //rc4 encoder
+    aead_cipher _aead;      //aead cipher, used instead of rc4 if set
+    std::string _key;       //key of aead cipher
+    std::vector<char> _zip; //compressed packet, reused
     qlz_state_compress st;
+    int _hash;              //hash_none, hash_murmur or hash_crc32c
 
   public:
-    inline encoder(const char* key = 0, size_t size = 0) {
+    inline encoder(const char* key = 0, size_t size = 0)
+      : _hash(hash_murmur) {
       if (key) {
         _rc4.reset(key, size);
+        _key.assign(key, size);
+      }
+      else {
+        _key.assign(rc4_encoder::default_key());
+      }
+    }
+    inline int cipher() const {
+      return _aead.type() ? _aead.type() : cipher_rc4;
+    }
+    inline bool cipher(int type) {
+      if (type == cipher_rc4) {
+        _aead.clear();
+        return true;
       }
+      if (_aead.type() == type) {
+        return true;
+      }
+      return _aead.reset(type, _key.c_str(), _key.size());
+    }
+    inline int hash() const {
+      return _hash;
     }
+    inline void hash(int type) {
+      _hash = type;
+    }
+    /* false if a frame can't be sealed, the frames before it were handed out */
     template <typename Handler>
-    void encode(int opcode, const char* data, size_t size, bool encrypt, bool compress, Handler handler)
+    bool encode(int opcode, const char* data, size_t size, bool encrypt, bool compress, Handler handler)
     {
       assert(opcode < 0x10);
-      char cache[8192];
-      char* buff = 0;
+      if (size < compress_threshold) {
+        compress = false;
+      }
 
       if (compress)
       {
-        if (size + 400 < sizeof(cache)) {
-          buff = cache;
-        }
-        else {
-          buff = (char*)malloc(size + 400);
+        if (_zip.size() < size + 400) {
+          try {
+            _zip.resize(size + 400);
+          }
+          catch (...) {
+            compress = false;
+          }
         }
+      }
 
-        if (!buff) {
+      if (compress && size >= 4 * compress_probe)
+      {
+        /* random or already compressed data: don't compress all of it to find out */
+        if (qlz_compress(data, _zip.data(), compress_probe, &st) >= compress_probe) {
           compress = false;
         }
+      }
+
+      if (compress)
+      {
+        size_t n = qlz_compress(data, _zip.data(), size, &st);
+        if (n < size) {
+          size = n;
+          data = _zip.data();
+        }
         else {
-          size = qlz_compress(data, buff, size, &st);
-          data = buff;
+          compress = false; //incompressible, send as is
         }
       }
 
-      u32 hash = 1;
       opcode &= 0x0f;
       circular_buffer buf;
 
+      /* the aead tag replaces the hash-value */
+      bool aead = encrypt && _aead.type() != cipher_none;
+      int hash = aead ? (int)hash_none : _hash;
+
       do
       {
         size_t len = _min_size(size, 0xffff);
@@ -402,6 +537,10 @@ namespace eth
         if (compress) {
           byte1 |= (1 << 5); //set rsv2 = 1
         }
+
+        if (hash == hash_crc32c || aead) {
+          byte1 |= (1 << 4); //set rsv3 = 1
+        }
         u8 byte2 = hash ? 0x80 : 0;
 
         buf.clear();
@@ -425,17 +564,35 @@ namespace eth
         if (hash)
         {
           u32 nv = 0;
-          hash = hash32(data, len);
-          encode32u((char*)&nv, (u32)hash);
+          encode32u((char*)&nv, (u32)frame_hash(hash, data, len));
           buf.write((char*)&nv, sizeof(nv));
         }
 
+        if (aead)
+        {
+          char nonce[aead_cipher::nonce_size] = { 0 };
+          u8 cipher = (u8)_aead.type();
+          buf.write((char*)&cipher, 1);
+          buf.write(nonce, sizeof(nonce));
+        }
+
+        size_t n = buf.size();
         buf.write(data, len);
         data = data + len;
-        size_t n = buf.size() - len;
 
-        const char* packet = buf.data() + n;
-        if (encrypt) {
+        if (aead)
+        {
+          char tag[aead_cipher::tag_size] = { 0 };
+          buf.write(tag, sizeof(tag));
+
+          char* head = (char*)buf.data();
+          char* nonce = head + n - aead_cipher::nonce_size;
+          if (!_aead.seal(head, nonce - head, head + n, len, nonce, head + n + len)) {
+            return false;
+          }
+        }
+        else if (encrypt) {
+          const char* packet = buf.data() + n;
           _rc4.convert(packet, len, (char*)packet);
         }
 
@@ -443,7 +600,10 @@ namespace eth
       }
       while (size > 0);
 
-      if (buff && buff != cache) free(buff);
+      if (_zip.size() > compress_reuse) {
+        std::vector<char>().swap(_zip);
+      }
+      return true;
     }
   };
 }
@@ -0,0 +1,456 @@
+
+/************************************************************************************
+**
+** Copyright 2021 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+************************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <cctype>
+#include <cstring>
+#include <stdlib.h>
+
+/*******************************************************************************/
+
+/*
+** Request framing for an http server socket, fed with the received bytes
+** before they reach the application. The request line and headers are
+** held back until they are complete, so a client trickling its headers
+** costs no callbacks, and the size, deadline and receive rate limits are
+** checked on the way. A websocket upgrade is held to the body limits
+** until the server answers it with 101, after that the bytes pass
+** untouched.
+*/
+
+struct http_limits {
+  size_t header_timeout;  /* ms from the first byte of a request to the end of its headers,
+                             also from accept to the first byte and from an upgrade to its 101 */
+  size_t body_timeout;    /* ms from the end of the headers to the end of the body */
+  size_t min_rate;        /* bytes per second while a request is incomplete, 0 is off */
+  size_t max_headers;     /* header lines */
+  size_t max_header_size; /* bytes, request line included */
+  size_t max_body_size;   /* bytes */
+
+  http_limits()
+    : header_timeout(10000)
+    , body_timeout(60000)
+    , min_rate(256)
+    , max_headers(100)
+    , max_header_size(16384)
+    , max_body_size(8 * 1024 * 1024) {
+  }
+};
+
+class http_guard final
+{
+public:
+  enum status {
+    ok               = 0,
+    bad_request      = 400,
+    timeout          = 408,
+    too_large        = 413,
+    header_too_large = 431,
+  };
+  enum {
+    rate_grace = 2000, /* ms before the receive rate is judged */
+    max_chunk_line = 1024,
+  };
+
+private:
+  enum phase {
+    phase_accept,   /* connected, nothing received yet */
+    phase_idle,     /* between requests */
+    phase_header,   /* request line and headers */
+    phase_body,     /* content-length body */
+    phase_chunk,    /* chunk size line */
+    phase_data,     /* chunk data */
+    phase_data_end, /* crlf after chunk data */
+    phase_trailer,  /* trailers after the last chunk */
+    phase_upgrade,  /* upgrade requested, waiting for the 101 */
+    phase_through,  /* upgraded, nothing is checked */
+  };
+
+  http_limits _limits;
+  phase       _phase;
+  size_t      _started;  /* when the current phase began */
+  size_t      _received; /* bytes received in the current phase */
+  size_t      _remain;   /* body or chunk bytes left */
+  size_t      _body;     /* body bytes of the current request */
+  size_t      _lines;
+  size_t      _line;     /* start of the current line in _header */
+  bool        _upgrade;
+  bool        _chunked;
+  std::string _header;
+  std::string _output;
+
+  static bool iequals(const char* a, size_t size, const char* b)
+  {
+    if (strlen(b) != size) {
+      return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+      if (tolower((unsigned char)a[i]) != b[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool icontains(const char* a, size_t size, const char* b)
+  {
+    size_t n = strlen(b);
+    for (size_t i = 0; i + n <= size; i++) {
+      if (iequals(a + i, n, b)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void enter(phase which, size_t now)
+  {
+    _phase    = which;
+    _started  = now;
+    _received = 0;
+  }
+
+  /* the headers are complete, pick up the body framing */
+  int on_headers(size_t now)
+  {
+    size_t length = 0;
+    bool has_length = false;
+    bool websocket = false, connection = false;
+    _upgrade = _chunked = false;
+
+    const char* p = _header.data();
+    const char* end = p + _header.size();
+    p = (const char*)memchr(p, '\n', end - p) + 1; /* skip the request line */
+    while (p < end)
+    {
+      const char* eol = (const char*)memchr(p, '\n', end - p);
+      const char* colon = (const char*)memchr(p, ':', eol - p);
+      if (colon)
+      {
+        const char* value = colon + 1;
+        const char* stop = eol;
+        while (value < stop && (*value == ' ' || *value == '\t')) value++;
+        while (stop > value && (stop[-1] == '\r' || stop[-1] == ' ' || stop[-1] == '\t')) stop--;
+        size_t name = colon - p;
+        if (iequals(p, name, "content-length"))
+        {
+          if (value == stop) {
+            return bad_request;
+          }
+          size_t n = 0;
+          for (const char* c = value; c < stop; c++) {
+            if (*c < '0' || *c > '9') {
+              return bad_request;
+            }
+            if (n > _limits.max_body_size) {
+              return too_large;
+            }
+            n = n * 10 + (*c - '0');
+          }
+          if (has_length && n != length) {
+            return bad_request;
+          }
+          length = n;
+          has_length = true;
+        }
+        else if (iequals(p, name, "transfer-encoding")) {
+          _chunked = icontains(value, stop - value, "chunked");
+        }
+        else if (iequals(p, name, "upgrade")) {
+          websocket = icontains(value, stop - value, "websocket");
+        }
+        else if (iequals(p, name, "connection")) {
+          connection = icontains(value, stop - value, "upgrade");
+        }
+      }
+      p = eol + 1;
+    }
+    if (length > _limits.max_body_size) {
+      return too_large;
+    }
+    _body = 0;
+    /* anything else carrying an upgrade header is an ordinary request */
+    _upgrade = websocket && connection && !_chunked && length == 0 && _header.compare(0, 4, "GET ") == 0;
+    if (_upgrade) {
+      enter(phase_upgrade, now);
+    }
+    else if (_chunked) {
+      _remain = 0;
+      enter(phase_chunk, now);
+    }
+    else if (length > 0) {
+      _remain = length;
+      enter(phase_body, now);
+    }
+    else {
+      enter(phase_idle, now);
+    }
+    return ok;
+  }
+
+  int scan_header(const char*& data, size_t& size, size_t now)
+  {
+    while (size > 0)
+    {
+      const char* eol = (const char*)memchr(data, '\n', size);
+      size_t n = eol ? eol - data + 1 : size;
+      if (_header.size() + n > _limits.max_header_size) {
+        return header_too_large;
+      }
+      _header.append(data, n);
+      data += n;
+      size -= n;
+      if (!eol) {
+        break;
+      }
+      size_t length = _header.size() - _line;
+      const char* line = _header.data() + _line;
+      bool empty = length == 1 || (length == 2 && line[0] == '\r');
+      if (empty && _lines == 0) {
+        _header.clear(); /* stray crlf before a request */
+        _line = 0;
+        continue;
+      }
+      if (!empty)
+      {
+        if (++_lines > _limits.max_headers + 1) {
+          return header_too_large;
+        }
+        _line = _header.size();
+        continue;
+      }
+      int status = on_headers(now);
+      if (status != ok) {
+        return status;
+      }
+      _output.append(_header);
+      _header.clear();
+      _lines = _line = 0;
+      return ok;
+    }
+    return ok;
+  }
+
+  int scan_chunk(const char*& data, size_t& size, size_t now)
+  {
+    while (size > 0)
+    {
+      if (_phase == phase_data)
+      {
+        size_t n = size < _remain ? size : _remain;
+        _output.append(data, n);
+        data += n;
+        size -= n;
+        if ((_remain -= n) == 0) {
+          _phase = phase_data_end;
+        }
+        continue;
+      }
+      const char* eol = (const char*)memchr(data, '\n', size);
+      size_t n = eol ? eol - data + 1 : size;
+      if (_header.size() + n > max_chunk_line) {
+        return bad_request;
+      }
+      _header.append(data, n);
+      _output.append(data, n);
+      data += n;
+      size -= n;
+      if (!eol) {
+        break;
+      }
+      if (_phase == phase_data_end) {
+        _header.clear();
+        _phase = phase_chunk;
+        continue;
+      }
+      if (_phase == phase_trailer)
+      {
+        bool empty = _header.size() == 1 || (_header.size() == 2 && _header[0] == '\r');
+        _header.clear();
+        if (empty) {
+          enter(phase_idle, now);
+          return ok;
+        }
+        continue;
+      }
+      char* end = 0;
+      size_t length = strtoul(_header.c_str(), &end, 16);
+      if (end == _header.c_str()) {
+        return bad_request;
+      }
+      _header.clear();
+      if (length == 0) {
+        _phase = phase_trailer;
+        continue;
+      }
+      if (length > _limits.max_body_size || _body + length > _limits.max_body_size) {
+        return too_large;
+      }
+      _body  += length;
+      _remain = length;
+      _phase  = phase_data;
+    }
+    return ok;
+  }
+
+public:
+  http_guard(const http_limits& limits, size_t now)
+    : _limits(limits)
+    , _phase(phase_accept)
+    , _started(now)
+    , _received(0)
+    , _remain(0)
+    , _body(0)
+    , _lines(0)
+    , _line(0)
+    , _upgrade(false)
+    , _chunked(false) {
+  }
+
+  inline const http_limits& limits() const {
+    return _limits;
+  }
+
+  /* no longer looking at the bytes */
+  inline bool passthrough() const {
+    return _phase == phase_through;
+  }
+
+  /* the application sends a response, an upgrade holds if it is 101 */
+  void on_response(const char* data, size_t size, size_t now)
+  {
+    if (_phase != phase_upgrade || size < 12 || memcmp(data, "HTTP/1.", 7)) {
+      return;
+    }
+    if (memcmp(data + 8, " 101", 4) == 0) {
+      enter(phase_through, now);
+    }
+    else {
+      enter(phase_idle, now); /* refused, back to plain requests */
+    }
+  }
+
+  /*
+  ** Feed received bytes, out and outlen are what the application
+  ** may see now, which is nothing while the headers are incomplete.
+  */
+  int feed(const char* data, size_t size, size_t now, const char*& out, size_t& outlen)
+  {
+    if (_phase == phase_upgrade)
+    {
+      /* early frames are passed on but count as a body */
+      if ((_body += size) > _limits.max_body_size) {
+        return too_large;
+      }
+      out = data;
+      outlen = size;
+      return ok;
+    }
+    if (_phase == phase_through || (_phase == phase_body && size <= _remain))
+    {
+      if (_phase == phase_body) {
+        _received += size;
+        if ((_remain -= size) == 0) {
+          enter(phase_idle, now);
+        }
+      }
+      out = data;
+      outlen = size;
+      return ok;
+    }
+    _output.clear();
+    while (size > 0)
+    {
+      int status = ok;
+      switch (_phase) {
+      case phase_accept:
+      case phase_idle:
+        enter(phase_header, now);
+        break;
+      case phase_header:
+        _received += size;
+        status = scan_header(data, size, now);
+        break;
+      case phase_body: {
+        size_t n = size < _remain ? size : _remain;
+        _received += n;
+        _output.append(data, n);
+        data += n;
+        size -= n;
+        if ((_remain -= n) == 0) {
+          enter(phase_idle, now);
+        }
+        break;
+      }
+      case phase_through:
+        _output.append(data, size);
+        size = 0;
+        break;
+      default:
+        _received += size;
+        status = scan_chunk(data, size, now);
+        break;
+      }
+      if (status != ok) {
+        return status;
+      }
+    }
+    out = _output.data();
+    outlen = _output.size();
+    return check(now);
+  }
+
+  /* deadlines and receive rate of the request in progress */
+  int check(size_t now) const
+  {
+    if (_phase == phase_idle || _phase == phase_through) {
+      return ok;
+    }
+    size_t elapsed = now - _started;
+    if (_phase == phase_accept || _phase == phase_upgrade) {
+      /* nothing owed by the client, only the deadline counts */
+      return _limits.header_timeout && elapsed >= _limits.header_timeout ? timeout : ok;
+    }
+    size_t deadline = _phase == phase_header ? _limits.header_timeout : _limits.body_timeout;
+    if (deadline && elapsed >= deadline) {
+      return timeout;
+    }
+    if (_limits.min_rate && elapsed >= rate_grace) {
+      if (_received * 1000 < _limits.min_rate * elapsed) {
+        return timeout;
+      }
+    }
+    return ok;
+  }
+
+  static const char* reason(int status)
+  {
+    switch (status) {
+    case bad_request:
+      return "Bad Request";
+    case timeout:
+      return "Request Timeout";
+    case too_large:
+      return "Payload Too Large";
+    case header_too_large:
+      return "Request Header Fields Too Large";
+    }
+    return "Error";
+  }
+};
+
+/*******************************************************************************/
@@ -15,21 +15,36 @@
 
 #pragma once
 
-#include <list>
+#include <memory>
 #include "mutex.h"
 
 /*******************************************************************************/
 
+/*
+** Services and sockets are numbered separately. Service ids stay below
+** 65536 so they fit the 16-bit job fields of the publisher encoding, socket
+** ids carry a generation above the slot so a stale id held by a script
+** never names a newer socket.
+*/
+
 class identifier final
 {
 public:
   typedef int value_type;
-  inline identifier()
-    : _value(generator::instance()->next()) {
+  enum kind {
+    service_id = 0, /* 1..65535, no generation */
+    socket_id  = 1, /* slot(20) plus generation(11), always positive */
+  };
+  /* every id in use, creation fails rather than hand out 0 */
+  inline explicit identifier(kind which = service_id)
+    : _kind(which), _value(generator::instance(which)->next()) {
+    if (_value == 0) {
+      throw("identifier exhausted");
+    }
   }
   inline ~identifier()
   {
-    generator::instance()->push(_value);
+    generator::instance(_kind)->push(_value);
   }
   inline operator int() const
   {
@@ -39,49 +54,101 @@ public:
   {
     return _value;
   }
-  inline static value_type max_value()
+  inline static value_type max_value(kind which = service_id)
   {
-    return 0xffff;
+    return generator::instance(which)->max_value();
   }
   identifier(const identifier&) = delete;
   identifier& operator= (const identifier&) = delete;
 
 private:
+  /*
+  ** Free slots form a lock-free stack threaded through a preallocated slot
+  ** table, the head carries an ABA tag beside the slot index. Slots never
+  ** used yet are taken from _next, so untouched table pages are never
+  ** committed.
+  */
   class generator final
   {
+    struct slot {
+      std::atomic<unsigned int> next;
+      unsigned int gen;
+    };
+
   public:
-    static generator* instance()
+    static generator* instance(kind which)
     {
-      static generator gen(1);
-      return &gen;
+      static generator services(16, 0);
+      static generator sockets(20, 11);
+      return which == socket_id ? &sockets : &services;
+    }
+    inline value_type max_value() const
+    {
+      return (value_type)_capacity - 1;
     }
     value_type next()
     {
-      value_type id = 0;
-      local_unique_lock lock(_mutex);
-      if (_next < max_value() + 1) {
-        id = _next++;
-      }
-      else if (!_free.empty()) {
-        id = _free.front();
-        _free.pop_front();
+      unsigned int index = pop();
+      if (index == 0) {
+        index = _next.fetch_add(1, std::memory_order_relaxed);
+        if (index >= _capacity) {
+          _next.store(_capacity, std::memory_order_relaxed);
+          return 0;
+        }
+        _slots[index].gen = 0;
       }
+      value_type id = (value_type)((_slots[index].gen << _slot_bits) | index);
       assert(id > 0);
       return id;
     }
     void push(value_type id)
     {
-      assert(id > 0);
-      local_unique_lock lock(_mutex);
-      _free.push_back(id);
+      unsigned int index = (unsigned int)id & (_capacity - 1);
+      if (index == 0) {
+        return; /* 0 ends the free stack */
+      }
+      slot& s = _slots[index];
+      s.gen = (s.gen + 1) & _gen_mask;
+      unsigned long long head = _free.load(std::memory_order_relaxed);
+      unsigned long long desired;
+      do {
+        s.next.store((unsigned int)head, std::memory_order_relaxed);
+        desired = ((head >> 32) + 1) << 32 | index;
+      } while (!_free.compare_exchange_weak(head, desired, std::memory_order_release, std::memory_order_relaxed));
     }
 
   private:
-    lock_type _mutex;
-    value_type _next;
-    std::list<value_type> _free;
-    generator(value_type init) : _next(init) { }
+    unsigned int pop()
+    {
+      unsigned long long head = _free.load(std::memory_order_acquire);
+      while ((unsigned int)head != 0)
+      {
+        unsigned int index = (unsigned int)head;
+        unsigned long long desired = ((head >> 32) + 1) << 32 | _slots[index].next.load(std::memory_order_relaxed);
+        if (_free.compare_exchange_weak(head, desired, std::memory_order_acquire, std::memory_order_acquire)) {
+          return index;
+        }
+      }
+      return 0;
+    }
+
+    const int _slot_bits;
+    const unsigned int _gen_mask;
+    const unsigned int _capacity;
+    std::unique_ptr<slot[]> _slots;
+    std::atomic<unsigned int> _next;
+    std::atomic<unsigned long long> _free; /* tag(32) | slot(32), slot 0 ends the stack */
+
+    generator(int slot_bits, int gen_bits)
+      : _slot_bits(slot_bits)
+      , _gen_mask((1u << gen_bits) - 1)
+      , _capacity(1u << slot_bits)
+      , _slots(new slot[1u << slot_bits])
+      , _next(1)
+      , _free(0) {
+    }
   };
+  const kind _kind;
   const value_type _value;
 };
 
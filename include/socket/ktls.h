@@ -0,0 +1,108 @@
+
+/************************************************************************************
+**
+** Copyright 2021 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+************************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+
+/*******************************************************************************/
+
+/*
+** Kernel tls and zero copy file sends. A socket asking for kernel tls
+** runs its session on the descriptor instead of asio memory bios, so
+** openssl can hand the record keys to the kernel after the handshake.
+** Where that is not possible the socket stays on the asio ssl stream.
+*/
+
+namespace ktls
+{
+#if defined(TLS_SSL_ENABLE) && defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define KTLS_ENABLE
+#endif
+
+  /* ciphers the kernel can run, negotiated on kernel tls sockets */
+  static const char* const ciphers = "ECDHE+AESGCM:ECDHE+CHACHA20:AESGCM";
+
+  /* openssl is built with it and the tls ulp is loaded */
+  inline bool supported()
+  {
+#ifdef KTLS_ENABLE
+    static const bool result = []() {
+      char line[256] = { 0 };
+      FILE* fp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+      if (!fp) {
+        return false;
+      }
+      bool found = false;
+      if (fgets(line, sizeof(line), fp)) {
+        for (char* p = strtok(line, " \t\r\n"); p; p = strtok(nullptr, " \t\r\n")) {
+          found = found || strcmp(p, "tls") == 0;
+        }
+      }
+      fclose(fp);
+      return found;
+    }();
+    return result;
+#else
+    return false;
+#endif
+  }
+
+  /* the kernel can copy from a file into this socket */
+  inline bool has_sendfile()
+  {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  /*
+  ** Send up to size bytes of fd from offset without blocking. Returns
+  ** the bytes sent, 0 with err set to EAGAIN when the socket is full.
+  */
+  inline size_t sendfile(int sock, int fd, uint64_t& offset, size_t size, int& err)
+  {
+    err = 0;
+#ifdef __linux__
+    off_t pos = (off_t)offset;
+    ssize_t n = ::sendfile(sock, fd, &pos, size);
+    if (n < 0) {
+      err = errno;
+      return 0;
+    }
+    if (n == 0) {
+      err = EIO; /* the file got shorter */
+      return 0;
+    }
+    offset = (uint64_t)pos;
+    return (size_t)n;
+#else
+    err = -1;
+    return 0;
+#endif
+  }
+} //end of namespace ktls
+
+/*******************************************************************************/
@@ -47,6 +47,74 @@ public:
 
 /***********************************************************************************/
 
+/*
+** Readers back off while a writer waits, so a steady stream of readers
+** can't starve the writers.
+*/
+class atomic_rwlock final {
+  std::atomic<int> _count;   /* -1: writing, >0: readers */
+  std::atomic<int> _writers; /* writers waiting in lock() */
+
+public:
+  inline void lock()
+  {
+    _writers.fetch_add(1, std::memory_order_relaxed);
+    while (!try_lock()) std::this_thread::yield();
+    _writers.fetch_sub(1, std::memory_order_relaxed);
+  }
+  inline void unlock()
+  {
+    _count.store(0, std::memory_order_release);
+  }
+  inline bool try_lock()
+  {
+    int expected = 0;
+    return _count.compare_exchange_strong(expected, -1, std::memory_order_acquire);
+  }
+  inline void lock_shared()
+  {
+    while (!try_lock_shared()) std::this_thread::yield();
+  }
+  inline void unlock_shared()
+  {
+    _count.fetch_sub(1, std::memory_order_release);
+  }
+  inline bool try_lock_shared()
+  {
+    if (_writers.load(std::memory_order_relaxed) > 0) {
+      return false;
+    }
+    int expected = _count.load(std::memory_order_relaxed);
+    if (expected < 0) {
+      return false;
+    }
+    return _count.compare_exchange_weak(expected, expected + 1, std::memory_order_acquire);
+  }
+
+public:
+  atomic_rwlock() : _count(0), _writers(0) {}
+  atomic_rwlock(const atomic_rwlock&) = delete;
+  atomic_rwlock& operator= (const atomic_rwlock&) = delete;
+};
+
+template <typename _Ty>
+class shared_unique_lock final {
+  _Ty& _mutex;
+
+public:
+  inline explicit shared_unique_lock(_Ty& mutex)
+    : _mutex(mutex) {
+    _mutex.lock_shared();
+  }
+  inline ~shared_unique_lock() {
+    _mutex.unlock_shared();
+  }
+  shared_unique_lock(const shared_unique_lock&) = delete;
+  shared_unique_lock& operator= (const shared_unique_lock&) = delete;
+};
+
+/***********************************************************************************/
+
 //#define lock_type std::mutex
 #define lock_type atomic_lock
 #define local_unique_lock std::unique_lock<lock_type>
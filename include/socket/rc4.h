@@ -25,7 +25,10 @@ public:
         reset(key, bytes);
     }
     inline rc4_encoder(){
-        reset("374315ed9864f687d6d5144167944eb8", 32);
+        reset(default_key(), 32);
+    }
+    inline static const char* default_key(){
+        return "374315ed9864f687d6d5144167944eb8";
     }
     inline void reset(const void *key, size_t bytes)
     {
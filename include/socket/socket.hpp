@@ -25,6 +25,9 @@
 
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <array>
+#include <deque>
 #include <asio.hpp> /* include asio c++ library */
 #include <os/os.h>
 
@@ -35,6 +38,9 @@
 #include "identifier.h"
 #include "decoder.h"
 #include "circular_buffer.h"
+#include "buffer_chain.h"
+#include "http_guard.h"
+#include "ktls.h"
 
 /*******************************************************************************/
 
@@ -72,16 +78,45 @@ namespace eth
 
     inline int id() const { return _id.value(); }
 
+    /* the backend asio was built with */
+    inline static const char* backend() {
+#if defined(ASIO_HAS_IOCP)
+      return "iocp";
+#elif defined(ASIO_HAS_EPOLL)
+      return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+      return "kqueue";
+#else
+      return "select";
+#endif
+    }
+
+    /* number of posted handlers not yet invoked */
+    inline size_t pending() const { return _pending.load(std::memory_order_relaxed); }
+
     template <typename Handler> inline void post(Handler&& handler) {
-      asio::post(*this, handler);
+      _pending.fetch_add(1, std::memory_order_relaxed);
+      asio::post(*this, counted_handler<typename std::decay<Handler>::type>(handler, _pending));
     }
     template <typename Handler> inline void dispatch(Handler&& handler) {
       asio::dispatch(*this, handler);
     }
 
   private:
+    template <typename Handler> struct counted_handler {
+      Handler _handler;
+      std::atomic<size_t>& _pending;
+      inline counted_handler(const Handler& handler, std::atomic<size_t>& pending)
+        : _handler(handler), _pending(pending) {
+      }
+      inline void operator()() {
+        _pending.fetch_sub(1, std::memory_order_relaxed);
+        _handler();
+      }
+    };
     const identifier _id;
     io_work_guard    _work_guard;
+    std::atomic<size_t> _pending{ 0 };
   };
 
   typedef reactor::ref reactor_type;
@@ -149,9 +184,7 @@ namespace eth
         else {
           bytes = available(_ec);
         }
-        if (_ec || bytes > 0) {
-          handler(_ec, bytes);
-        }
+        handler(_ec, bytes); /* an empty datagram is a datagram too */
         if (keep_on && !_ec) {
           async_wait(socket::wait_read, handler);
         }
@@ -378,6 +411,11 @@ namespace eth
         return parent::receive_from(buffer(buf, size), peer, 0, ec);
       }
 
+      size_t available(error_code& ec) const
+      {
+        return parent::available(ec);
+      }
+
       void async_send(const std::string& data)
       {
         async_send(data, [](const error_code&, size_t) {});
@@ -499,6 +537,8 @@ namespace eth
       typedef ip::tcp::socket parent;
       typedef ssl::stream<parent&> ssl_stream;
       ssl_stream *_stream;
+      SSL        *_native; /* session on the descriptor, for kernel tls */
+      bool        _ktls;   /* asked for kernel tls */
 
       template <typename Handler>
       inline void handshake(Handler&& handler)
@@ -510,53 +550,272 @@ namespace eth
         );
       }
 
+      /* the reason of a failed native call, 0 is would block on what */
+      int native_error(int result, error_code& ec, wait_type& what)
+      {
+        int reason = SSL_get_error(_native, result);
+        if (reason == SSL_ERROR_WANT_READ) {
+          what = wait_read;
+          return 0;
+        }
+        if (reason == SSL_ERROR_WANT_WRITE) {
+          what = wait_write;
+          return 0;
+        }
+        if (reason == SSL_ERROR_ZERO_RETURN) {
+          ec = error::eof;
+        }
+        else if (reason == SSL_ERROR_SYSCALL && errno) {
+          ec = error_code(errno, asio::error::get_system_category());
+        }
+        else if (reason == SSL_ERROR_SYSCALL) {
+          ec = error::eof;
+        }
+        else {
+          ec = error_code((int)ERR_get_error(), asio::error::get_ssl_category());
+        }
+        ERR_clear_error();
+        return reason;
+      }
+
+      template <typename Handler>
+      void native_handshake(Handler handler)
+      {
+        error_code ec;
+        wait_type what;
+        ERR_clear_error();
+        int result = SSL_do_handshake(_native);
+        if (result == 1 || native_error(result, ec, what)) {
+          post(get_executor(), std::bind([handler](const error_code& ec) { handler(ec); }, ec));
+          return;
+        }
+        parent::async_wait(what, [this, handler](const error_code& ec) {
+          ec ? handler(ec) : native_handshake(handler);
+        });
+      }
+
+      template <typename Handler>
+      void native_read(mutable_buffer buf, Handler handler)
+      {
+        error_code ec;
+        wait_type what;
+        ERR_clear_error();
+        int result = SSL_read(_native, buf.data(), (int)buf.size());
+        if (result > 0 || native_error(result, ec, what)) {
+          size_t n = result > 0 ? (size_t)result : 0;
+          post(get_executor(), std::bind([handler](const error_code& ec, size_t n) { handler(ec, n); }, ec, n));
+          return;
+        }
+        parent::async_wait(what, [this, buf, handler](const error_code& ec) {
+          ec ? handler(ec, 0) : native_read(buf, handler);
+        });
+      }
+
+      template <typename Handler>
+      void native_write(std::shared_ptr<std::vector<const_buffer>> bufs, size_t index, size_t sent, Handler handler)
+      {
+        error_code ec;
+        wait_type what;
+        for (; index < bufs->size(); index++)
+        {
+          const_buffer& buf = (*bufs)[index];
+          if (buf.size() == 0) {
+            continue;
+          }
+          ERR_clear_error();
+          int result = SSL_write(_native, buf.data(), (int)buf.size());
+          if (result > 0) {
+            sent += (size_t)result;
+            continue;
+          }
+          if (native_error(result, ec, what)) {
+            break;
+          }
+          parent::async_wait(what, [this, bufs, index, sent, handler](const error_code& ec) {
+            ec ? handler(ec, sent) : native_write(bufs, index, sent, handler);
+          });
+          return;
+        }
+        post(get_executor(), std::bind([handler](const error_code& ec, size_t n) { handler(ec, n); }, ec, sent));
+      }
+
+      /* blocking use of the native session, waits when it would block */
+      template <typename Operation>
+      int native_sync(Operation op, error_code& ec)
+      {
+        for (;;)
+        {
+          wait_type what;
+          ERR_clear_error();
+          int result = op();
+          if (result > 0 || native_error(result, ec, what)) {
+            return result;
+          }
+          parent::wait(what, ec);
+          if (ec) {
+            return -1;
+          }
+        }
+      }
+
     public:
       template <typename ExecutionContext>
       inline explicit socket(ExecutionContext& context)
         : parent(context)
-        , _stream(nullptr) {
+        , _stream(nullptr)
+        , _native(nullptr)
+        , _ktls(false) {
       }
 
       virtual ~socket() {
         delete _stream;
+        if (_native) {
+          SSL_free(_native);
+        }
       }
 
       inline SSL* ssl_handle() const {
-        return _stream ? _stream->native_handle() : nullptr;
+        return _stream ? _stream->native_handle() : _native;
+      }
+
+      /* before ssl_enable, fall back to the asio stream when unsupported */
+      inline void ktls_enable(bool enable) {
+        _ktls = enable;
+      }
+
+      /* the kernel encrypts what is sent, files can go out with sendfile */
+      inline bool ktls_send() const {
+#ifdef KTLS_ENABLE
+        return _native && BIO_get_ktls_send(SSL_get_wbio(_native));
+#else
+        return false;
+#endif
+      }
+
+      inline bool ktls_recv() const {
+#ifdef KTLS_ENABLE
+        return _native && BIO_get_ktls_recv(SSL_get_rbio(_native));
+#else
+        return false;
+#endif
+      }
+
+      /* sent bytes are the bytes on the wire, no user space encryption */
+      inline bool plain_send() const {
+        return !_stream && (!_native || ktls_send());
       }
 
       inline void ssl_enable(ssl_context& sslctx) {
+#ifdef KTLS_ENABLE
+        if (_ktls && ktls::supported() && is_open())
+        {
+          _native = SSL_new(sslctx.native_handle());
+          if (_native)
+          {
+            error_code ec;
+            parent::native_non_blocking(true, ec);
+            SSL_set_fd(_native, (int)parent::native_handle());
+            SSL_set_options(_native, SSL_OP_ENABLE_KTLS);
+            SSL_set_mode(_native, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            SSL_set_cipher_list(_native, ktls::ciphers);
+            return;
+          }
+        }
+#endif
         _stream = new ssl_stream(*this, sslctx);
       }
 
       inline void handshake(handshake_type type, error_code& ec) {
+        if (_native) {
+          type == ssl::stream_base::client ? SSL_set_connect_state(_native) : SSL_set_accept_state(_native);
+          native_sync([this]() { return SSL_do_handshake(_native); }, ec);
+          return;
+        }
         _stream ? _stream->handshake(type, ec) : ec.clear();
       }
 
       template <typename Handler>
       inline void async_handshake(handshake_type type, Handler&& handler) {
+        if (_native) {
+          type == ssl::stream_base::client ? SSL_set_connect_state(_native) : SSL_set_accept_state(_native);
+          native_handshake(std::function<void(const error_code&)>(handler));
+          return;
+        }
         _stream ? _stream->async_handshake(type, handler) : handshake(handler);
       }
 
       template <typename MutableBuffers>
       inline size_t receive(const MutableBuffers& buffers, int flag, error_code& ec) {
+        if (_native) {
+          mutable_buffer buf = *buffer_sequence_begin(buffers);
+          int n = native_sync([this, buf]() { return SSL_read(_native, buf.data(), (int)buf.size()); }, ec);
+          return n > 0 ? (size_t)n : 0;
+        }
         return _stream ? _stream->read_some(buffers, ec) : read_some(buffers, ec);
       }
 
       template <typename MutableBuffers, typename Handler>
       inline void async_receive(const MutableBuffers& buffers, Handler&& handler) {
+        if (_native) {
+          native_read(*buffer_sequence_begin(buffers), std::function<void(const error_code&, size_t)>(handler));
+          return;
+        }
         _stream ? _stream->async_read_some(buffers, handler) : async_read_some(buffers, handler);
       }
 
       template <typename MutableBuffers>
       inline size_t send(const MutableBuffers& buffers, int flag, error_code& ec) {
+        if (_native) {
+          size_t sent = 0;
+          for (auto iter = buffer_sequence_begin(buffers); iter != buffer_sequence_end(buffers) && !ec; ++iter) {
+            const_buffer buf = *iter;
+            if (buf.size() > 0) {
+              int n = native_sync([this, buf]() { return SSL_write(_native, buf.data(), (int)buf.size()); }, ec);
+              sent += n > 0 ? (size_t)n : 0;
+            }
+          }
+          return sent;
+        }
         return _stream ? write(*_stream, buffers, ec) : write(*this, buffers, ec);
       }
 
       template <typename MutableBuffers, typename Handler>
       inline void async_send(const MutableBuffers& buffers, Handler&& handler) {
+        if (_native) {
+          auto bufs = std::make_shared<std::vector<const_buffer>>(buffer_sequence_begin(buffers), buffer_sequence_end(buffers));
+          native_write(bufs, 0, 0, std::function<void(const error_code&, size_t)>(handler));
+          return;
+        }
         _stream ? async_write(*_stream, buffers, handler) : async_write(*this, buffers, handler);
       }
+
+      /* one non blocking sendfile, only when plain_send() */
+      inline size_t send_file(int fd, uint64_t& offset, size_t size, error_code& ec) {
+        int err = 0;
+        size_t n = 0;
+#ifdef KTLS_ENABLE
+        if (_native)
+        {
+          ERR_clear_error();
+          ossl_ssize_t r = SSL_sendfile(_native, fd, (off_t)offset, size, 0);
+          if (r > 0) {
+            offset += (uint64_t)r;
+            return (size_t)r;
+          }
+          err = (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? EAGAIN : (errno ? errno : EIO);
+          ERR_clear_error();
+        }
+        else
+#endif
+        n = ktls::sendfile((int)parent::native_handle(), fd, offset, size, err);
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+          ec = error::would_block;
+        }
+        else if (err) {
+          ec = error_code(err, asio::error::get_system_category());
+        }
+        return n;
+      }
     };
 #else
     enum struct handshake_type {
@@ -597,6 +856,22 @@ namespace eth
       inline void async_send(const MutableBuffers& buffers, Handler&& handler) {
         async_write(*this, buffers, handler);
       }
+
+      inline bool plain_send() const {
+        return true;
+      }
+
+      inline size_t send_file(int fd, uint64_t& offset, size_t size, error_code& ec) {
+        int err = 0;
+        size_t n = ktls::sendfile((int)parent::native_handle(), fd, offset, size, err);
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+          ec = error::would_block;
+        }
+        else if (err) {
+          ec = error_code(err, asio::error::get_system_category());
+        }
+        return n;
+      }
     };
 #endif
   } //end of namespace tls
@@ -622,6 +897,13 @@ namespace eth
       typedef tls::socket parent;
       typedef std::shared_ptr<socket> ref;
 
+      struct file_part {
+        FILE*    fp;
+        uint64_t offset;
+        size_t   size;
+        size_t   ahead; /* queued bytes which go out before it */
+      };
+
       inline explicit socket(reactor_type ios)
         : parent(*ios)
         , _timer(*ios)
@@ -630,10 +912,11 @@ namespace eth
         , _tmsend  (0)
         , _tmrecv  (0)
         , _expires (0)
-        , _widx    (0)
+        , _rdata  (_recved)
         , _asyned (false)
         , _closed (false)
-        , _sending(false) {
+        , _sending(false)
+        , _ticking(false) {
       }
 #if 0
       inline socket& operator=(socket&& r) noexcept
@@ -650,9 +933,18 @@ namespace eth
         return ref(new socket(ios));
       }
 
-      inline circular_buffer& cache(int index)
+      inline buffer_chain& cache()
       {
-        return _buffers[index];
+        return _buffers;
+      }
+
+      inline size_t queued() const
+      {
+        size_t n = _buffers.size();
+        for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
+          n += iter->size;
+        }
+        return n;
       }
 
       void shutdown(bool linger)
@@ -665,7 +957,7 @@ namespace eth
           _acceptor = 0;
           return;
         }
-        if (_expires > 0) {
+        if (_ticking) {
           _timer.cancel();
         }
         if (_sending && linger)
@@ -715,11 +1007,43 @@ namespace eth
       void on_wait(const error_code& ec, size_t n, bool keep_on, handler_t handler)
       {
         _tmrecv = 0;
+        _rdata  = _recved;
+        std::unique_ptr<http_guard> done; /* _rdata may point into it */
+        if (!ec && _guard)
+        {
+          int status = _guard->feed(_recved, n, os::milliseconds(), _rdata, n);
+          if (status != http_guard::ok) {
+            handler(reject(status), 0);
+            return;
+          }
+          if (n == 0) { /* headers incomplete, nothing to hand over */
+            if (keep_on) {
+              async_wait(socket::wait_read, handler);
+            }
+            return;
+          }
+          if (_guard->passthrough()) {
+            done = std::move(_guard);
+          }
+        }
         handler(ec, n);
         if (keep_on && !ec) {
           async_wait(socket::wait_read, handler);
         }
       }
+
+      /* answer a request which broke the limits and close after it is sent */
+      error_code reject(int status)
+      {
+        char response[160];
+        int size = snprintf(response, sizeof(response),
+          "HTTP/1.1 %d %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", status, http_guard::reason(status)
+        );
+        _guard.reset();
+        enqueue(response, (size_t)size, [](const error_code&, size_t) {});
+        shutdown(true);
+        return status == http_guard::timeout ? error::timed_out : error::message_size;
+      }
       /*
       void dequeue(const error_code& ec, bool keep_on, handler_t handler)
       {
@@ -734,13 +1058,16 @@ namespace eth
       */
       void enqueue(const char* data, size_t size, handler_t handler)
       {
-        size_t n = cache(_widx).write(data, size);
+        if (_guard) {
+          _guard->on_response(data, size, os::milliseconds());
+        }
+        size_t n = cache().write(data, size);
         if (n != size) {
           shutdown(false);
           return;
         }
         if (!_sending) {
-          flush(0, _widx, handler);
+          flush(0, handler);
           return;
         }
         if (os::milliseconds() - _tmsend > async_send_timeout) {
@@ -753,26 +1080,118 @@ namespace eth
         enqueue(data.c_str(), data.size(), handler);
       }
 
+      /* queue a file behind the pending bytes, the kernel copies it if it can */
+      void write_file(FILE* fp, uint64_t offset, size_t size, handler_t handler)
+      {
+        if (!is_open()) {
+          fclose(fp);
+          return;
+        }
+        if (!ktls::has_sendfile() || !parent::plain_send())
+        {
+          /* encrypted in user space, the bytes have to pass through here */
+          char data[8192];
+          fseek(fp, (long)offset, SEEK_SET);
+          while (size > 0)
+          {
+            size_t n = fread(data, 1, size < sizeof(data) ? size : sizeof(data), fp);
+            if (n == 0) {
+              break;
+            }
+            if (cache().write(data, n) != n) {
+              fclose(fp);
+              shutdown(false);
+              return;
+            }
+            size -= n;
+          }
+          fclose(fp);
+          if (!_sending) {
+            flush(0, handler);
+          }
+          return;
+        }
+        if (_files.empty())
+        {
+          /* sendfile runs on the raw descriptor, it must not stall the reactor */
+          error_code ec;
+          parent::native_non_blocking(true, ec);
+        }
+        file_part part;
+        part.fp     = fp;
+        part.offset = offset;
+        part.size   = size;
+        part.ahead  = cache().size();
+        _files.push_back(part);
+        if (!_sending) {
+          flush(0, handler);
+        }
+      }
+
+      void send_file(handler_t handler)
+      {
+        error_code ec;
+        size_t sent = 0;
+        file_part& part = _files.front();
+        while (part.size > 0 && !ec)
+        {
+          size_t n = parent::send_file(fileno(part.fp), part.offset, part.size, ec);
+          part.size -= n;
+          sent += n;
+        }
+        _tmsend = os::milliseconds();
+        if (ec == error::would_block)
+        {
+          parent::async_wait(wait_write,
+            std::bind(&socket::on_file_ready, shared_from_this(), placeholders1, handler)
+          );
+          return;
+        }
+        fclose(part.fp);
+        _files.pop_front();
+        if (ec) {
+          handler(ec, sent);
+          shutdown(false);
+          return;
+        }
+        flush(sent, handler);
+      }
+
+      void on_file_ready(const error_code& ec, handler_t handler)
+      {
+        if (!ec) {
+          send_file(handler);
+          return;
+        }
+        if (is_open()) {
+          handler(ec, 0);
+        }
+      }
+
       void commit(const error_code& ec, size_t bytes, handler_t handler)
       {
         if (!ec)
         {
-          int index = 1 - _widx;
-          cache(index).erase(bytes);
-
-          if (!cache(index).empty()) {
-            _widx = index;
+          cache().erase(bytes);
+          for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
+            iter->ahead -= bytes;
           }
-          flush(bytes, _widx, handler);
+          flush(bytes, handler);
         }
         if (is_open()) {
           handler(ec, bytes);
         }
       }
 
-      void flush(size_t sent, int index, handler_t handler)
+      void flush(size_t sent, handler_t handler)
       {
-        size_t size = cache(index).size();
+        if (!_files.empty() && _files.front().ahead == 0)
+        {
+          _sending = true;
+          send_file(handler);
+          return;
+        }
+        size_t size = cache().size();
         if (size == 0)
         {
           _sending = false;
@@ -787,11 +1206,20 @@ namespace eth
           return;
         }
         _sending = true;
-        _widx = 1 - index;
-        size = _min_size(size, async_send_size);
+
+        /* gather write straight from the blocks, appends go behind them */
+        std::array<const_buffer, async_send_size / buffer_chain::block_size + 1> buffers;
+        size_t count = 0;
+        size_t limit = async_send_size;
+        if (!_files.empty() && _files.front().ahead < limit) {
+          limit = _files.front().ahead; /* stop where the next file goes */
+        }
+        cache().visit(limit, [&](const char* data, size_t n) {
+          buffers[count++] = buffer(data, n);
+        });
 
         parent::async_send(
-          buffer(cache(index).data(), size),
+          buffers,
           std::bind(
           &socket::commit, shared_from_this(), placeholders1, placeholders2, handler
           )
@@ -801,7 +1229,19 @@ namespace eth
 
       void on_timer(const error_code& ec, size_t interval)
       {
-        if (!ec && _expires > 0)
+        _ticking = false;
+        if (ec || !is_open()) {
+          return;
+        }
+        if (_guard)
+        {
+          int status = _guard->check(os::milliseconds());
+          if (status != http_guard::ok) {
+            reject(status); /* the pending read fails and tells the handler */
+            return;
+          }
+        }
+        if (_expires > 0)
         {
           _tmrecv += interval;
           if (_tmrecv >= _expires)
@@ -809,12 +1249,15 @@ namespace eth
             shutdown(false);
             return;
           }
+        }
+        if (_expires > 0 || _guard) {
           set_timer(interval);
         }
       }
 
       void set_timer(size_t interval)
       {
+        _ticking = true;
         _timer.expires_after(
           std::chrono::milliseconds(interval)
         );
@@ -834,14 +1277,20 @@ namespace eth
       bool               _sending;
       bool               _closed;
       bool               _asyned;
-      int                _widx;
+      bool               _ticking;
       char               _recved[8192];
-      circular_buffer    _buffers[2];
+      std::deque<file_part> _files;
+      const char*        _rdata; //what the read handler sees, _recved unless held back
+      buffer_chain       _buffers;
+      std::unique_ptr<http_guard> _guard;
 
     public:
       virtual ~socket()
       {
         delete _acceptor;
+        for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
+          fclose(iter->fp);
+        }
       }
 
       inline reactor_type service() const
@@ -893,7 +1342,7 @@ namespace eth
         if (_acceptor) {
           return;
         }
-        if (_expires == 0 && milliseconds) {
+        if (!_ticking && milliseconds) {
           set_timer(1000);
         }
         if (milliseconds < 1000) {
@@ -1048,12 +1497,27 @@ namespace eth
       size_t send(const char* data, size_t size, error_code& ec)
       {
         assert(data && size);
+        if (_guard) {
+          _guard->on_response(data, size, os::milliseconds());
+        }
         return parent::send(buffer(data, size), 0, ec);
       }
 
       const char* receive() const
       {
-        return _recved;
+        return _rdata;
+      }
+
+      /* check incoming http requests against limits before the handler */
+      inline void http_limit(const http_limits& limits)
+      {
+        if (_acceptor) {
+          return;
+        }
+        _guard.reset(new http_guard(limits, os::milliseconds()));
+        if (!_ticking) {
+          set_timer(1000);
+        }
       }
 
       size_t receive(char* buf, size_t size)
@@ -1067,7 +1531,7 @@ namespace eth
       {
         if (_asyned != false) {
           ec.clear();
-          memcpy(buf, _recved, size);
+          memcpy(buf, _rdata, size);
           return size;
         }
         return parent::receive(buffer(buf, size), 0, ec);
@@ -1133,6 +1597,15 @@ namespace eth
         );
       }
 
+      void async_send_file(FILE* fp, uint64_t offset, size_t size)
+      {
+        service()->post(
+          std::bind(
+            &socket::write_file, shared_from_this(), fp, offset, size, (handler_t)[](const error_code&, size_t) {}
+          )
+        );
+      }
+
       template <typename Handler>
       void async_send(const char* data, size_t bytes, Handler&& handler)
       {
@@ -1190,7 +1663,7 @@ namespace eth
 
   private:
     socket(reactor_type ios, family mode)
-      : _reactor(ios), _context(0), _is_server(true)
+      : _id(identifier::socket_id), _reactor(ios), _context(0), _is_server(true)
     {
       assert(ios);
       switch (mode)
@@ -1216,6 +1689,19 @@ namespace eth
       }
     }
 
+    /* out of socket ids, accept again once some sockets are closed */
+    void retry_accept(bool keep_on, Acceptor handler)
+    {
+      auto self  = shared_from_this();
+      auto timer = std::make_shared<steady_timer>(*service());
+      timer->expires_after(std::chrono::milliseconds(100));
+      timer->async_wait([self, timer, keep_on, handler](const error_code& ec) {
+        if (!ec && self->is_open()) {
+          self->async_accept(keep_on, handler);
+        }
+      });
+    }
+
     const identifier  _id;
     const void*       _context;
     reactor_type      _reactor;
@@ -1226,10 +1712,16 @@ namespace eth
     udp::socket::ref  _udp; //udp socket
 
   public:
+    /* null when every socket id is in use */
     inline static ref create(reactor_type ios, family mode)
     {
       assert(ios);
-      return ref(new socket(ios, mode));
+      try {
+        return ref(new socket(ios, mode));
+      }
+      catch (...) {
+        return ref();
+      }
     }
 #if 0
     inline ref swap(ref other)
@@ -1288,8 +1780,24 @@ namespace eth
     {
       return _tcp ? _tcp->ssl_handle() : nullptr;
     }
+    inline void ktls_enable(bool enable)
+    {
+      assert(_tcp);
+      _tcp->ktls_enable(enable);
+    }
+    inline bool ktls() const
+    {
+      return _tcp && _tcp->ktls_send();
+    }
 #endif
 
+    /* the file goes out after what is already queued, owns fp */
+    inline void async_send_file(FILE* fp, uint64_t offset, size_t size)
+    {
+      assert(_tcp);
+      _tcp->async_send_file(fp, offset, size);
+    }
+
     inline void handshake(error_code& ec)
     {
       assert(_tcp);
@@ -1311,6 +1819,15 @@ namespace eth
       return _tcp ? _tcp->native_handle() : _udp->native_handle();
     }
 
+    inline bool http_limit(const http_limits& limits)
+    {
+      if (!_tcp) {
+        return false;
+      }
+      _tcp->http_limit(limits);
+      return true;
+    }
+
     inline bool non_blocking() const
     {
       return _tcp ? _tcp->non_blocking() : _udp->non_blocking();
@@ -1535,6 +2052,12 @@ namespace eth
       return ec ? 0 : n;
     }
 
+    /* bytes accepted by async sends and not yet written to the kernel */
+    size_t queued() const
+    {
+      return _tcp ? _tcp->queued() : 0;
+    }
+
     const char* receive() const
     {
       return _tcp ? _tcp->receive() : nullptr;
@@ -1664,9 +2187,7 @@ namespace eth
     template <typename Handler>
     void async_accept(Handler&& handler)
     {
-      assert(_tcp);
-      auto peer = create(service(), family::sock_stream);
-      async_accept(peer, true, handler);
+      async_accept(true, handler);
     }
 
     //Handler: void(const error_code& /* ec */, socket_type /* peer */);
@@ -1675,6 +2196,10 @@ namespace eth
     {
       assert(_tcp);
       auto peer = create(service(), family::sock_stream);
+      if (!peer) {
+        retry_accept(keep_on, (Acceptor)handler);
+        return;
+      }
       async_accept(peer, keep_on, handler);
     }
 
@@ -1739,10 +2264,28 @@ namespace eth
 
     //Handler: void(const char* /* data */, size_t /* size */);
     template <typename Handler>
-    void encode(int opcode, const char* data, size_t size, bool encrypt, bool compress, Handler&& handler)
+    bool encode(int opcode, const char* data, size_t size, bool encrypt, bool compress, Handler&& handler)
     {
       assert(opcode);
-      _encoder.encode(opcode, data, size, encrypt, compress, handler);
+      return _encoder.encode(opcode, data, size, encrypt, compress, handler);
+    }
+
+    //eth::hash_none, eth::hash_murmur or eth::hash_crc32c
+    inline int hash() const {
+      return _encoder.hash();
+    }
+
+    inline void hash(int type) {
+      _encoder.hash(type);
+    }
+
+    //eth::cipher_rc4, eth::cipher_aes_gcm or eth::cipher_chacha20
+    inline int cipher() const {
+      return _encoder.cipher();
+    }
+
+    inline bool cipher(int type) {
+      return _encoder.cipher(type);
     }
 
     //Handler: void(const error_code& /* ec */, size_t /* size */);
@@ -190,6 +190,119 @@ static int linflategz(lua_State *L)
 	return 1;
 }
 
+#define STREAM_META "gzip.stream"
+
+/*
+** A deflate stream kept across calls, so a body produced piece by
+** piece is compressed as it goes instead of in one shot at the end.
+*/
+typedef struct {
+	z_stream z;
+	int finished;
+} zstream;
+
+static zstream* checkstream(lua_State *L)
+{
+	zstream* s = (zstream*)luaL_checkudata(L, 1, STREAM_META);
+	if (s->finished) {
+		luaL_error(L, "gzip stream already finished");
+	}
+	return s;
+}
+
+static int zstream_run(lua_State *L, zstream* s, const char* input, size_t inputsz, int flush)
+{
+	int err;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	s->z.next_in  = (const Bytef*)input;
+	s->z.avail_in = (uInt)inputsz;
+	for (;;) {
+		size_t room = LUAL_BUFFERSIZE;
+		unsigned char* output = (unsigned char*)luaL_prepbuffsize(&b, room);
+		s->z.next_out  = output;
+		s->z.avail_out = (uInt)room;
+		err = deflate(&s->z, flush);
+		if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+			return luaL_error(L, "gzip deflate error:%d", err);
+		}
+		luaL_addsize(&b, room - s->z.avail_out);
+		if (err == Z_STREAM_END) {
+			break;
+		}
+		if (s->z.avail_out != 0 && s->z.avail_in == 0) {
+			break;
+		}
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/* stream:write(data [, flush]), returns what is ready, maybe "" */
+static int lstreamwrite(lua_State *L)
+{
+	size_t inputsz;
+	zstream* s = checkstream(L);
+	const char* input = luaL_checklstring(L, 2, &inputsz);
+	int flush = lua_toboolean(L, 3) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+	return zstream_run(L, s, input, inputsz, flush);
+}
+
+/* stream:finish(), returns the tail of the stream */
+static int lstreamfinish(lua_State *L)
+{
+	zstream* s = checkstream(L);
+	zstream_run(L, s, "", 0, Z_FINISH);
+	s->finished = 1;
+	deflateEnd(&s->z);
+	return 1;
+}
+
+static int lstreamgc(lua_State *L)
+{
+	zstream* s = (zstream*)luaL_checkudata(L, 1, STREAM_META);
+	if (!s->finished) {
+		s->finished = 1;
+		deflateEnd(&s->z);
+	}
+	return 0;
+}
+
+/* gzip.stream([gzip]), the same framing as deflate(data, gzip) */
+static int lstreamgz(lua_State *L)
+{
+	int err;
+	int gzip = lua_toboolean(L, 1);
+	zstream* s = (zstream*)lua_newuserdata(L, sizeof(zstream));
+	memset(s, 0, sizeof(zstream));
+	s->z.zalloc = zmalloc;
+	s->z.zfree  = zfree;
+	s->finished = 1;
+	err = deflateInit2(&s->z,
+		  Z_BEST_SPEED,
+			Z_DEFLATED,
+			gzip ? MAX_WBITS + 16 : -MAX_WBITS,
+			MAX_MEM_LEVEL - 1,
+			Z_DEFAULT_STRATEGY);
+	if (err != Z_OK) {
+		return luaL_error(L, "gzip deflateInit2 error:%d", err);
+	}
+	s->finished = 0;
+	if (luaL_newmetatable(L, STREAM_META)) {
+		luaL_Reg methods[] = {
+			{"write",  lstreamwrite},
+			{"finish", lstreamfinish},
+			{NULL, NULL},
+		};
+		luaL_newlib(L, methods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lstreamgc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
 LUALIB_API int luaopen_gzip(lua_State* L)
 {
     luaL_checkversion(L);
@@ -201,5 +314,7 @@ LUALIB_API int luaopen_gzip(lua_State* L)
 	luaL_checkversion(L);
 	luaL_newlibtable(L, tbl);
 	setfuncswithbuffer(L, tbl);
+	lua_pushcfunction(L, lstreamgz);
+	lua_setfield(L, -2, "stream");
 	return 1;
 }
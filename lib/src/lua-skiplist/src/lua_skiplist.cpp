@@ -69,6 +69,7 @@ end
 #include <lua.hpp>
 
 #include "skiplist/skiplist.h"
+#include "lua_zset.h"
 
 #if LUA_VERSION_NUM < 502
 # ifndef luaL_newlib
@@ -802,9 +803,11 @@ extern "C" int luaopen_skiplist(lua_State* L)
   luaL_checkversion(L);
   luaL_Reg lfuncs[] = {
     { "new",    lua__new  },
+    { "zset",   lua__zset_new },
     { NULL,     NULL      },
   };
   opencls__skiplist(L);
+  opencls__zset(L);
   luaL_newlib(L, lfuncs);
   lua_pushnumber(L, EPSILON);
   lua_setfield(L, -2, "EPSILON");
@@ -0,0 +1,667 @@
+
+
+/*
+local skiplist = require("skiplist")
+
+local board = skiplist.zset(true)   -- descending, number scores
+local level = skiplist.zset(true, true) -- descending, integer scores
+
+board:insert("tom", 98.5)
+board:insert(10086, 77)
+board:insert_many({ jack = 60, rose = 99 })
+board:incr("jack", 5)
+
+print(board:rank_of("tom"), board:get_score("tom"))
+print(board:get_by_rank(1))
+
+for rank, member, score in board:range_by_rank(1, 10) do
+	print("top", rank, member, score)
+end
+for rank, member, score in board:range_by_score(90, 60) do
+	print("between", rank, member, score)
+end
+
+board:delete("tom")
+board:del_by_rank_range(3, #board)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <lua.hpp>
+
+#include "lua_zset.h"
+#include "skiplist/skiplist.h"
+
+#define CLASS_ZSET "cls{zset}"
+#define CHECK_ZSET(L, n) ((zset_t *)luaL_checkudata(L, n, CLASS_ZSET))
+
+#define ZSET_BUCKETS 16
+
+/*
+** A sorted set of (member, score) pairs. Members are integers or strings,
+** scores are numbers or, for integer sets, exact 64-bit integers. Nodes are
+** ordered by score and then by member, all comparisons stay in C. Each node
+** carries its member in the same allocation, and an intrusive hash index
+** maps members to nodes.
+*/
+
+typedef struct zmember_s {
+  struct zmember_s* chain;  /* next member in the same bucket */
+  slNode_t* node;
+  size_t hash;
+  long long iscore;         /* exact score of integer sets */
+  size_t len;               /* key length, 0 for integer members */
+  int isint;
+  union {
+    lua_Integer i;
+    char s[1];
+  } key;
+} zmember_t;
+
+typedef struct zset_s {
+  sl_t sl;                  /* must be first, the comparator casts back */
+  int desc;
+  int integer;
+  unsigned int version;     /* changed by every write, checked by iterators */
+  zmember_t** buckets;
+  size_t nbucket;
+} zset_t;
+
+typedef struct zkey_s {
+  int isint;
+  lua_Integer i;
+  const char* s;
+  size_t len;
+  size_t hash;
+} zkey_t;
+
+typedef struct zscore_s {
+  double d;
+  long long i;
+} zscore_t;
+
+/***********************************************************************************/
+
+static size_t zhash_int(lua_Integer v)
+{
+  unsigned long long x = (unsigned long long)v;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (size_t)x;
+}
+
+static size_t zhash_str(const char* s, size_t len)
+{
+  unsigned long long x = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    x ^= (unsigned char)s[i];
+    x *= 0x100000001b3ULL;
+  }
+  return (size_t)x;
+}
+
+static int zto_key(lua_State* L, int idx, zkey_t* k)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNUMBER:
+    if (!lua_isinteger(L, idx))
+      return 0;
+    k->isint = 1;
+    k->i = lua_tointeger(L, idx);
+    k->s = NULL;
+    k->len = 0;
+    k->hash = zhash_int(k->i);
+    return 1;
+  case LUA_TSTRING:
+    k->isint = 0;
+    k->i = 0;
+    k->s = lua_tolstring(L, idx, &k->len);
+    k->hash = zhash_str(k->s, k->len);
+    return 1;
+  }
+  return 0;
+}
+
+static void zcheck_key(lua_State* L, int idx, zkey_t* k)
+{
+  luaL_argcheck(L, zto_key(L, idx, k), idx, "integer|string member required");
+}
+
+static int zto_score(lua_State* L, const zset_t* zs, int idx, zscore_t* s)
+{
+  if (zs->integer) {
+    int isnum = 0;
+    s->i = lua_tointegerx(L, idx, &isnum);
+    s->d = (double)s->i;
+    return isnum;
+  }
+  int isnum = 0;
+  s->d = lua_tonumberx(L, idx, &isnum);
+  s->i = 0;
+  return isnum && s->d == s->d;
+}
+
+static void zcheck_score(lua_State* L, const zset_t* zs, int idx, zscore_t* s)
+{
+  luaL_argcheck(L, zto_score(L, zs, idx, s), idx, zs->integer ? "integer score required" : "number score required");
+}
+
+static void zpush_member(lua_State* L, const slNode_t* node)
+{
+  const zmember_t* m = (const zmember_t*)node->udata;
+  if (m->isint)
+    lua_pushinteger(L, m->key.i);
+  else
+    lua_pushlstring(L, m->key.s, m->len);
+}
+
+static void zpush_score(lua_State* L, const zset_t* zs, const slNode_t* node)
+{
+  if (zs->integer)
+    lua_pushinteger(L, ((const zmember_t*)node->udata)->iscore);
+  else
+    lua_pushnumber(L, node->score);
+}
+
+/***********************************************************************************/
+
+/* order of a node against a score, in the direction of the set */
+static int zcompare_score(const zset_t* zs, const slNode_t* node, const zscore_t* s)
+{
+  int c;
+  if (zs->integer) {
+    long long v = ((const zmember_t*)node->udata)->iscore;
+    c = v < s->i ? -1 : (v > s->i);
+  }
+  else {
+    c = node->score < s->d ? -1 : (node->score > s->d);
+  }
+  return zs->desc ? -c : c;
+}
+
+static int zcompare_member(const zmember_t* a, const zmember_t* b)
+{
+  if (a->isint != b->isint)
+    return a->isint ? -1 : 1;
+  if (a->isint)
+    return a->key.i < b->key.i ? -1 : (a->key.i > b->key.i);
+  int c = memcmp(a->key.s, b->key.s, a->len < b->len ? a->len : b->len);
+  if (c != 0)
+    return c < 0 ? -1 : 1;
+  return a->len < b->len ? -1 : (a->len > b->len);
+}
+
+static int zcompare(slNode_t* nodeA, slNode_t* nodeB, sl_t* sl, void* ctx)
+{
+  (void)ctx;
+  const zmember_t* mb = (const zmember_t*)nodeB->udata;
+  zscore_t s = { nodeB->score, mb->iscore };
+  int c = zcompare_score((const zset_t*)sl, nodeA, &s);
+  return c != 0 ? c : zcompare_member((const zmember_t*)nodeA->udata, mb);
+}
+
+/* first node not before the score, or after it when strict, with its rank */
+static slNode_t* zseek(zset_t* zs, const zscore_t* s, int strict, int* rank)
+{
+  int i, c;
+  int traversed = 0;
+  sl_t* sl = &zs->sl;
+  slNode_t* p = SL_HEAD(sl);
+  for (i = sl->level - 1; i >= 0; i--) {
+    while (p->level[i].next != NULL) {
+      c = zcompare_score(zs, p->level[i].next, s);
+      if (c > 0 || (c == 0 && !strict))
+        break;
+      traversed += (int)p->level[i].span;
+      p = p->level[i].next;
+    }
+  }
+  *rank = traversed + 1;
+  return SL_NEXT(p);
+}
+
+/***********************************************************************************/
+
+static zmember_t** zfind_slot(zset_t* zs, const zkey_t* k)
+{
+  zmember_t** p = &zs->buckets[k->hash & (zs->nbucket - 1)];
+  for (; *p != NULL; p = &(*p)->chain) {
+    const zmember_t* m = *p;
+    if (m->hash != k->hash || m->isint != k->isint)
+      continue;
+    if (k->isint ? m->key.i == k->i : (m->len == k->len && memcmp(m->key.s, k->s, k->len) == 0))
+      break;
+  }
+  return p;
+}
+
+static zmember_t* zfind(zset_t* zs, const zkey_t* k)
+{
+  return *zfind_slot(zs, k);
+}
+
+static void zunlink(zset_t* zs, zmember_t* m)
+{
+  zmember_t** p = &zs->buckets[m->hash & (zs->nbucket - 1)];
+  while (*p != m)
+    p = &(*p)->chain;
+  *p = m->chain;
+}
+
+static void zrehash(zset_t* zs)
+{
+  size_t i, n = zs->nbucket * 2;
+  zmember_t** buckets = (zmember_t**)calloc(n, sizeof(zmember_t*));
+  if (buckets == NULL)
+    return; /* keep the old table, chains just get longer */
+  for (i = 0; i < zs->nbucket; i++) {
+    zmember_t* m = zs->buckets[i];
+    while (m != NULL) {
+      zmember_t* next = m->chain;
+      zmember_t** b = &buckets[m->hash & (n - 1)];
+      m->chain = *b;
+      *b = m;
+      m = next;
+    }
+  }
+  free(zs->buckets);
+  zs->buckets = buckets;
+  zs->nbucket = n;
+}
+
+static void zfree_cb(void* udata, void* ctx)
+{
+  zunlink((zset_t*)ctx, (zmember_t*)udata);
+}
+
+/* node, member and key in one block, slFreeNode releases all of it */
+static slNode_t* zcreate_node(const zkey_t* k, const zscore_t* s)
+{
+  int i;
+  int level = slRandomLevel();
+  size_t nodesz = sizeof(slNode_t) + sizeof(struct levelNode_s) * (level - 1);
+  size_t keysz = k->isint ? sizeof(lua_Integer) : k->len + 1;
+  size_t memsz = offsetof(zmember_t, key) + (keysz > sizeof(lua_Integer) ? keysz : sizeof(lua_Integer));
+  nodesz = (nodesz + 7) & ~(size_t)7;
+
+  slNode_t* node = (slNode_t*)malloc(nodesz + memsz);
+  if (node == NULL)
+    return NULL;
+
+  zmember_t* m = (zmember_t*)((char*)node + nodesz);
+  node->score = s->d;
+  node->udata = m;
+  node->prev = NULL;
+  node->levelSize = level;
+  for (i = 0; i < level; i++) {
+    node->level[i].next = NULL;
+    node->level[i].span = 0;
+  }
+  m->chain = NULL;
+  m->node = node;
+  m->hash = k->hash;
+  m->iscore = s->i;
+  m->len = k->len;
+  m->isint = k->isint;
+  if (k->isint) {
+    m->key.i = k->i;
+  }
+  else {
+    memcpy(m->key.s, k->s, k->len);
+    m->key.s[k->len] = 0;
+  }
+  return node;
+}
+
+/* 1 inserted, 0 updated, -1 no memory */
+static int zinsert(zset_t* zs, const zkey_t* k, const zscore_t* s)
+{
+  sl_t* sl = &zs->sl;
+  zmember_t* m = zfind(zs, k);
+  zs->version++;
+
+  if (m != NULL) {
+    slNode_t* node = m->node;
+    slNode_t* prev = SL_PREV(node);
+    slNode_t* next = SL_NEXT(node);
+    zscore_t old = { node->score, m->iscore };
+    node->score = s->d;
+    m->iscore = s->i;
+    /* still between its neighbours, nothing to move */
+    if ((prev == NULL || zcompare(prev, node, sl, NULL) < 0) &&
+        (next == NULL || zcompare(node, next, sl, NULL) < 0))
+      return 0;
+    node->score = old.d;
+    m->iscore = old.i;
+    slDeleteNode(sl, node, NULL, &node);
+    node->score = s->d;
+    m->iscore = s->i;
+    slInsertNode(sl, node, NULL);
+    return 0;
+  }
+
+  slNode_t* node = zcreate_node(k, s);
+  if (node == NULL)
+    return -1;
+
+  if (sl->size >= zs->nbucket)
+    zrehash(zs);
+
+  zmember_t** b = &zs->buckets[k->hash & (zs->nbucket - 1)];
+  m = (zmember_t*)node->udata;
+  m->chain = *b;
+  *b = m;
+  slInsertNode(sl, node, NULL);
+  return 1;
+}
+
+static void zclear(zset_t* zs)
+{
+  slDestroy(&zs->sl, NULL, NULL);
+  slInit(&zs->sl);
+  zs->sl.comp = zcompare;
+  zs->sl.udata = NULL;
+  memset(zs->buckets, 0, zs->nbucket * sizeof(zmember_t*));
+  zs->version++;
+}
+
+/***********************************************************************************/
+
+int lua__zset_new(lua_State* L)
+{
+  zset_t* zs = (zset_t*)lua_newuserdata(L, sizeof(zset_t));
+  zs->desc = lua_toboolean(L, 1);
+  zs->integer = lua_toboolean(L, 2);
+  zs->version = 0;
+  zs->nbucket = ZSET_BUCKETS;
+  zs->buckets = (zmember_t**)calloc(zs->nbucket, sizeof(zmember_t*));
+  slInit(&zs->sl);
+  zs->sl.comp = zcompare;
+  zs->sl.udata = NULL;
+  if (zs->buckets == NULL)
+    return luaL_error(L, "no memory in lua__zset_new");
+  luaL_getmetatable(L, CLASS_ZSET);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int lua__zset_gc(lua_State* L)
+{
+  zset_t* zs = CHECK_ZSET(L, 1);
+  if (zs->buckets != NULL) {
+    slDestroy(&zs->sl, NULL, NULL);
+    free(zs->buckets);
+    zs->buckets = NULL;
+  }
+  return 0;
+}
+
+static int lua__zset_insert(lua_State* L)
+{
+  zkey_t k;
+  zscore_t s;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zcheck_key(L, 2, &k);
+  zcheck_score(L, zs, 3, &s);
+  int ret = zinsert(zs, &k, &s);
+  if (ret < 0)
+    return luaL_error(L, "no memory in lua__zset_insert");
+  lua_pushboolean(L, ret);
+  return 1;
+}
+
+static int lua__zset_insert_many(lua_State* L)
+{
+  zkey_t k;
+  zscore_t s;
+  lua_Integer count = 0;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+    if (!zto_key(L, -2, &k))
+      return luaL_error(L, "integer|string member required, got %s", luaL_typename(L, -2));
+    if (!zto_score(L, zs, -1, &s))
+      return luaL_error(L, "%s score required, got %s", zs->integer ? "integer" : "number", luaL_typename(L, -1));
+    int ret = zinsert(zs, &k, &s);
+    if (ret < 0)
+      return luaL_error(L, "no memory in lua__zset_insert_many");
+    count += ret;
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static int lua__zset_incr(lua_State* L)
+{
+  zkey_t k;
+  zscore_t s;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zcheck_key(L, 2, &k);
+  zcheck_score(L, zs, 3, &s);
+  zmember_t* m = zfind(zs, &k);
+  if (m != NULL) {
+    if (zs->integer) {
+      /* added unsigned, a sign flip against both operands is an overflow */
+      long long sum = (long long)((unsigned long long)s.i + (unsigned long long)m->iscore);
+      if (((s.i ^ sum) & (m->iscore ^ sum)) < 0)
+        return luaL_error(L, "integer overflow in lua__zset_incr");
+      s.i = sum;
+      s.d = (double)s.i;
+    }
+    else {
+      s.d += m->node->score;
+    }
+  }
+  if (zinsert(zs, &k, &s) < 0)
+    return luaL_error(L, "no memory in lua__zset_incr");
+  if (zs->integer)
+    lua_pushinteger(L, s.i);
+  else
+    lua_pushnumber(L, s.d);
+  return 1;
+}
+
+static int lua__zset_delete(lua_State* L)
+{
+  zkey_t k;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zcheck_key(L, 2, &k);
+  zmember_t** p = zfind_slot(zs, &k);
+  zmember_t* m = *p;
+  if (m == NULL) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  *p = m->chain;
+  slDeleteNode(&zs->sl, m->node, NULL, NULL);
+  zs->version++;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lua__zset_exists(lua_State* L)
+{
+  zkey_t k;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zcheck_key(L, 2, &k);
+  lua_pushboolean(L, zfind(zs, &k) != NULL);
+  return 1;
+}
+
+static int lua__zset_get_score(lua_State* L)
+{
+  zkey_t k;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zcheck_key(L, 2, &k);
+  zmember_t* m = zfind(zs, &k);
+  if (m == NULL)
+    return 0;
+  zpush_score(L, zs, m->node);
+  return 1;
+}
+
+static int lua__zset_rank_of(lua_State* L)
+{
+  zkey_t k;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zcheck_key(L, 2, &k);
+  zmember_t* m = zfind(zs, &k);
+  if (m == NULL)
+    return 0;
+  lua_pushinteger(L, slGetRank(&zs->sl, m->node, NULL));
+  return 1;
+}
+
+static int lua__zset_get_by_rank(lua_State* L)
+{
+  zset_t* zs = CHECK_ZSET(L, 1);
+  lua_Integer rank = luaL_checkinteger(L, 2);
+  if (rank <= 0 || rank > (lua_Integer)zs->sl.size)
+    return 0;
+  slNode_t* node = slGetNodeByRank(&zs->sl, (int)rank);
+  if (node == NULL)
+    return 0;
+  zpush_member(L, node);
+  zpush_score(L, zs, node);
+  return 2;
+}
+
+static int lua__zset_del_rank_range(lua_State* L)
+{
+  zset_t* zs = CHECK_ZSET(L, 1);
+  int size = (int)zs->sl.size;
+  int imin = (int)luaL_checkinteger(L, 2);
+  int imax = (int)luaL_optinteger(L, 3, imin);
+  luaL_argcheck(L, 1 <= imin && imin <= size, 2, "min [1, size]");
+  luaL_argcheck(L, imin <= imax && imax <= size, 3, "max [min, size]");
+  int n = slDeleteByRankRange(&zs->sl, imin, imax, zfree_cb, zs);
+  zs->version++;
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+static int lua__zset_size(lua_State* L)
+{
+  zset_t* zs = CHECK_ZSET(L, 1);
+  lua_pushinteger(L, (lua_Integer)zs->sl.size);
+  return 1;
+}
+
+static int lua__zset_clear(lua_State* L)
+{
+  zset_t* zs = CHECK_ZSET(L, 1);
+  zclear(zs);
+  return 0;
+}
+
+/***********************************************************************************/
+
+/* walks the nodes in place, the set must not change until the loop ends */
+static int lua__zset_iterator(lua_State* L)
+{
+  zset_t* zs = (zset_t*)lua_touserdata(L, lua_upvalueindex(1));
+  slNode_t* node = (slNode_t*)lua_touserdata(L, lua_upvalueindex(2));
+  lua_Integer rank = lua_tointeger(L, lua_upvalueindex(3));
+  lua_Integer last = lua_tointeger(L, lua_upvalueindex(4));
+  if (node == NULL || rank > last)
+    return 0;
+  if ((unsigned int)lua_tointeger(L, lua_upvalueindex(5)) != zs->version)
+    return luaL_error(L, "zset changed during iteration");
+
+  lua_pushlightuserdata(L, (void*)SL_NEXT(node));
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushinteger(L, rank + 1);
+  lua_replace(L, lua_upvalueindex(3));
+
+  lua_pushinteger(L, rank);
+  zpush_member(L, node);
+  zpush_score(L, zs, node);
+  return 3;
+}
+
+static int zpush_iterator(lua_State* L, zset_t* zs, slNode_t* node, int first, int last)
+{
+  lua_pushvalue(L, 1);
+  lua_pushlightuserdata(L, (void*)node);
+  lua_pushinteger(L, first);
+  lua_pushinteger(L, last);
+  lua_pushinteger(L, zs->version);
+  lua_pushcclosure(L, lua__zset_iterator, 5);
+  return 1;
+}
+
+static int lua__zset_range_by_rank(lua_State* L)
+{
+  zset_t* zs = CHECK_ZSET(L, 1);
+  int size = (int)zs->sl.size;
+  lua_Integer first = luaL_optinteger(L, 2, 1);
+  lua_Integer last = luaL_optinteger(L, 3, size);
+  if (first < 1)
+    first = 1;
+  if (last > size)
+    last = size;
+  slNode_t* node = NULL;
+  if (first <= last)
+    node = slGetNodeByRank(&zs->sl, (int)first);
+  return zpush_iterator(L, zs, node, (int)first, (int)last);
+}
+
+/* from and to follow the order of the set, from >= to when descending */
+static int lua__zset_range_by_score(lua_State* L)
+{
+  zscore_t s;
+  zset_t* zs = CHECK_ZSET(L, 1);
+  int first = 1;
+  int last = (int)zs->sl.size;
+  slNode_t* node = zs->sl.head.level[0].next;
+  if (!lua_isnoneornil(L, 2)) {
+    zcheck_score(L, zs, 2, &s);
+    node = zseek(zs, &s, 0, &first);
+  }
+  if (!lua_isnoneornil(L, 3)) {
+    zcheck_score(L, zs, 3, &s);
+    zseek(zs, &s, 1, &last);
+    last--;
+  }
+  return zpush_iterator(L, zs, node, first, last);
+}
+
+/***********************************************************************************/
+
+int opencls__zset(lua_State* L)
+{
+  luaL_Reg lmethods[] = {
+    {"insert",            lua__zset_insert          },
+    {"insert_many",       lua__zset_insert_many     },
+    {"incr",              lua__zset_incr            },
+    {"delete",            lua__zset_delete          },
+    {"exists",            lua__zset_exists          },
+    {"get_score",         lua__zset_get_score       },
+    {"rank_of",           lua__zset_rank_of         },
+    {"get_by_rank",       lua__zset_get_by_rank     },
+    {"del_by_rank_range", lua__zset_del_rank_range  },
+    {"range_by_rank",     lua__zset_range_by_rank   },
+    {"range_by_score",    lua__zset_range_by_score  },
+    {"size",              lua__zset_size            },
+    {"clear",             lua__zset_clear           },
+    {NULL,                NULL                      },
+  };
+  luaL_newmetatable(L, CLASS_ZSET);
+  luaL_newlib(L, lmethods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, lua__zset_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, lua__zset_size);
+  lua_setfield(L, -2, "__len");
+  lua_pop(L, 1);
+  return 0;
+}
+
+/***********************************************************************************/
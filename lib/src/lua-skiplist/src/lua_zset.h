@@ -0,0 +1,11 @@
+
+#pragma once
+
+#include <lua.hpp>
+
+/***********************************************************************************/
+
+int opencls__zset(lua_State* L);
+int lua__zset_new(lua_State* L);
+
+/***********************************************************************************/
@@ -128,6 +128,19 @@ local luaos = {
         return os.pid();
     end,
     
+    ---获取 I/O 后端名称("epoll", "iocp", "kqueue"...)
+    ---@return string
+    backend = function()
+        return os.backend();
+    end,
+    
+    ---不带参数时返回当前线程可运行的 CPU 列表, 否则将当前线程绑定到指定 CPU
+    ---@param cpu integer|integer[]
+    ---@return boolean|integer[]
+    affinity = function(cpu)
+        return os.affinity(cpu);
+    end,
+    
     ---获取雪花码
     ---@param uid integer|nil
     ---@return integer
@@ -152,19 +165,31 @@ local luaos = {
     end,
     
     ---执行一个 lua 模块
+    ---最后一个参数如果是 luaos.options 返回的 table, 则作为启动选项,
+    ---其他 table 都原样传给模块
     ---@param name string
     ---@return luaos_job
     start = function(name, ...)
         return os.start(name, ...);
     end,
     
+    ---标记 start 的启动选项:
+    ---{cpu = n | {n1, n2}, priority = "low"|"normal"|"high"}
+    ---@param options table
+    ---@return table
+    options = function(options)
+        return os.options(options);
+    end,
+    
     ---优雅退出当前 lua 模块运行
     exit = function()
         return os.exit();
     end,
     
     ---等待系统消息,返回执行的消息数量
-    ---@param timeout integer
+    ---timeout 也可以是 table: {timeout=毫秒, mode="spin"|"block", spin_us=50, cpu=n}
+    ---mode 为 spin 时空闲 spin_us 微秒内忙轮询, 之后再阻塞等待; cpu 绑定当前线程
+    ---@param timeout integer|table
     ---@return integer
     wait = function(timeout)
         return os.wait(timeout or -1);
@@ -176,6 +201,68 @@ local luaos = {
         return os.stopped();
     end,
     
+    ---设置当前模块的卡死检测时间(毫秒, 0 表示不检测), 返回原来的设置
+    ---@param timeout integer
+    ---@param interrupt boolean 超时后是否中断运行(默认 true)
+    ---@return integer
+    watchdog = function(timeout, interrupt)
+        return os.watchdog(timeout, interrupt);
+    end,
+    
+    ---CPU 采样分析(输出 flamegraph 兼容的 folded stacks)
+    profile = {
+        ---开始采样指定模块(默认当前模块)
+        ---@param id integer
+        ---@param hz integer 采样频率(默认 100)
+        ---@return boolean
+        start = function(id, hz)
+            return os.profile.start(id, hz);
+        end,
+        
+        ---停止采样, 返回 folded stacks 和采样总数
+        ---@param id integer
+        ---@return string,integer
+        stop = function(id)
+            return os.profile.stop(id);
+        end,
+    },
+    
+    ---在公共线程池中执行耗时的原生函数, 结果通过 callback(ok, ...) 返回到当前模块
+    ---name 如 "openssl.hash.sha256", "msgpack.encode", "rapidjson.decode"
+    ---@param name string
+    ---@return boolean
+    async = function(name, ...)
+        return os.async(name, ...);
+    end,
+    
+    ---异步打开文件, 读写在独立的 I/O 线程中执行, 结果通过回调返回到当前模块
+    ---方法: read([size [, offset]], callback(ec, data)), write(data [, offset] [, callback(ec, bytes)]),
+    ---append(data [, callback(ec, bytes)]), flush([callback(ec)]), fsync([callback(ec)]),
+    ---stat(callback(ec, info)), close([callback(ec)])
+    ---@param filename string
+    ---@param mode string 同 io.open, 默认 "rb"
+    ---@param callback fun(ec:integer)|nil 打开完成时调用
+    ---@return userdata
+    file = function(filename, mode, callback)
+        return os.file(filename, mode, callback);
+    end,
+    
+    ---打开一个跨模块的有界队列(按名称全局共享, 首次打开时确定容量)
+    ---方法: push, push_batch, try_pop, try_pop_batch, pop(callback), size, capacity, stats
+    ---@param name string
+    ---@param capacity integer 默认 1024
+    ---@return userdata
+    queue = function(name, capacity)
+        return os.queue(name, capacity);
+    end,
+    
+    ---获取所有模块的运行统计(计数器, 队列深度, 内存, 延迟分布)
+    ---@param format string "table"(默认) 或 "prometheus"
+    ---@return table|string
+    stats = function(format)
+        return os.stats(format);
+    end,
+    
     ---发布一个系统消息(跨模块)
     ---@param topic integer
     ---@param mask integer
@@ -246,9 +333,18 @@ luaos.rpcall = setmetatable({
     ---注册一个 RPC 函数(当前进程有效)
     ---@param name string
     ---@param func function
+    ---balance 由第一个注册者决定, 之后显式传入不同的 balance 会抛出错误
+    ---@param balance string "round"|"least"
     ---@return boolean
-    register = function(name, func)
-        return __rpcall.register(name, func);
+    register = function(name, func, balance)
+        return __rpcall.register(name, func, balance);
+    end,
+    
+    ---绑定一个 RPC 句柄(省去每次调用的名字查找)
+    ---@param name string
+    ---@return userdata
+    bind = function(name)
+        return __rpcall.bind(name);
     end,
     
     ---取消一个 RPC 函数(当前进程有效)
@@ -282,6 +378,30 @@ luaos.tls = {
             return nil;
         end
         return tls.context(certfile, keyfile, keypwd);
+    end,
+    
+    ---获取进程内共享的 TLS context, 不存在时用证书文件创建, 所有 job 共用
+    ---共享的 context 不能再调用 ca, assign, load 和 sni_callback
+    ---@param  name string
+    ---@param  certfile string
+    ---@param  keyfile string
+    ---@param  keypwd string
+    ---@return tls_context
+    cache = function(name, certfile, keyfile, keypwd)
+        if not tls then
+            return nil;
+        end
+        return tls.cache(name, certfile, keyfile, keypwd);
+    end,
+    
+    ---移除共享的 TLS context, 下次使用时重新加载证书
+    ---@param  name string
+    ---@return boolean
+    uncache = function(name)
+        if not tls then
+            return false;
+        end
+        return tls.uncache(name);
     end
 };
 
@@ -321,6 +441,24 @@ luaos.nginx = {
             server.upgrade();
         end
         
+        ---在指定路径输出 prometheus 监控数据(nil 表示关闭)
+        ---@param path string
+        function result:metrics(path)
+            server.metrics(path);
+        end
+        
+        ---设置 http 请求限制(超时、最低接收速率、头部和包体大小)
+        ---@param limits table
+        function result:limits(limits)
+            server.limits(limits);
+        end
+        
+        ---开启内核 TLS(kTLS), 系统不支持时仍在用户态加解密
+        ---@param enable boolean
+        function result:ktls(enable)
+            server.ktls(enable);
+        end
+        
         return result;
     end
 };
@@ -356,6 +494,22 @@ local function cluster_watch(proxy, topics)
 end
 
 luaos.cluster = {
+    ---在当前模块启动集群主节点, cpu 用于绑定当前线程(可选)
+    ---@param host string
+    ---@param port integer
+    ---@param cpu integer|integer[]|nil
+    ---@return boolean,string
+    listen = function(host, port, cpu)
+        assert(host and port);
+        local ok, master = pcall(
+            require, "luaos.cluster.master"
+        );
+        if not ok then
+            throw(master);
+        end
+        return master.start(host, port, cpu);
+    end,
+    
     ---建立一个集群连接
     ---@param host string
     ---@param port integer
@@ -430,9 +584,53 @@ luaos.global = {
     ---@param key string
     ---@param value any
     ---@param handler nil|fun(new:any, old:any):any
+    ---@param ttl integer 过期时间(毫秒), 0 表示永不过期
     ---@retrun any
-    set = function(key, value, handler)
-        return storage.set(key, value, handler);
+    set = function(key, value, handler, ttl)
+        if type(handler) ~= "function" then
+            return storage.set(key, value, handler or ttl);
+        end
+        return storage.set(key, value, handler, ttl);
+    end,
+    
+    ---原子累加一个数值, 返回累加后的值
+    ---@param key string
+    ---@param delta number
+    ---@return number
+    incr = function(key, delta)
+        return storage.incr(key, delta or 1);
+    end,
+    
+    ---原子追加一个字符串, 返回追加后的长度
+    ---@param key string
+    ---@param data string
+    ---@return integer
+    append = function(key, data)
+        return storage.append(key, data);
+    end,
+    
+    ---比较并交换, 当前值等于 expected 时设置为 value
+    ---@param key string
+    ---@param expected any
+    ---@param value any
+    ---@return boolean,any
+    cas = function(key, expected, value)
+        return storage.cas(key, expected, value);
+    end,
+    
+    ---设置过期时间(毫秒), 0 表示永不过期
+    ---@param key string
+    ---@param ttl integer
+    ---@return boolean
+    expire = function(key, ttl)
+        return storage.expire(key, ttl);
+    end,
+    
+    ---获取剩余过期时间(毫秒), -1 表示永不过期
+    ---@param key string
+    ---@return integer
+    ttl = function(key)
+        return storage.ttl(key);
     end,
     
     ---获取一个 key-value 值
@@ -453,6 +651,28 @@ luaos.global = {
     erase = function(key)
         return storage.erase(key);
     end,
+
+    ---将一个 table 冻结为只读共享数据, 所有 job 共享同一份内存
+    ---@param name string
+    ---@param data table
+    ---@return userdata
+    freeze = function(name, data)
+        return storage.freeze(name, data);
+    end,
+
+    ---获取冻结的只读数据, 不存在时返回 nil
+    ---@param name string
+    ---@return userdata|nil
+    frozen = function(name)
+        return storage.frozen(name);
+    end,
+
+    ---移除冻结的只读数据, 已经获取的引用仍然有效
+    ---@param name string
+    ---@return boolean
+    unfreeze = function(name)
+        return storage.unfreeze(name);
+    end,
 };
 
 ----------------------------------------------------------------------------
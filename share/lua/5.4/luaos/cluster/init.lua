@@ -22,9 +22,9 @@ local master = require("luaos.cluster.master");
 ----------------------------------------------------------------------------
 
 --The module can be started independently
-function main(host, port)
+function main(host, port, cpu)
     os.chdir(os.pwd());
-    local ok, err = master.start(host, port);
+    local ok, err = master.start(host, port, tonumber(cpu));
     if not ok then
         error(err);
         return;
@@ -39,6 +39,12 @@ local cmd_heartbeat  = "heartbeat";
 
 local _MAX_PACKET    = 64 * 1024 * 1024
 
+-- publisher: job(16) | fd(31) | job(16)
+local _FD_BITS      = 31;
+local _FD_MASK      = (1 << _FD_BITS) - 1;
+local _JOB_BITS     = 16;
+local _JOB_MASK     = (1 << _JOB_BITS) - 1;
+
 ----------------------------------------------------------------------------
 
 local last_onlines, last_performance = 0, 0;
@@ -50,7 +56,12 @@ sessions = {fd={topic={subscriber,...}, peer}, ...}
 ----------------------------------------------------------------------------
 
 local function send_to_peer(peer, data)
-    peer:send(peer:encode(data), true);
+    local packet = peer:encode(data);
+    if not packet then
+        peer:close();
+        return;
+    end
+    peer:send(packet, true);
 end
 
 ---Forward to all sessions except fd
@@ -176,10 +187,27 @@ local function on_socket_dispatch(session, data)
     
     local cmd = tb.type;
     if cmd == cmd_heartbeat then
+        --the first heartbeat of a proxy names its publisher layout
+        if tb.layout then
+            if tb.layout ~= _FD_BITS then
+                peer:close();
+                return;
+            end
+            session.layout = tb.layout;
+        end
         send_to_peer(session.peer, data);
         return;
     end
     
+    --proxies with the old 16-bit fd field would misroute replies
+    if not session.layout then
+        peer:close();
+        if _DEBUG then
+            print(format("session %d closed: old publisher layout", peer:id()));
+        end
+        return;
+    end
+    
     if cmd == cmd_subscribe then
         on_subscribe_request(session, tb);
         return;
@@ -197,17 +225,17 @@ local function on_socket_dispatch(session, data)
     
     performance = performance + 1;
     local publisher = tb.publisher;
-    local high = publisher >> 16; -- >>16bits
+    local high = publisher >> _JOB_BITS;
     
     local fd = peer:id();   
     if high == 0 then
-        publisher = publisher << 16; -- <<16bits
-        tb.publisher = publisher + fd;
+        tb.publisher = (publisher << _FD_BITS) | fd;
         on_publish_request(session, tb);
     else
-        session = sessions[high & 0xffff];
+        session = sessions[high & _FD_MASK];
         if session then
-            tb.publisher = (publisher & 0xFFFF0000FFFF) | (fd << 16)
+            local jobs = (_JOB_MASK << (_FD_BITS + _JOB_BITS)) | _JOB_MASK;
+            tb.publisher = (publisher & jobs) | (fd << _JOB_BITS);
             data = pack.encode(tb);
             send_to_peer(session.peer, data);
         end
@@ -222,7 +250,14 @@ local function on_socket_receive(session, ec, data)
     end
     
     local peer = session.peer;
-    local size, reason = peer:decode(data, function(data, opcode)
+    local size, reason = peer:decode(data, function(data, opcode, hash, cipher)
+        --the proxy switches only after our ready, answer in kind
+        if hash == "crc32c" and peer:hash() ~= hash then
+            peer:hash(hash);
+        end
+        if cipher == "aes-128-gcm" and peer:cipher() ~= cipher then
+            peer:cipher(cipher);
+        end
         if not pcall(on_socket_dispatch, session, data) then
             peer:close();
         end
@@ -262,7 +297,14 @@ local function on_socket_accept(acceptor, peer)
     };
     onlines = onlines + 1;
     
-    tb.type = cmd_ready;    
+    tb.type = cmd_ready;
+    tb.layout = _FD_BITS;
+    tb.hash = "crc32c"; --frame hash we can decode, old proxies ignore it
+    --advertise aes-128-gcm if this build has it, send rc4 until the proxy switches
+    if peer:cipher("aes-128-gcm") then
+        tb.cipher = "aes-128-gcm";
+        peer:cipher("rc4");
+    end
     send_to_peer(peer, pack.encode(tb));    
     peer:select(luaos.read, bind(on_socket_receive, sessions[fd])); 
     
@@ -302,12 +344,20 @@ function master.stop()
     sessions = {};
 end
 
-function master.start(host, port)
+function master.start(host, port, cpu)
     assert(host and port);
     if master.acceptor then
         return false;
     end
     
+    --the master forwards every message, pin it away from busy jobs
+    if cpu then
+        local ok, bound = pcall(luaos.affinity, cpu);
+        if not ok or not bound then
+            error(format("cluster master failed to bind cpu %s", tostring(cpu)));
+        end
+    end
+    
     local acceptor = socket("tcp");
     if not acceptor then
         return false;
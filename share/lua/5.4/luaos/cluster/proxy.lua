@@ -38,6 +38,12 @@ local cmd_heartbeat   = "heartbeat"
  
 local _MAX_PACKET     = 64 * 1024 * 1024
 
+-- publisher: job(16) | fd(31) | job(16)
+local _FD_BITS       = 31;
+local _JOB_BITS      = 16;
+local _JOB_MASK      = (1 << _JOB_BITS) - 1;
+local _FD_FIELD      = ((1 << _FD_BITS) - 1) << _JOB_BITS;
+
 ----------------------------------------------------------------------------
 
 local local_topics    = {};
@@ -47,7 +53,12 @@ local server = { peer = nil, ready = false };
 ----------------------------------------------------------------------------
 
 local function send_to_peer(peer, data)
-    peer:send(peer:encode(data), true);
+    local packet = peer:encode(data);
+    if not packet then
+        peer:close();
+        return;
+    end
+    peer:send(packet, true);
 end
 
 local function send_to_master(message)
@@ -155,7 +166,18 @@ end
 ----------------------------------------------------------------------------
 
 local function on_remote_ready(message)
+    if message.layout ~= _FD_BITS then
+        error("cluster master uses another publisher layout");
+        server.peer:close();
+        return;
+    end
     server.ready = true;
+    if message.hash == "crc32c" and server.peer then
+        server.peer:hash(message.hash);
+    end
+    if message.cipher and server.peer then
+        server.peer:cipher(message.cipher);
+    end
     if _DEBUG then
         print("cluster ready");
     end
@@ -163,12 +185,12 @@ end
 
 local function on_remote_publish(message)
     local publisher = message.publisher;
-    local receiver  = publisher >> 32; -- >>32bits
+    local receiver  = publisher >> (_FD_BITS + _JOB_BITS);
     
     if receiver > 0 then
-        publisher = ((publisher & 0xFFFF) << 32) | (publisher & 0xFFFF0000) | receiver;
+        publisher = ((publisher & _JOB_MASK) << (_FD_BITS + _JOB_BITS)) | (publisher & _FD_FIELD) | receiver;
     else
-        publisher = publisher << 16; -- <<16bits
+        publisher = publisher << _JOB_BITS;
     end
     luaos_publish(message.topic, message.mask, publisher, pack.decode(message.argv));
 end
@@ -287,6 +309,8 @@ function proxy.start(host, port, timeout)
     local ok, reason = peer:connect(host, port, timeout or 2000);
     if ok then
         server.peer = peer;
+        --before anything else, the master drops proxies which don't send it
+        send_to_master({ type = cmd_heartbeat, layout = _FD_BITS });
         peer:select(luaos.read, bind(on_socket_receive, peer));
         timer = luaos.scheme(10000, bind(update_proxy, 10000));
     end
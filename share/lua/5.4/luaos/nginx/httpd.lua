@@ -127,12 +127,17 @@ local gzip_encoding = {
 }
 
 local _WWWROOT = "nginx"
+local _METRICS  = nil
+local _LIMITS   = {}
 local _STATE_OK                 = 200
 local _STATE_LOCATION           = 301
 local _STATE_BAD_REQUEST        = 400
 local _STATE_NOT_FOUND          = 404
 local _STATE_ERROR              = 500
 
+local _CHUNK_HIGH_WATER <const> = 256 * 1024
+local _HTTP_MAX_PIPELINE <const> = 64
+
 local _STATE_OK_TEXT            = "OK"
 local _STATE_FAILED_TEXT        = "Failed"
 
@@ -146,6 +151,7 @@ local _HEADER_LOCATION          = "Location"
 local _HEADER_CACHE_CONTROL     = "Cache-Control"
 local _HEADER_CONTENT_TYPE      = "Content-Type"
 local _HEADER_CONTENT_LENGTH    = "Content-Length"
+local _HEADER_TRANSFER_ENCODING = "Transfer-Encoding"
 local _HEADER_WEBSOCKET_VERSION    = "Sec-WebSocket-Version"
 local _HEADER_WEBSOCKET_KEY        = "Sec-WebSocket-Key"
 local _HEADER_WEBSOCKET_ACCEPT     = "Sec-WebSocket-Accept"
@@ -300,7 +306,99 @@ local function on_http_success(peer, headers, code)
     end
 end
 
-local function on_http_download(peer, headers, filename, ext)
+local function chunk_send(peer, data)
+    if data and #data > 0 then
+        send_message(peer, string_format("%x\r\n", #data) .. data .. "\r\n")
+    end
+end
+
+---plain 为 true 时(HTTP/1.0 客户端)不分块, 数据直接输出到连接关闭为止
+local function on_http_chunked(peer, headers, plain)
+    local cache, head = {}
+    head = string_format("HTTP/1.1 %d %s\r\n", _STATE_OK, http_status_text[_STATE_OK])
+    table_insert(cache, head);
+    
+    headers[_HEADER_CONTENT_LENGTH] = nil
+    if plain then
+        headers[_HEADER_TRANSFER_ENCODING] = nil
+        headers[_HEADER_CONNECTION] = "close"
+    else
+        headers[_HEADER_TRANSFER_ENCODING] = "chunked"
+    end
+    for k, v in pairs(headers) do
+        if type(k) == "string" then
+            if type(v) ~= "function" then
+                table_insert(cache, string_format("%s: %s\r\n", k, v))
+            end
+        end
+    end
+    
+    table_insert(cache, "\r\n");
+    send_message(peer, table_concat(cache))
+    
+    ---压缩流贯穿整个响应, 每个 chunk 只压缩新增的数据
+    local zstream = nil
+    local encoding = headers[_HEADER_CONTENT_ENCODING]
+    if encoding == "gzip" then
+        zstream = gzip.stream(true)
+    elseif encoding == "deflate" then
+        zstream = gzip.stream(false)
+    end
+    
+    local function output(data)
+        if not plain then
+            chunk_send(peer, data)
+        elseif data and #data > 0 then
+            send_message(peer, data)
+        end
+    end
+    
+    local stream = {}
+    function stream:write(data, flush)
+        if zstream then
+            data = zstream:write(data, flush)
+        end
+        output(data)
+        return peer:queued() < _CHUNK_HIGH_WATER
+    end
+    function stream:finish()
+        if zstream then
+            output(zstream:finish())
+        end
+        if plain then
+            peer:close()
+        else
+            send_message(peer, "0\r\n\r\n")
+        end
+    end
+    return stream
+end
+
+local function on_http_file(peer, headers, filename, size)
+    local cache, head = {}
+    head = string_format("HTTP/1.1 %d %s\r\n", _STATE_OK, http_status_text[_STATE_OK])
+    table_insert(cache, head);
+    
+    headers[_HEADER_CONTENT_LENGTH] = size
+    for k, v in pairs(headers) do
+        if type(k) == "string" then
+            if type(v) ~= "function" then
+                table_insert(cache, string_format("%s: %s\r\n", k, v))
+            end
+        end
+    end
+    
+    table_insert(cache, "\r\n");
+    send_message(peer, table_concat(cache))
+    peer:sendfile(filename)
+    
+    if "close" == headers[_HEADER_CONNECTION] then
+        peer:close()
+    end
+end
+
+---返回 true 时响应由 I/O 线程完成, 完成后调用 done()
+local function on_http_download(peer, headers, filename, ext, done)
     filename = _WWWROOT .. filename
     filename = string_gsub(filename, '%.', '/')
     filename = string_sub(filename, 1, #filename - #ext - 1)
@@ -319,20 +417,39 @@ local function on_http_download(peer, headers, filename, ext)
         return;
     end
     
-    local ok, data = pcall(fs.read, fs, "a")
-    fs:close()
-    if not ok or not data or #data == 0 then
-        on_http_error(peer, headers, code)
-        return;
-    end
-    
-    if not gzip_encoding[ext] then
+    ---不压缩的文件直接由内核发送(sendfile)
+    if not gzip_encoding[ext] or not headers[_HEADER_CONTENT_ENCODING] then
+        local size = fs:seek("end")
+        fs:close()
+        if not size or size == 0 then
+            on_http_error(peer, headers, code)
+            return;
+        end
         headers[_HEADER_CONTENT_ENCODING] = nil
+        headers[_HEADER_CONTENT_TYPE] = mime
+        on_http_file(peer, headers, filename, size)
+        return;
     end
     
-    headers[_HEADER_CONTENT_TYPE] = mime
-    table_insert(headers, data)
-    on_http_success(peer, headers)
+    ---需要压缩的文件在 I/O 线程中读取, 不阻塞当前模块
+    fs:close()
+    fs = os.file(filename, "rb")
+    fs:read(nil, function(ec, data)
+        fs:close()
+        local ok
+        if ec ~= 0 or #data == 0 then
+            ok = pcall(on_http_error, peer, headers, code)
+        else
+            headers[_HEADER_CONTENT_TYPE] = mime
+            table_insert(headers, data)
+            ok = pcall(on_http_success, peer, headers)
+        end
+        if not ok then
+            peer:close()
+        end
+        done()
+    end)
+    return true;
 end
 
 ----------------------------------------------------------------------------
@@ -371,7 +488,7 @@ local function url_to_filename(url)
     return filename, path, params;
 end
 
-local function on_http_request(peer, request)
+local function on_http_request(peer, request, done)
     local headers = default_headers()
     local rheader = request:headers()
     
@@ -390,6 +507,15 @@ local function on_http_request(peer, request)
     end
     
     local url = unescape(request:url())
+    
+    ---输出 prometheus 监控数据
+    if _METRICS and string_match(url, "^[^?]*") == _METRICS then
+        headers[_HEADER_CONTENT_TYPE] = "text/plain; version=0.0.4"
+        headers:write(luaos.stats("prometheus"))
+        on_http_success(peer, headers)
+        return;
+    end
+    
     local filename, path, params = url_to_filename(url)
     
     local others = path[#path]
@@ -398,8 +524,7 @@ local function on_http_request(peer, request)
     ---读取静态文件
     if #others > 1 then
         local ext = others[#others]
-        on_http_download(peer, headers, filename, ext)
-        return;
+        return on_http_download(peer, headers, filename, ext, done);
     end
     
     ---加载脚本文件
@@ -421,6 +546,36 @@ local function on_http_request(peer, request)
     
     ---运行脚本文件
     local responsed = false;
+    local pending = false;
+    local stream = nil;
+    local major, minor = request:version();
+    local http10 = major == 1 and minor == 0;
+    
+    ---分块输出, 队列积压超过上限时返回 false, 应等待 on_drain 再继续
+    function headers:write_chunk(data, flush)
+        assert(responsed == false);
+        if not stream then
+            stream = on_http_chunked(peer, headers, http10);
+        end
+        if #headers > 0 then
+            local cached = table_concat(headers);
+            for i = #headers, 1, -1 do
+                headers[i] = nil;
+            end
+            stream:write(cached);
+        end
+        return stream:write(data, flush);
+    end
+    
+    ---发送队列清空时回调 handler()
+    function headers:on_drain(handler)
+        peer:select(luaos.write, function(ec)
+            if ec == 0 and not responsed then
+                handler();
+            end
+        end);
+    end
+    
     function headers:finish(state_code)
         assert(responsed == false);
         if not state_code then
@@ -428,7 +583,16 @@ local function on_http_request(peer, request)
         end
         
         assert(type(state_code) == "number");
-        if state_code < 400 then
+        if stream then
+            state_code = _STATE_OK;
+            if #headers > 0 then
+                stream:write(table_concat(headers));
+            end
+            stream:finish();
+            if "close" == headers[_HEADER_CONNECTION] then
+                peer:close()
+            end
+        elseif state_code < 400 then
             on_http_success(peer, headers, state_code);
         else
             on_http_error(peer, headers, state_code)
@@ -444,6 +608,12 @@ local function on_http_request(peer, request)
             local info = string_format("%s %s %d %s from %s", method, url, state_code, text, from);
             trace(info);
         end
+        
+        ---脚本返回后才完成的响应, 继续处理排队的请求
+        if pending then
+            pending = false;
+            done();
+        end
     end
 
     function headers:id()
@@ -452,7 +622,19 @@ local function on_http_request(peer, request)
     
     local ok = pcall(script.on_request, request, headers, params)
     if not ok then
-        on_http_error(peer, headers, _STATE_ERROR)
+        ---响应已经开始输出, 不能再发送错误页, 直接断开
+        if stream or responsed then
+            peer:close()
+        else
+            on_http_error(peer, headers, _STATE_ERROR)
+        end
+        return;
+    end
+    
+    ---返回时还没有 finish(流式输出或异步响应), 后面的请求等待 finish
+    if not responsed then
+        pending = true;
+        return true;
     end
 end
 
@@ -942,8 +1124,57 @@ local sessions = {};
 
 local _ws_upgrade = false;
 
-local function on_http_callback(session, request)
+---解析器在下一个请求时会被复用, 排队的请求需要保存当前的内容
+local function http_freeze(request)
+    local method     = request:method();
+    local major, minor = request:version();
+    local url        = request:url();
+    local headers    = request:headers();
+    local body       = request:body();
+    local upgrade    = request:is_upgrade();
+    local keep_alive = request:is_keep_alive();
+    
+    local frozen = setmetatable({}, {__index = request});
+    function frozen:method()        return method;     end
+    function frozen:version()       return major, minor; end
+    function frozen:url()           return url;        end
+    function frozen:headers()       return headers;    end
+    function frozen:body()          return body;       end
+    function frozen:is_upgrade()    return upgrade;    end
+    function frozen:is_keep_alive() return keep_alive; end
+    return frozen;
+end
+
+local on_http_callback;
+
+---前一个响应完成, 按顺序处理排队的请求, 直到又有一个响应需要等待
+local function http_resume(session)
+    local waiting = session.waiting;
+    session.waiting = nil;
+    for i = 1, #waiting do
+        if not session.peer:is_open() then
+            return;
+        end
+        if session.waiting then
+            table_insert(session.waiting, waiting[i]);
+        else
+            on_http_callback(session, waiting[i]);
+        end
+    end
+end
+
+---流水线(pipelining)请求必须按顺序响应, 前一个响应未完成时后面的请求排队等待
+on_http_callback = function(session, request)
     local peer = session.peer;
+    if session.waiting then
+        if #session.waiting >= _HTTP_MAX_PIPELINE then
+            peer:close();
+            return false;
+        end
+        table_insert(session.waiting, http_freeze(request));
+        return;
+    end
+    
     local method = request:method();
     if method ~= "GET" and method ~= "POST" then
         peer:close();
@@ -965,8 +1196,11 @@ local function on_http_callback(session, request)
     end
     
     peer:timeout(_WS_TRUST_TIMEOUT);
-    if not pcall(on_http_request, peer, request) then
+    local ok, pending = pcall(on_http_request, peer, request, bind(http_resume, session));
+    if not ok then
         peer:close();
+    elseif pending then
+        session.waiting = {};
     end
 end
 
@@ -1041,32 +1275,39 @@ local function on_tls_handshake(peer, ec)
         session.peer   = peer
         session.parser = parser(false)
         sessions[fd]   = session
+        peer:http_limit(_LIMITS)
         peer:select(luaos.read, bind(on_receive_handler, peer))
     end
 end
 
-local function on_sni_callback(peer, sslctx, hostname)
+local function on_sni_callback(sslctx, hostname)
     if not hostname then
-        peer:close();
-        return;
+        return nil;
     end
     local ok, context = pcall(sslctx, hostname);
-    if not ok or not context then
-        peer:close();
-        return;
+    if not ok then
+        return nil;
     end
-    --Replace the old context
-    peer:tls_enable(context);
+    return context;
 end
 
+local _ACCEPT_CTX = nil
+local _KTLS       = false
+
 local function on_socket_accept(sslctx, peer)
     local type_of_ctx = type(sslctx);
     if type_of_ctx == "function" then
-        --Create temporary context
-        local context = tls.context();
-        context:sni_callback(bind(on_sni_callback, peer, sslctx));
+        --One context for every connection, sni picks the certificate
+        if not _ACCEPT_CTX then
+            _ACCEPT_CTX = tls.context();
+            _ACCEPT_CTX:session_cache(300, "nginx");
+            _ACCEPT_CTX:sni_callback(bind(on_sni_callback, sslctx), true);
+        end
         --enable ssl/tls for socket
-        peer:tls_enable(context);
+        if _KTLS then
+            peer:ktls(true);
+        end
+        peer:tls_enable(_ACCEPT_CTX);
     end
     peer:timeout(_WS_UNTRUST_TIMEOUT);
     peer:handshake(bind(on_tls_handshake, peer));
@@ -1080,11 +1321,27 @@ function nginx.upgrade()
     _ws_upgrade = true;
 end
 
+function nginx.metrics(path)
+    _METRICS = path;
+end
+
+---header_timeout, body_timeout, min_rate, max_headers,
+---max_header_size and max_body_size, checked natively
+function nginx.limits(limits)
+    _LIMITS = limits or {};
+end
+
+---kernel tls for new connections, where the system supports it
+function nginx.ktls(enable)
+    _KTLS = enable and true or false;
+end
+
 function nginx.stop()
     if nginx.acceptor then
         nginx.acceptor:close();
         nginx.acceptor = nil;
     end
+    _ACCEPT_CTX = nil;
     for k, v in pairs(sessions) do
         v.peer:close();
         v.peer = nil;
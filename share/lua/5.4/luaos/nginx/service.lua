@@ -20,14 +20,21 @@ local luaos = require("luaos");
 local nginx = require("luaos.nginx");
 local certificates = {};
 
---Create a TLS context for the specified hostname
+local contexts = {};
+
+--The TLS context for the specified hostname, certificates are loaded once
 local function tls_context(hostname)
+    local context = contexts[hostname];
+    if context then
+        return context;
+    end
     local hostcert = certificates[hostname];
     if not hostcert then
         return nil;
     end
-    local context = tls.context();
-    assert(context:load(hostcert.cert, hostcert.key, hostcert.passwd));
+    context = luaos.tls.cache(hostname, hostcert.cert, hostcert.key, hostcert.passwd);
+    assert(context, hostname);
+    contexts[hostname] = context;
     return context;
 end
 
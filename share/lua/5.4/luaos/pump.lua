@@ -18,72 +18,21 @@
 
 ----------------------------------------------------------------------------
 
-local class = require("luaos.classy");
-local pcall = require("luaos.pcall");
-local pump_message = class("pump_message");
-local skiplist = require("skiplist");
+local dispatcher = require("dispatcher");
 
 ----------------------------------------------------------------------------
 
-function pump_message:__init(...)
-    self.handlers = {};
-end
-
----注册一个消息回调(仅当前模块)
----@param name integer|string
----@param handler fun(...):void
----@return function
-function pump_message:register(name, handler, priority)
-    assert(type(handler) == "function");
-    local event = self.handlers[name];
-    if not priority then
-        priority = 0;
-    else
-        priority = -priority;
-    end
-    
-    if not event then
-        event = skiplist.new();
-        self.handlers[name] = event;
-    end
-    
-    event:insert(handler, priority);
-    return handler;
-end
-
----派发一个回调消息(仅当前模块)
----@param name integer|string
----@return integer
-function pump_message:dispatch(name, ...)
-    local event = self.handlers[name];
-    if not event then
-        return true, 0;
-    end
-    
-    local result = true;
-    for i, handler in pairs(event:rank_range()) do
-        local ok = pcall(handler, ...);
-        if not ok then
-            result = false;
-        end
-    end
-    
-    return result, event:size();
-end
-
----取消一个消息回调(仅当前模块)
----@param name integer|string
----@param handler fun(...):void
-function pump_message:unregister(name, handler)
-    assert(type(handler) == "function");
-    local event = self.handlers[name];
-    if not event then
-        return;
-    end
-    
-    if event:delete(handler) and event:size() == 0 then
-        self.handlers[name] = nil;
-    end
+---@class pump_message
+---@field register fun(self:pump_message, name:integer|string, handler:fun(...):void, priority?:number):function
+---@field unregister fun(self:pump_message, name:integer|string, handler:fun(...):void)
+---@field dispatch fun(self:pump_message, name:integer|string, ...):boolean,integer
+
+---创建一个消息反应堆(仅当前模块)
+---回调按 priority 从高到低调用, 相同优先级按注册顺序调用
+---同一消息重复注册同一个回调会抛出 "handler exists" 错误
+---@return pump_message
+local function pump_message()
+    return dispatcher();
 end
 
 ----------------------------------------------------------------------------
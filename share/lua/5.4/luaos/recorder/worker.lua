@@ -76,13 +76,16 @@ local function open_logfile(filename)
         return status[filename];
     end    
     
-    local log = io.open(filename, "a");
-    if not log then
-        return nil;
-    end
+    ---写入在 I/O 线程中完成, 不阻塞订阅消息的处理
+    local log = os.file(filename, "a", function(ec)
+        if ec ~= 0 then
+            status[filename] = nil;
+            return;
+        end
+        trace(format("log file opened: %s", filename));
+    end);
     
     status[filename] = log;
-    trace(format("log file opened: %s", filename));
     return log;
 end
 
@@ -103,7 +106,7 @@ local function on_publish(publisher, mask, from, data)
         return;
     end
     
-    log:write(format("<%s:%s> %s", data.module, data.type, data.message));
+    log:append(format("<%s:%s> %s", data.module, data.type, data.message));
 end
 
 ----------------------------------------------------------------------------
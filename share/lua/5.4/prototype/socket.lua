@@ -62,11 +62,21 @@ function i_socket:nodelay() end;
 ---@return integer|nil
 function i_socket:available() end;
 
+---获取异步发送队列中尚未写入内核的字节数
+---@return integer
+function i_socket:queued() end;
+
 ---设置 socket 连接超时时间(keep-alive time),成功返回 true，否则返回 false 或 nil
 ---@param millisecond integer
 ---@return boolean|nil
 function i_socket:timeout(millisecond) end;
 
+---对 http 请求做限制(超时、最低接收速率、头部和包体大小),超限时回复错误并关闭连接
+---limits 的字段: header_timeout, body_timeout, min_rate, max_headers, max_header_size, max_body_size
+---@param limits table|nil
+---@return boolean
+function i_socket:http_limit(limits) end;
+
 ---获取 socket 远端地址信息,成功返回 ip 和 端口，否则返回 nil
 ---@return string,integer
 function i_socket:endpoint() end;
@@ -84,6 +94,19 @@ function i_socket:select(handler) end;
 ---@return string|nil
 function i_socket:encode(data, opcode, encrypt, compress) end;
 
+---设置/获取 encode 使用的校验算法("none", "murmur", "crc32c"),返回当前算法
+---"crc32c" 只能发给能解析它的对端(新版本),"none" 用于可信链路
+---@param name string|nil
+---@return string
+function i_socket:hash(name) end;
+
+---设置/获取 encode 加密使用的算法("rc4", "aes-128-gcm", "chacha20-poly1305"),返回当前算法
+---aes-128-gcm/chacha20-poly1305 自带完整性校验(不再计算 hash),只能发给能解析它的对端(新版本)
+---不支持时返回 nil 和错误信息
+---@param name string|nil
+---@return string|nil
+function i_socket:cipher(name) end;
+
 ---发送数据,成功则返回发送的字节数，否则返回 nil
 ---@param data string
 ---@param asynchronous boolean|nil
@@ -100,7 +123,7 @@ function i_socket:send_to(data, host, port, asynchronous) end;
 
 ---对收到的数据进行解码,成功则返回未解码的数据长度，否则返回 nil
 ---@param data string
----@param handler fun(data:string, opcode:integer):void
+---@param handler fun(data:string, opcode:integer, hash:string, cipher:string):void
 ---@return integer|nil,reason
 function i_socket:decode(data, handler) end;
 
@@ -124,6 +147,19 @@ function i_socket:tls_sni(cafile) end;
 ---@return boolean
 function i_socket:tls_enable(ctx) end;
 
+---在 tls_enable 之前调用, 请求握手后由内核加解密(kTLS), 返回系统是否支持
+---不带参数调用时返回内核加解密是否已经生效
+---@param enable boolean|nil
+---@return boolean
+function i_socket:ktls(enable) end;
+
+---异步发送文件内容, 排在已发送数据之后, 能用 sendfile 时由内核直接发送
+---@param filename string
+---@param offset integer|nil
+---@param length integer|nil
+---@return integer|nil, string
+function i_socket:sendfile(filename, offset, length) end;
+
 ---SSL 握手
 ---@overload fun(handler:fun(ec:integer):void):boolean
 ---@return boolean
@@ -41,9 +41,18 @@ function context:assign(certdata, keydata, passwd) end
 function context:load(certfile, keyfile, passwd) end
  
 ---设置 TLS sni 回调函数
----@param callback fun(hostname:string)
+---persistent 为 true 时回调在每次握手时调用, 并返回该 hostname 使用的 context
+---@param callback fun(hostname:string):tls_context|nil
+---@param persistent boolean
 ---@return boolean|nil
-function context:sni_callback(callback) end
+function context:sni_callback(callback, persistent) end
+
+---开启服务端会话复用(session id 和 session ticket), 会话在所有 job 间共享
+---同一 scope 的 context 可以互相复用会话, tls.cache 的 context 以名称为 scope
+---@param timeout integer
+---@param scope? string
+---@return boolean|nil
+function context:session_cache(timeout, scope) end
 
 ---关闭 TLS 上下文
 function context:close() end
@@ -202,7 +202,8 @@ static int start_master(lua_State* L)
   const char* host = luaL_checkstring(L, 1);
   unsigned short port = (unsigned short)luaL_checkinteger(L, 2);
   int threads = (int)luaL_optinteger(L, 3, 1);
-  lua_pushboolean(L, luaos_start_master(host, port, threads) ? 1 : 0);
+  int cpu = (int)luaL_optinteger(L, 4, -1);
+  lua_pushboolean(L, luaos_start_master(host, port, threads, cpu) ? 1 : 0);
   return 1;
 }
 
@@ -0,0 +1,286 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <string.h>
+#include <socket/mutex.h>
+
+#include "luaos_async.h"
+#include "luaos_conv.h"
+#include "luaos_pack.h"
+#include "rapidjson/rapidjson.h"
+
+#define async_registry_name "luaos_async"
+
+/*******************************************************************************/
+
+/*
+** Only native functions which work on plain values and keep no per-state
+** data may run in the pool, every worker calls them in its own lua_State.
+*/
+static const char* const async_functions[] = {
+  "openssl.hash.crc32",
+  "openssl.hash.md5",
+  "openssl.hash.sha1",
+  "openssl.hash.sha224",
+  "openssl.hash.sha256",
+  "openssl.hash.sha384",
+  "openssl.hash.sha512",
+  "openssl.hash.hmac_md5",
+  "openssl.hash.hmac_sha1",
+  "openssl.hash.hmac_sha224",
+  "openssl.hash.hmac_sha256",
+  "openssl.hash.hmac_sha384",
+  "openssl.hash.hmac_sha512",
+  "openssl.aes.encrypt",
+  "openssl.aes.decrypt",
+  "openssl.rsa.sign",
+  "openssl.rsa.verify",
+  "openssl.rsa.encrypt",
+  "openssl.rsa.decrypt",
+  "openssl.base64.encode",
+  "openssl.base64.decode",
+  "openssl.xor.convert",
+  "msgpack.encode",
+  "msgpack.decode",
+  "rapidjson.encode",
+  "rapidjson.decode",
+  NULL
+};
+
+static int find_function(const char* name)
+{
+  for (int i = 0; async_functions[i]; i++) {
+    if (strcmp(async_functions[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*******************************************************************************/
+
+typedef std::function<void(lua_State*)> async_task;
+
+struct async_worker final {
+  atomic_lock mutex;
+  std::deque<async_task> tasks;
+  std::thread thread;
+};
+
+/*
+** Tasks are spread over the workers round robin, a worker drains its own
+** queue first and steals from the others when it runs dry, so one slow call
+** does not hold back the tasks queued behind it.
+*/
+class async_pool final {
+  std::vector<std::unique_ptr<async_worker>> _workers;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::atomic<size_t> _queued;
+  std::atomic<size_t> _next;
+  std::atomic<bool> _stopped;
+
+  bool pop(size_t index, async_task& task)
+  {
+    size_t count = _workers.size();
+    for (size_t i = 0; i < count; i++)
+    {
+      async_worker& worker = *_workers[(index + i) % count];
+      std::unique_lock<atomic_lock> lock(worker.mutex);
+      if (worker.tasks.empty()) {
+        continue;
+      }
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+      _queued--;
+      return true;
+    }
+    return false;
+  }
+
+  static lua_State* newstate()
+  {
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_requiref(L, "openssl", luaopen_openssl, 0);
+    luaL_requiref(L, "msgpack", luaopen_cmsgpack_safe, 0);
+    luaL_requiref(L, "rapidjson", luaopen_rapidjson, 0);
+    lua_pop(L, 3);
+
+    lua_newtable(L);
+    for (int i = 0; async_functions[i]; i++)
+    {
+      const char* name = async_functions[i];
+      const char* dot = strchr(name, '.');
+      lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+      lua_pushlstring(L, name, dot - name);
+      lua_rawget(L, -2);
+      while (dot && lua_istable(L, -1))
+      {
+        const char* next = strchr(dot + 1, '.');
+        size_t size = next ? next - dot - 1 : strlen(dot + 1);
+        lua_pushlstring(L, dot + 1, size);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+        dot = next;
+      }
+      lua_remove(L, -2);  /* remove loaded table */
+      lua_rawseti(L, -2, i);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, async_registry_name);
+    return L;
+  }
+
+  void run(size_t index)
+  {
+    lua_State* L = newstate();
+    while (!_stopped)
+    {
+      async_task task;
+      if (pop(index, task)) {
+        task(L);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [this]() { return _stopped || _queued > 0; });
+    }
+    lua_close(L);
+  }
+
+public:
+  async_pool() : _queued(0), _next(0), _stopped(false)
+  {
+    size_t count = std::thread::hardware_concurrency();
+    count = count > 1 ? count - 1 : 1;
+    for (size_t i = 0; i < count; i++) {
+      _workers.emplace_back(new async_worker());
+    }
+    for (size_t i = 0; i < count; i++) {
+      _workers[i]->thread = std::thread(std::bind(&async_pool::run, this, i));
+    }
+  }
+  ~async_pool()
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _stopped = true;
+    }
+    _cond.notify_all();
+    for (auto& worker : _workers) {
+      worker->thread.join();
+    }
+  }
+  void post(async_task task)
+  {
+    async_worker& worker = *_workers[_next++ % _workers.size()];
+    {
+      /* count first, so a worker never sees the task before the count */
+      std::unique_lock<std::mutex> lock(_mutex);
+      _queued++;
+    }
+    {
+      std::unique_lock<atomic_lock> lock(worker.mutex);
+      worker.tasks.push_back(std::move(task));
+    }
+    _cond.notify_one();
+  }
+  static async_pool& instance()
+  {
+    static async_pool pool;
+    return pool;
+  }
+};
+
+/*******************************************************************************/
+
+static void async_call(lua_State* L, int index, lua_value_array::value_type params, io_handler ios, int callback)
+{
+  stack_rollback rollback(L);
+  int top = lua_gettop(L);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, async_registry_name);
+  lua_rawgeti(L, -1, index);
+  lua_remove(L, -2);
+
+  auto status = lua_pcall(L, (int)params->push(L), LUA_MULTRET, 0);
+  lua_value_array::value_type result;
+  result = lua_value_array::create();
+  result->append(L, lua_value(status == LUA_OK));
+  result->append(L, top + 1, 0);
+
+  ios->post([result, callback]()
+    {
+      lua_State* L = luaos_local.lua_state();
+      stack_rollback rollback(L);
+
+      lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+      luaL_unref (L, LUA_REGISTRYINDEX, callback);
+
+      if (luaos_pcall(L, (int)result->push(L), 0) != LUA_OK) {
+        luaos_error("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+    }
+  );
+}
+
+/*******************************************************************************/
+
+static int lua_os_async(lua_State* L)
+{
+  const char* name = luaL_checkstring(L, 1);
+  int index = find_function(name);
+  if (index < 0) {
+    luaL_argerror(L, 1, "not an async function");
+  }
+  int argc = lua_gettop(L);
+  if (argc < 2 || !lua_isfunction(L, argc)) {
+    luaL_error(L, "the last argument must be a callback function");
+  }
+  lua_value_array::value_type params;
+  params = lua_value_array::create(L, 2, argc - 1);
+
+  lua_pushvalue(L, argc);
+  int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  auto ios = luaos_local.lua_service();
+  async_pool::instance().post(std::bind(&async_call, std::placeholders::_1, index, params, ios, callback));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*******************************************************************************/
+
+namespace async
+{
+  void init_metatable(lua_State* L)
+  {
+    struct luaL_Reg methods[] = {
+      { "async",        lua_os_async        },
+      { NULL,           NULL },
+    };
+    lua_getglobal(L, "os");
+    luaL_setfuncs(L, methods, 0);
+    lua_pop(L, 1); //pop os from stack
+  }
+}
+
+/*******************************************************************************/
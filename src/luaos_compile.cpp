@@ -98,9 +98,13 @@ static int luaos_build(const char* filename, FILE* fp)
     luaos_error("Can't open input file: %s\n", filename);
     return 0;
   }
-  encoder->encode(opcode, data.c_str(), data.size(), true, true, [fp](const char* data, size_t size) {
+  bool ok = encoder->encode(opcode, data.c_str(), data.size(), true, true, [fp](const char* data, size_t size) {
     fwrite(data, 1, size, fp);
   });
+  if (!ok) {
+    luaos_error("Can't encrypt file: %s\n", filename);
+    return 0;
+  }
   luaos_trace("%s build OK\n", filename);
   return 1;
 }
@@ -0,0 +1,254 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "luaos.h"
+#include "luaos_dispatcher.h"
+#include "luaos_metrics.h"
+#include "luaos_traceback.h"
+
+/*
+** Every event keeps its handlers in one array sorted by priority, higher
+** first and in register order within a priority. A dispatch holds its own
+** reference to the array, a change made while the array is in use goes to
+** a fresh copy, so a dispatch is never disturbed by its own handlers.
+**
+** The functions live in a uservalue table keyed by a handler id which is
+** never reused, a handler removed during a dispatch is simply skipped.
+*/
+
+struct event_handler {
+  lua_Integer id;
+  lua_Number  priority;
+};
+
+typedef std::vector<event_handler> handler_array;
+typedef std::shared_ptr<handler_array> handler_list;
+
+struct dispatcher {
+  lua_Integer next_id;
+};
+
+enum {
+  uv_events    = 1, /* name -> event userdata */
+  uv_functions = 2, /* handler id -> function */
+};
+
+static dispatcher* check_dispatcher(lua_State* L, int i = 1)
+{
+  return lexget_userdata<dispatcher>(L, i, luaos_dispatcher_name);
+}
+
+static handler_array& writable(handler_list& list)
+{
+  if (list.use_count() > 1) {
+    list = std::make_shared<handler_array>(*list);
+  }
+  return *list;
+}
+
+/* the event of name in the events table at index, or null */
+static handler_list* find_event(lua_State* L, int events, int name)
+{
+  lua_pushvalue(L, name);
+  lua_rawget(L, events);
+  auto list = (handler_list*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return list;
+}
+
+static int find_handler(lua_State* L, const handler_array& handlers, int functions, int handler)
+{
+  for (size_t i = 0; i < handlers.size(); i++)
+  {
+    lua_rawgeti(L, functions, handlers[i].id);
+    bool equal = lua_rawequal(L, -1, handler) != 0;
+    lua_pop(L, 1);
+    if (equal) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/***********************************************************************************/
+
+static int lua_os_dispatcher_new(lua_State* L)
+{
+  auto self = (dispatcher*)lua_newuserdatauv(L, sizeof(dispatcher), 2);
+  self->next_id = 0;
+  lexset_metatable(L, luaos_dispatcher_name);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, uv_events);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, uv_functions);
+  return 1;
+}
+
+static int lua_os_dispatcher_event_gc(lua_State* L)
+{
+  auto list = lexget_userdata<handler_list>(L, 1, luaos_dispatcher_event);
+  list->~handler_list();
+  return 0;
+}
+
+static int lua_os_dispatcher_register(lua_State* L)
+{
+  dispatcher* self = check_dispatcher(L);
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "integer|string required");
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  lua_Number priority = luaL_optnumber(L, 4, 0);
+
+  lua_settop(L, 4);
+  lua_getiuservalue(L, 1, uv_events);     /* 5 */
+  lua_getiuservalue(L, 1, uv_functions);  /* 6 */
+
+  handler_list* list = find_event(L, 5, 2);
+  if (!list) {
+    list = lexnew_userdata<handler_list>(L, luaos_dispatcher_event);
+    new (list) handler_list(std::make_shared<handler_array>());
+    lua_pushvalue(L, 2);
+    lua_insert(L, -2);
+    lua_rawset(L, 5);
+  }
+  if (find_handler(L, **list, 6, 3) >= 0) {
+    luaL_argerror(L, 3, "handler exists");
+  }
+
+  lua_Integer id = ++self->next_id;
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, 6, id);
+
+  event_handler handler = { id, priority };
+  handler_array& handlers = writable(*list);
+  auto pos = std::upper_bound(handlers.begin(), handlers.end(), priority,
+    [](lua_Number value, const event_handler& item) { return value > item.priority; }
+  );
+  handlers.insert(pos, handler);
+
+  lua_pushvalue(L, 3);
+  return 1;
+}
+
+static int lua_os_dispatcher_unregister(lua_State* L)
+{
+  check_dispatcher(L);
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "integer|string required");
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+
+  lua_settop(L, 3);
+  lua_getiuservalue(L, 1, uv_events);     /* 4 */
+  lua_getiuservalue(L, 1, uv_functions);  /* 5 */
+
+  handler_list* list = find_event(L, 4, 2);
+  if (!list) {
+    return 0;
+  }
+  int index = find_handler(L, **list, 5, 3);
+  if (index < 0) {
+    return 0;
+  }
+  handler_array& handlers = writable(*list);
+  lua_pushnil(L);
+  lua_rawseti(L, 5, handlers[index].id);
+  handlers.erase(handlers.begin() + index);
+
+  if (handlers.empty()) {
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, 4);
+  }
+  return 0;
+}
+
+static int lua_os_dispatcher_dispatch(lua_State* L)
+{
+  check_dispatcher(L);
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "integer|string required");
+
+  int argc = lua_gettop(L) - 2;
+  luaL_checkstack(L, argc + 4, "too many arguments");
+  lua_getiuservalue(L, 1, uv_events);
+  handler_list* list = find_event(L, lua_gettop(L), 2);
+  lua_pop(L, 1);
+  if (!list) {
+    lua_pushboolean(L, 1);
+    lua_pushinteger(L, 0);
+    return 2;
+  }
+
+  lua_getiuservalue(L, 1, uv_functions);
+  int functions = lua_gettop(L);
+  lua_pushcfunction(L, luaos_traceback);
+  int traceback = lua_gettop(L);
+
+  bool result = true;
+  handler_list snapshot(*list);
+  for (const event_handler& handler : *snapshot)
+  {
+    if (lua_rawgeti(L, functions, handler.id) != LUA_TFUNCTION) {
+      lua_pop(L, 1);  /* unregistered by an earlier handler */
+      continue;
+    }
+    for (int i = 0; i < argc; i++) {
+      lua_pushvalue(L, 3 + i);
+    }
+    if (lua_pcall(L, argc, 0, traceback) != LUA_OK) {
+      luaos_metrics_count(metrics_counter::pcall_errors);
+      luaos_error("%s\n", lua_tostring(L, -1));
+      lua_pop(L, 1);
+      result = false;
+    }
+  }
+  lua_pushboolean(L, result ? 1 : 0);
+  lua_pushinteger(L, (lua_Integer)snapshot->size());
+  return 2;
+}
+
+/***********************************************************************************/
+
+static void init_metatable(lua_State* L)
+{
+  struct luaL_Reg methods[] = {
+    { "register",     lua_os_dispatcher_register    },
+    { "unregister",   lua_os_dispatcher_unregister  },
+    { "dispatch",     lua_os_dispatcher_dispatch    },
+    { NULL,           NULL                          },
+  };
+  lexnew_metatable(L, luaos_dispatcher_name, methods);
+  lua_pop(L, 1);
+
+  struct luaL_Reg event[] = {
+    { "__gc",         lua_os_dispatcher_event_gc    },
+    { NULL,           NULL                          },
+  };
+  lexnew_metatable(L, luaos_dispatcher_event, event);
+  lua_pop(L, 1);
+}
+
+/***********************************************************************************/
+
+int luaopen_dispatcher(lua_State* L)
+{
+  luaL_checkversion(L);
+  init_metatable(L);
+  lua_pushcfunction(L, lua_os_dispatcher_new);
+  return 1;
+}
+
+/***********************************************************************************/
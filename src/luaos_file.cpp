@@ -0,0 +1,530 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#define file_seek(fp, off, how) _fseeki64(fp, off, how)
+#define file_sync(fp)           ::_commit(_fileno(fp))
+#define file_fstat(fp, st)      _fstat64(_fileno(fp), st)
+typedef struct _stat64 file_stat;
+#else
+#include <unistd.h>
+#define file_seek(fp, off, how) fseeko(fp, (off_t)(off), how)
+#define file_sync(fp)           ::fsync(fileno(fp))
+#define file_fstat(fp, st)      fstat(fileno(fp), st)
+typedef struct stat file_stat;
+#endif
+
+#include "luaos_file.h"
+
+#define file_io_threads 4
+#define file_read_size  65536
+
+/*******************************************************************************/
+
+typedef std::function<void()> file_task;
+
+/*
+** Every file is pinned to one worker, so the operations on a file run in
+** the order they were asked for while other files go on in parallel.
+*/
+class file_worker final {
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::deque<file_task> _tasks;
+  bool _stopped;
+  std::thread _thread;
+
+  void run()
+  {
+    for (;;)
+    {
+      file_task task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [this]() { return _stopped || !_tasks.empty(); });
+        if (_tasks.empty()) {
+          return;
+        }
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+public:
+  file_worker()
+    : _stopped(false)
+    , _thread(std::bind(&file_worker::run, this)) {
+  }
+  ~file_worker()
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _stopped = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+  }
+  void post(file_task task)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _tasks.push_back(std::move(task));
+    }
+    _cond.notify_one();
+  }
+};
+
+class file_pool final {
+  std::vector<std::unique_ptr<file_worker>> _workers;
+  std::atomic<size_t> _next;
+
+public:
+  file_pool() : _next(0)
+  {
+    for (size_t i = 0; i < file_io_threads; i++) {
+      _workers.emplace_back(new file_worker());
+    }
+  }
+  file_worker& next()
+  {
+    return *_workers[_next++ % _workers.size()];
+  }
+  static file_pool& instance()
+  {
+    static file_pool pool;
+    return pool;
+  }
+};
+
+/*******************************************************************************/
+
+/*
+** The FILE is only touched on its worker. Every read and write seeks
+** first, which also satisfies stdio between switching directions.
+*/
+class async_file final {
+  FILE* _fp;
+  int _error;
+
+public:
+  file_worker& worker;
+  bool closed; /* asked to close, owned by the job */
+
+  async_file(file_worker& w)
+    : _fp(nullptr), _error(0), worker(w), closed(false) {
+  }
+  ~async_file() {
+    close();
+  }
+  int open(const std::string& filename, const std::string& mode)
+  {
+    _fp = fopen(filename.c_str(), mode.c_str());
+    _error = _fp ? 0 : errno;
+    return _error;
+  }
+  int check() const
+  {
+    return _fp ? 0 : (_error ? _error : EBADF);
+  }
+  int seek(lua_Integer offset, int how = SEEK_SET)
+  {
+    int ec = check();
+    if (ec) {
+      return ec;
+    }
+    if (offset < 0) { /* stay where the last operation stopped */
+      offset = 0;
+      how = SEEK_CUR;
+    }
+    return file_seek(_fp, offset, how) == 0 ? 0 : errno;
+  }
+  int read(std::string& data, lua_Integer size, lua_Integer offset)
+  {
+    int ec = seek(offset);
+    if (ec) {
+      return ec;
+    }
+    char buf[file_read_size];
+    while (size != 0)
+    {
+      size_t n = size < 0 || size > file_read_size ? file_read_size : (size_t)size;
+      n = fread(buf, 1, n, _fp);
+      if (n == 0) {
+        break;
+      }
+      data.append(buf, n);
+      size = size < 0 ? size : size - (lua_Integer)n;
+    }
+    return ferror(_fp) ? EIO : 0;
+  }
+  int write(const std::string& data, lua_Integer offset, size_t& bytes, int how = SEEK_SET)
+  {
+    bytes = 0;
+    int ec = seek(offset, how);
+    if (ec) {
+      return ec;
+    }
+    errno = 0;
+    bytes = fwrite(data.c_str(), 1, data.size(), _fp);
+    ec = errno; /* before anything else can touch it */
+    return bytes == data.size() ? 0 : (ec ? ec : EIO);
+  }
+  int flush()
+  {
+    int ec = check();
+    if (ec) {
+      return ec;
+    }
+    return fflush(_fp) == 0 ? 0 : errno;
+  }
+  int fsync()
+  {
+    int ec = flush();
+    if (ec) {
+      return ec;
+    }
+    return file_sync(_fp) == 0 ? 0 : errno;
+  }
+  int stat(file_stat& st)
+  {
+    int ec = flush();
+    if (ec) {
+      return ec;
+    }
+    return file_fstat(_fp, &st) == 0 ? 0 : errno;
+  }
+  int close()
+  {
+    if (!_fp) {
+      return 0;
+    }
+    int ec = fclose(_fp) == 0 ? 0 : errno;
+    _fp = nullptr;
+    _error = EBADF;
+    return ec;
+  }
+};
+
+typedef std::shared_ptr<async_file> file_ref;
+
+/*******************************************************************************/
+
+/* pushes the results of a finished operation, returns how many */
+typedef std::function<int(lua_State*)> file_result;
+
+static void complete(io_handler ios, int callback, file_result result)
+{
+  if (callback == LUA_NOREF) {
+    return;
+  }
+  ios->post([callback, result]()
+    {
+      lua_State* L = luaos_local.lua_state();
+      stack_rollback rollback(L);
+
+      lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+      luaL_unref (L, LUA_REGISTRYINDEX, callback);
+
+      if (luaos_pcall(L, result(L), 0) != LUA_OK) {
+        luaos_error("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+    }
+  );
+}
+
+static file_result error_result(int ec)
+{
+  return [ec](lua_State* L) {
+    lua_pushinteger(L, ec);
+    return 1;
+  };
+}
+
+static file_result bytes_result(int ec, size_t bytes)
+{
+  return [ec, bytes](lua_State* L) {
+    lua_pushinteger(L, ec);
+    lua_pushinteger(L, (lua_Integer)bytes);
+    return 2;
+  };
+}
+
+/*******************************************************************************/
+
+static file_ref& check_file(lua_State* L, int i = 1)
+{
+  file_ref& self = *lexget_userdata<file_ref>(L, i, luaos_file_name);
+  if (self->closed) {
+    luaL_error(L, "attempt to use a closed file");
+  }
+  return self;
+}
+
+/* finds the callback at the end of the arguments, the rest stay in argc */
+static int check_callback(lua_State* L, int first, int& argc, bool required)
+{
+  argc = lua_gettop(L);
+  if (argc >= first && lua_isfunction(L, argc)) {
+    return argc--;
+  }
+  if (required) {
+    luaL_error(L, "the last argument must be a callback function");
+  }
+  return 0;
+}
+
+/* after the arguments are checked, so an error can't leak the reference */
+static int ref_callback(lua_State* L, int index)
+{
+  if (index == 0) {
+    return LUA_NOREF;
+  }
+  lua_pushvalue(L, index);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static lua_Integer check_offset(lua_State* L, int i, int argc)
+{
+  if (i > argc || lua_isnil(L, i)) {
+    return -1;
+  }
+  lua_Integer offset = luaL_checkinteger(L, i);
+  luaL_argcheck(L, offset >= 0, i, "must be >= 0");
+  return offset;
+}
+
+static int lua_os_file_open(lua_State* L)
+{
+  int argc;
+  int index = check_callback(L, 2, argc, false);
+  std::string filename(luaL_checkstring(L, 1));
+  std::string mode(argc >= 2 && !lua_isnil(L, 2) ? luaL_checkstring(L, 2) : "rb");
+  luaL_argcheck(L, !mode.empty() && strchr("rwa", mode[0]), 2, "invalid mode");
+
+  file_ref file(new async_file(file_pool::instance().next()));
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, filename, mode, ios, callback]() {
+    complete(ios, callback, error_result(file->open(filename, mode)));
+  });
+
+  auto userdata = lexnew_userdata<file_ref>(L, luaos_file_name);
+  new (userdata) file_ref(file);
+  return 1;
+}
+
+static int lua_os_file_gc(lua_State* L)
+{
+  file_ref& self = *lexget_userdata<file_ref>(L, 1, luaos_file_name);
+  if (!self->closed)
+  {
+    file_ref file = self;
+    file->worker.post([file]() { file->close(); });
+  }
+  self.~file_ref();
+  return 0;
+}
+
+/* file:read([size [, offset]], callback), callback(ec, data) */
+static int lua_os_file_read(lua_State* L)
+{
+  int argc;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 2, argc, true);
+  lua_Integer size = 2 <= argc && !lua_isnil(L, 2) ? luaL_checkinteger(L, 2) : -1;
+  lua_Integer offset = check_offset(L, 3, argc);
+
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, size, offset, ios, callback]() {
+    std::shared_ptr<std::string> data(new std::string());
+    int ec = file->read(*data, size, offset);
+    complete(ios, callback, [ec, data](lua_State* L) {
+      lua_pushinteger(L, ec);
+      lua_pushlstring(L, data->c_str(), data->size());
+      return 2;
+    });
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* file:write(data [, offset] [, callback]), callback(ec, bytes) */
+static int lua_os_file_write(lua_State* L)
+{
+  int argc;
+  size_t size = 0;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 3, argc, false);
+  const char* data = luaL_checklstring(L, 2, &size);
+  lua_Integer offset = check_offset(L, 3, argc);
+
+  std::string buffer(data, size);
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, buffer, offset, ios, callback]() {
+    size_t bytes;
+    int ec = file->write(buffer, offset, bytes);
+    complete(ios, callback, bytes_result(ec, bytes));
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* file:append(data [, callback]), callback(ec, bytes) */
+static int lua_os_file_append(lua_State* L)
+{
+  int argc;
+  size_t size = 0;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 3, argc, false);
+  const char* data = luaL_checklstring(L, 2, &size);
+
+  std::string buffer(data, size);
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, buffer, ios, callback]() {
+    size_t bytes;
+    int ec = file->write(buffer, 0, bytes, SEEK_END);
+    complete(ios, callback, bytes_result(ec, bytes));
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lua_os_file_flush(lua_State* L)
+{
+  int argc;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 2, argc, false);
+
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, ios, callback]() {
+    complete(ios, callback, error_result(file->flush()));
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lua_os_file_fsync(lua_State* L)
+{
+  int argc;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 2, argc, false);
+
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, ios, callback]() {
+    complete(ios, callback, error_result(file->fsync()));
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* file:stat(callback), callback(ec, {size, atime, mtime, ctime}) */
+static int lua_os_file_stat(lua_State* L)
+{
+  int argc;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 2, argc, true);
+
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, ios, callback]() {
+    file_stat st;
+    int ec = file->stat(st);
+    complete(ios, callback, [ec, st](lua_State* L) {
+      lua_pushinteger(L, ec);
+      if (ec) {
+        return 1;
+      }
+      lua_newtable(L);
+      lua_pushinteger(L, (lua_Integer)st.st_size);
+      lua_setfield(L, -2, "size");
+      lua_pushinteger(L, (lua_Integer)st.st_atime);
+      lua_setfield(L, -2, "atime");
+      lua_pushinteger(L, (lua_Integer)st.st_mtime);
+      lua_setfield(L, -2, "mtime");
+      lua_pushinteger(L, (lua_Integer)st.st_ctime);
+      lua_setfield(L, -2, "ctime");
+      return 2;
+    });
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lua_os_file_close(lua_State* L)
+{
+  int argc;
+  file_ref file = check_file(L);
+  int index = check_callback(L, 2, argc, false);
+
+  file->closed = true;
+  int callback = ref_callback(L, index);
+  auto ios = luaos_local.lua_service();
+  file->worker.post([file, ios, callback]() {
+    complete(ios, callback, error_result(file->close()));
+  });
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*******************************************************************************/
+
+namespace file
+{
+  void init_metatable(lua_State* L)
+  {
+    struct luaL_Reg methods[] = {
+      { "__gc",         lua_os_file_gc      },
+      { "read",         lua_os_file_read    },
+      { "write",        lua_os_file_write   },
+      { "append",       lua_os_file_append  },
+      { "flush",        lua_os_file_flush   },
+      { "fsync",        lua_os_file_fsync   },
+      { "stat",         lua_os_file_stat    },
+      { "close",        lua_os_file_close   },
+      { NULL,           NULL                },
+    };
+    lexnew_metatable(L, luaos_file_name, methods);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "os");
+    lua_pushcfunction(L, lua_os_file_open);
+    lua_setfield(L, -2, "file");
+    lua_pop(L, 1); //pop os from stack
+  }
+}
+
+/*******************************************************************************/
@@ -0,0 +1,636 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "luaos_frozen.h"
+
+#define max_frozen_depth 200
+
+/*
+** A frozen table is converted once into flat arrays owned by one object,
+** which every job shares read-only. Strings are stored once in a single
+** pool, each table keeps its 1..n part as an array and the rest in an
+** open addressing hash, nested tables are referenced by index.
+**
+** Jobs see it through a proxy userdata, a lookup reads the arrays in
+** place and never copies the table.
+*/
+
+enum frozen_type {
+  fz_nil, fz_false, fz_true, fz_integer, fz_number, fz_string, fz_table,
+};
+
+struct frozen_value {
+  uint32_t type;
+  union {
+    lua_Integer i;
+    lua_Number  n;
+    uint32_t    table;
+    struct { uint32_t offset, size; } s;
+  };
+};
+
+struct frozen_entry {
+  frozen_value key;
+  frozen_value value;
+};
+
+struct frozen_table {
+  uint32_t array, narray;  /* values of keys 1..narray */
+  uint32_t hash,  nhash;   /* slots, nhash is 0 or a power of 2 */
+};
+
+struct frozen_data {
+  std::string strings;
+  std::vector<frozen_value> arrays;
+  std::vector<frozen_entry> entries;
+  std::vector<frozen_table> tables;
+};
+
+typedef std::shared_ptr<const frozen_data> frozen_ref;
+
+struct frozen_proxy {
+  frozen_ref data;
+  uint32_t   table;
+};
+
+static std::mutex _mutex;
+static std::map<std::string, frozen_ref> _frozens;
+
+/*******************************************************************************/
+
+static uint64_t hash_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hash_bytes(const char* data, size_t size)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return hash_mix(h);
+}
+
+static uint64_t hash_value(const frozen_data& data, const frozen_value& v)
+{
+  switch (v.type) {
+  case fz_integer:
+    return hash_mix((uint64_t)v.i);
+  case fz_number: {
+    uint64_t bits;
+    memcpy(&bits, &v.n, sizeof(bits));
+    return hash_mix(bits);
+  }
+  case fz_string:
+    return hash_bytes(data.strings.data() + v.s.offset, v.s.size);
+  }
+  return hash_mix(v.type);
+}
+
+/*******************************************************************************/
+
+class frozen_builder final {
+  lua_State*   L;
+  frozen_data& _data;
+  int          _depth;
+  std::unordered_map<const void*, uint32_t> _visited;
+  std::unordered_map<std::string, uint32_t> _strings;
+
+  static void fail(const char* message) {
+    throw std::runtime_error(message);
+  }
+
+  frozen_value make_string(int i)
+  {
+    size_t size = 0;
+    const char* data = lua_tolstring(L, i, &size);
+    std::string str(data, size);
+    frozen_value v;
+    v.type = fz_string;
+    v.s.size = (uint32_t)size;
+    auto iter = _strings.find(str);
+    if (iter != _strings.end()) {
+      v.s.offset = iter->second;
+      return v;
+    }
+    if (_data.strings.size() + size > UINT32_MAX) {
+      fail("frozen strings too large");
+    }
+    v.s.offset = (uint32_t)_data.strings.size();
+    _data.strings.append(data, size);
+    _strings[str] = v.s.offset;
+    return v;
+  }
+
+  frozen_value make_value(int i)
+  {
+    frozen_value v;
+    v.i = 0;
+    switch (lua_type(L, i)) {
+    case LUA_TNIL:
+      v.type = fz_nil;
+      break;
+    case LUA_TBOOLEAN:
+      v.type = lua_toboolean(L, i) ? fz_true : fz_false;
+      break;
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, i)) {
+        v.type = fz_integer;
+        v.i = lua_tointeger(L, i);
+      }
+      else {
+        v.type = fz_number;
+        v.n = lua_tonumber(L, i);
+      }
+      break;
+    case LUA_TSTRING:
+      return make_string(i);
+    case LUA_TTABLE:
+      v.type = fz_table;
+      v.table = make_table(i);
+      break;
+    default:
+      fail("only nil, boolean, number, string and table can be frozen");
+    }
+    return v;
+  }
+
+  uint32_t make_table(int i)
+  {
+    i = lua_absindex(L, i);
+    const void* pointer = lua_topointer(L, i);
+    auto iter = _visited.find(pointer);
+    if (iter != _visited.end()) {
+      return iter->second;
+    }
+    if (++_depth > max_frozen_depth) {
+      fail("table nested too deep");
+    }
+    if (!lua_checkstack(L, 4)) {
+      fail("stack overflow");
+    }
+    uint32_t index = (uint32_t)_data.tables.size();
+    _data.tables.push_back(frozen_table());
+    _visited[pointer] = index;
+
+    /* nested tables are appended while we walk, so collect first */
+    std::vector<frozen_value> items;
+    while (lua_rawgeti(L, i, (lua_Integer)items.size() + 1) != LUA_TNIL) {
+      items.push_back(make_value(-1));
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    std::vector<frozen_entry> pairs;
+    lua_pushnil(L);
+    while (lua_next(L, i))
+    {
+      if (lua_isinteger(L, -2)) {
+        lua_Integer key = lua_tointeger(L, -2);
+        if (key >= 1 && key <= (lua_Integer)items.size()) {
+          lua_pop(L, 1);
+          continue;
+        }
+      }
+      frozen_entry entry;
+      entry.key   = make_value(-2);
+      entry.value = make_value(-1);
+      pairs.push_back(entry);
+      lua_pop(L, 1);
+    }
+
+    frozen_table t;
+    t.array  = (uint32_t)_data.arrays.size();
+    t.narray = (uint32_t)items.size();
+    t.hash   = (uint32_t)_data.entries.size();
+    t.nhash  = 0;
+    if (!pairs.empty()) {
+      t.nhash = 1;
+      while (t.nhash * 3 < pairs.size() * 4) {
+        t.nhash <<= 1;
+      }
+    }
+    if (_data.arrays.size() + items.size() > UINT32_MAX || _data.entries.size() + t.nhash > UINT32_MAX) {
+      fail("frozen table too large");
+    }
+    _data.arrays.insert(_data.arrays.end(), items.begin(), items.end());
+
+    frozen_entry empty;
+    memset(&empty, 0, sizeof(empty));
+    _data.entries.resize(_data.entries.size() + t.nhash, empty);
+    for (const frozen_entry& entry : pairs)
+    {
+      uint32_t slot = (uint32_t)hash_value(_data, entry.key) & (t.nhash - 1);
+      while (_data.entries[t.hash + slot].key.type != fz_nil) {
+        slot = (slot + 1) & (t.nhash - 1);
+      }
+      _data.entries[t.hash + slot] = entry;
+    }
+    _data.tables[index] = t;
+    _depth--;
+    return index;
+  }
+
+public:
+  frozen_builder(lua_State* state, frozen_data& data)
+    : L(state), _data(data), _depth(0) {
+  }
+  void build(int i) {
+    make_table(i);
+  }
+};
+
+/*******************************************************************************/
+
+static bool same_key(const frozen_data& data, const frozen_value& a, const frozen_value& b)
+{
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+  case fz_integer:
+    return a.i == b.i;
+  case fz_number:
+    return a.n == b.n;
+  case fz_string:
+    return a.s.size == b.s.size && memcmp(data.strings.data() + a.s.offset, data.strings.data() + b.s.offset, a.s.size) == 0;
+  }
+  return true;
+}
+
+/* slot of the key at index i, -1 if missing */
+static int64_t find_slot(const frozen_data& data, const frozen_table& t, lua_State* L, int i)
+{
+  if (t.nhash == 0) {
+    return -1;
+  }
+  frozen_value key;
+  key.i = 0;
+  size_t size = 0;
+  const char* str = 0;
+  switch (lua_type(L, i)) {
+  case LUA_TBOOLEAN:
+    key.type = lua_toboolean(L, i) ? fz_true : fz_false;
+    break;
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, i)) {
+      key.type = fz_integer;
+      key.i = lua_tointeger(L, i);
+    }
+    else {
+      key.type = fz_number;
+      key.n = lua_tonumber(L, i);
+    }
+    break;
+  case LUA_TSTRING:
+    key.type = fz_string;
+    str = lua_tolstring(L, i, &size);
+    break;
+  default:
+    return -1;
+  }
+  uint64_t h = str ? hash_bytes(str, size) : hash_value(data, key);
+  uint32_t slot = (uint32_t)h & (t.nhash - 1);
+  for (;;)
+  {
+    const frozen_value& k = data.entries[t.hash + slot].key;
+    if (k.type == fz_nil) {
+      return -1;
+    }
+    if (k.type == key.type)
+    {
+      if (str) {
+        if (k.s.size == size && memcmp(data.strings.data() + k.s.offset, str, size) == 0) {
+          return slot;
+        }
+      }
+      else if (same_key(data, k, key)) {
+        return slot;
+      }
+    }
+    slot = (slot + 1) & (t.nhash - 1);
+  }
+}
+
+/* normalize float keys with an integral value, as lua tables do */
+static bool integer_key(lua_State* L, int i, lua_Integer& key)
+{
+  if (lua_type(L, i) != LUA_TNUMBER) {
+    return false;
+  }
+  int isnum = 0;
+  key = lua_tointegerx(L, i, &isnum);
+  return isnum != 0;
+}
+
+static void push_proxy(lua_State* L, int owner, uint32_t table);
+
+static void push_value(lua_State* L, int owner, const frozen_data& data, const frozen_value& v)
+{
+  switch (v.type) {
+  case fz_false:
+  case fz_true:
+    lua_pushboolean(L, v.type == fz_true ? 1 : 0);
+    break;
+  case fz_integer:
+    lua_pushinteger(L, v.i);
+    break;
+  case fz_number:
+    lua_pushnumber(L, v.n);
+    break;
+  case fz_string:
+    lua_pushlstring(L, data.strings.data() + v.s.offset, v.s.size);
+    break;
+  case fz_table:
+    push_proxy(L, owner, v.table);
+    break;
+  default:
+    lua_pushnil(L);
+  }
+}
+
+/*
+** Proxies of one frozen object share a weak cache in this state, so
+** reading the same nested table twice returns the same userdata.
+*/
+static void push_proxy(lua_State* L, int owner, uint32_t table)
+{
+  lua_getiuservalue(L, owner, 1);
+  if (lua_rawgeti(L, -1, (lua_Integer)table) != LUA_TNIL) {
+    lua_remove(L, -2);
+    return;
+  }
+  lua_pop(L, 1);
+  auto parent = lexget_userdata<frozen_proxy>(L, owner, luaos_frozen_name);
+  auto self = (frozen_proxy*)lua_newuserdatauv(L, sizeof(frozen_proxy), 1);
+  new (self) frozen_proxy();
+  self->data  = parent->data;
+  self->table = table;
+  lexset_metatable(L, luaos_frozen_name);
+  lua_pushvalue(L, -2);
+  lua_setiuservalue(L, -2, 1);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, (lua_Integer)table);
+  lua_remove(L, -2);
+}
+
+static void push_root(lua_State* L, const frozen_ref& data)
+{
+  auto self = (frozen_proxy*)lua_newuserdatauv(L, sizeof(frozen_proxy), 1);
+  new (self) frozen_proxy();
+  self->data  = data;
+  self->table = 0;
+  lexset_metatable(L, luaos_frozen_name);
+  lua_createtable(L, 0, 0);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, 0);
+  lua_setiuservalue(L, -2, 1);
+}
+
+static frozen_proxy* check_proxy(lua_State* L, int i = 1)
+{
+  return lexget_userdata<frozen_proxy>(L, i, luaos_frozen_name);
+}
+
+/*******************************************************************************/
+
+static int lua_frozen_gc(lua_State* L)
+{
+  frozen_proxy* self = check_proxy(L);
+  self->~frozen_proxy();
+  return 0;
+}
+
+static int lua_frozen_index(lua_State* L)
+{
+  frozen_proxy* self = check_proxy(L);
+  const frozen_data& data = *self->data;
+  const frozen_table& t = data.tables[self->table];
+
+  lua_Integer key;
+  if (integer_key(L, 2, key) && key >= 1 && key <= (lua_Integer)t.narray) {
+    push_value(L, 1, data, data.arrays[t.array + key - 1]);
+    return 1;
+  }
+  if (lua_type(L, 2) == LUA_TNUMBER && integer_key(L, 2, key)) {
+    lua_pushinteger(L, key);
+    lua_replace(L, 2);
+  }
+  int64_t slot = find_slot(data, t, L, 2);
+  if (slot < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  push_value(L, 1, data, data.entries[t.hash + slot].value);
+  return 1;
+}
+
+static int lua_frozen_newindex(lua_State* L)
+{
+  return luaL_error(L, "attempt to modify a frozen table");
+}
+
+static int lua_frozen_len(lua_State* L)
+{
+  frozen_proxy* self = check_proxy(L);
+  lua_pushinteger(L, (lua_Integer)self->data->tables[self->table].narray);
+  return 1;
+}
+
+/* stateless like next(), positions are the array part then the hash slots */
+static int lua_frozen_next(lua_State* L)
+{
+  frozen_proxy* self = check_proxy(L);
+  const frozen_data& data = *self->data;
+  const frozen_table& t = data.tables[self->table];
+  lua_settop(L, 2);
+
+  size_t pos = 0;
+  lua_Integer key;
+  if (lua_isnil(L, 2)) {
+    pos = 0;
+  }
+  else if (integer_key(L, 2, key) && key >= 1 && key <= (lua_Integer)t.narray) {
+    pos = (size_t)key;
+  }
+  else {
+    int64_t slot = find_slot(data, t, L, 2);
+    luaL_argcheck(L, slot >= 0, 2, "invalid key to 'next'");
+    pos = t.narray + (size_t)slot + 1;
+  }
+  if (pos < t.narray) {
+    lua_pushinteger(L, (lua_Integer)pos + 1);
+    push_value(L, 1, data, data.arrays[t.array + pos]);
+    return 2;
+  }
+  for (size_t slot = pos - t.narray; slot < t.nhash; slot++)
+  {
+    const frozen_entry& entry = data.entries[t.hash + slot];
+    if (entry.key.type != fz_nil) {
+      push_value(L, 1, data, entry.key);
+      push_value(L, 1, data, entry.value);
+      return 2;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int lua_frozen_pairs(lua_State* L)
+{
+  check_proxy(L);
+  lua_pushcfunction(L, lua_frozen_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int lua_frozen_tostring(lua_State* L)
+{
+  frozen_proxy* self = check_proxy(L);
+  lua_pushfstring(L, "%s: %p", luaos_frozen_name, (const void*)&self->data->tables[self->table]);
+  return 1;
+}
+
+/*******************************************************************************/
+
+static std::string check_name(lua_State* L, int i)
+{
+  size_t size = 0;
+  const char* name = luaL_checklstring(L, i, &size);
+  return std::string(name, size);
+}
+
+/* the frozen copy of the table at i, or null with the error pushed */
+static frozen_ref build_frozen(lua_State* L, int i)
+{
+  int top = lua_gettop(L);
+  std::shared_ptr<frozen_data> data(new frozen_data());
+  try {
+    frozen_builder(L, *data).build(i);
+  }
+  catch (const std::exception& e) {
+    lua_settop(L, top);
+    lua_pushstring(L, e.what());
+    return frozen_ref();
+  }
+  data->strings.shrink_to_fit();
+  data->arrays.shrink_to_fit();
+  data->entries.shrink_to_fit();
+  data->tables.shrink_to_fit();
+  return data;
+}
+
+static int lua_storage_freeze(lua_State* L)
+{
+  luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+
+  frozen_ref ref = build_frozen(L, 2);
+  if (!ref) {
+    return luaL_argerror(L, 2, lua_tostring(L, -1));
+  }
+  std::string name = check_name(L, 1);
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _frozens[name] = ref;
+  }
+  push_root(L, ref);
+  return 1;
+}
+
+static int lua_storage_frozen(lua_State* L)
+{
+  std::string name = check_name(L, 1);
+  frozen_ref ref;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto iter = _frozens.find(name);
+    if (iter != _frozens.end()) {
+      ref = iter->second;
+    }
+  }
+  if (!ref) {
+    lua_pushnil(L);
+    return 1;
+  }
+  push_root(L, ref);
+  return 1;
+}
+
+static int lua_storage_unfreeze(lua_State* L)
+{
+  std::string name = check_name(L, 1);
+  std::unique_lock<std::mutex> lock(_mutex);
+  lua_pushboolean(L, _frozens.erase(name) ? 1 : 0);
+  return 1;
+}
+
+/*******************************************************************************/
+
+namespace frozen
+{
+  void init_metatable(lua_State* L)
+  {
+    struct luaL_Reg methods[] = {
+      { "__gc",       lua_frozen_gc       },
+      { "__newindex", lua_frozen_newindex },
+      { "__len",      lua_frozen_len      },
+      { "__pairs",    lua_frozen_pairs    },
+      { "__tostring", lua_frozen_tostring },
+      { NULL,         NULL                },
+    };
+    lexnew_metatable(L, luaos_frozen_name, methods);
+    lua_pushcfunction(L, lua_frozen_index);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "global");
+    if (lua_istable(L, -1))
+    {
+      struct luaL_Reg functions[] = {
+        { "freeze",   lua_storage_freeze   },
+        { "frozen",   lua_storage_frozen   },
+        { "unfreeze", lua_storage_unfreeze },
+        { NULL,       NULL                 },
+      };
+      luaL_setfuncs(L, functions, 0);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+/*******************************************************************************/
@@ -15,6 +15,7 @@
 
 #include "luaos.h"
 #include "luaos_compile.h"
+#include "luaos_metrics.h"
 
 /********************************************************************************/
 
@@ -549,6 +550,7 @@ local_values::local_values() {
   }
   _L = luaos_newstate(luaos_loader, this);
   luaos_openlibs(_L);
+  luaos_metrics_attach(_ios);
 }
 
 local_values::~local_values() {
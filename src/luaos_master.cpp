@@ -15,8 +15,10 @@
 
 #include <map>
 #include "luaos_master.h"
+#include "luaos_state.h"
 
 static int thd_count = 1;
+static int thd_cpu   = -1;
 static int started   = 0;
 static socket_type listener;
 static io_handler  io_services[max_thd_count];
@@ -132,8 +134,30 @@ static bool async_accept()
 
 /***********************************************************************************/
 
+/* pin io thread index to the index-th allowed cpu from thd_cpu, wrapping */
+static void bind_thread(int index)
+{
+  int allowed[256];
+  size_t count = os::get_affinity(allowed, sizeof(allowed) / sizeof(allowed[0]));
+  size_t first = 0;
+  while (first < count && allowed[first] < thd_cpu) {
+    first++;
+  }
+  if (count == 0) {
+    luaos_error("master io thread %d: no cpu is allowed\n", index);
+    return;
+  }
+  int cpu = allowed[(first + (size_t)index) % count];
+  if (!os::affinity(&cpu, 1)) {
+    luaos_error("master io thread %d: failed to bind cpu %d\n", index, cpu);
+  }
+}
+
 static void threadproc(int index)
 {
+  if (thd_cpu >= 0) {
+    bind_thread(index);
+  }
   auto ios = luaos_local.lua_service();
   io_services[index] = ios;
   started++;
@@ -154,11 +178,12 @@ void luaos_stop_master()
   }
 }
 
-bool luaos_start_master(const char* host, unsigned short port, int threads)
+bool luaos_start_master(const char* host, unsigned short port, int threads, int cpu)
 {
   if (listener) {
     return false;
   }
+  thd_cpu   = cpu;
   thd_count = threads;
   if (thd_count < 1) {
     thd_count = 1;
@@ -27,7 +27,8 @@ void send_to_all (const std::string& data);
 
 void send_to_other(const std::string& data, socket_type peer);
 
-bool luaos_start_master(const char* host, unsigned short port, int threads);
+/* cpu >= 0 pins io thread i to the i-th allowed cpu from cpu on (wrapping) */
+bool luaos_start_master(const char* host, unsigned short port, int threads, int cpu = -1);
 
 void luaos_stop_master();
 
@@ -0,0 +1,366 @@
+
+/************************************************************************************
+**
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+************************************************************************************/
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "luaos_metrics.h"
+
+/***********************************************************************************/
+
+static const char* counter_names[] = {
+  "handlers",
+  "publish_sent",
+  "publish_recv",
+  "rpc_calls",
+  "rpc_errors",
+  "pcall_errors",
+  "socket_accepts",
+  "socket_connects",
+  "socket_recv_bytes",
+  "socket_send_bytes",
+};
+
+static const char* histogram_names[] = {
+  "publish_latency",
+  "rpc_latency",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+/***********************************************************************************/
+
+/*
+** Log-linear buckets: exact below 4, then 4 sub buckets per power of two,
+** so every bucket is within 25% of the values it holds.
+*/
+#define histogram_sub_bits  2
+#define histogram_sub_count (1 << histogram_sub_bits)
+#define histogram_buckets   (64 * histogram_sub_count)
+
+static inline int highest_bit(uint64_t v)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse64(&index, v);
+  return (int)index;
+#else
+  return 63 - __builtin_clzll(v);
+#endif
+}
+
+static inline size_t bucket_index(uint64_t v)
+{
+  if (v < histogram_sub_count) {
+    return (size_t)v;
+  }
+  int msb = highest_bit(v);
+  size_t sub = (size_t)(v >> (msb - histogram_sub_bits)) & (histogram_sub_count - 1);
+  return (size_t)(msb - histogram_sub_bits + 1) * histogram_sub_count + sub;
+}
+
+static inline uint64_t bucket_upper(size_t index)
+{
+  if (index < histogram_sub_count) {
+    return index;
+  }
+  int msb = (int)(index / histogram_sub_count) + histogram_sub_bits - 1;
+  uint64_t sub = index % histogram_sub_count;
+  uint64_t lower = (histogram_sub_count + sub) << (msb - histogram_sub_bits);
+  return lower + ((uint64_t)1 << (msb - histogram_sub_bits)) - 1;
+}
+
+/* single writer: the owner thread, readers may see a slightly stale value */
+template <typename _Ty>
+static inline void local_add(std::atomic<_Ty>& v, _Ty n)
+{
+  v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct histogram_type final {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+  std::atomic<uint64_t> buckets[histogram_buckets];
+
+  inline histogram_type() : count(0), sum(0), max(0) {
+    for (size_t i = 0; i < histogram_buckets; i++) {
+      buckets[i] = 0;
+    }
+  }
+  inline void record(uint64_t v) {
+    local_add<uint64_t>(buckets[bucket_index(v)], 1);
+    local_add<uint64_t>(count, 1);
+    local_add<uint64_t>(sum, v);
+    if (v > max.load(std::memory_order_relaxed)) {
+      max.store(v, std::memory_order_relaxed);
+    }
+  }
+  inline uint64_t quantile(double q) const {
+    uint64_t total = count.load(std::memory_order_relaxed);
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(q * total), seen = 0;
+    for (size_t i = 0; i < histogram_buckets; i++) {
+      seen += buckets[i].load(std::memory_order_relaxed);
+      if (seen > rank) {
+        uint64_t upper = bucket_upper(i);
+        uint64_t limit = max.load(std::memory_order_relaxed);
+        return upper < limit ? upper : limit;
+      }
+    }
+    return max.load(std::memory_order_relaxed);
+  }
+};
+
+struct metrics_slot final {
+  int id = 0;
+  io_handler ios;  /* guarded by _mutex */
+  std::atomic<size_t> heap{ 0 };
+  std::atomic<uint64_t> cpus{ 0 }; /* pinned cpus, 0 if not pinned */
+  std::atomic<uint64_t> counters[(size_t)metrics_counter::count];
+  histogram_type histograms[(size_t)metrics_histogram::count];
+
+  inline metrics_slot() {
+    for (size_t i = 0; i < (size_t)metrics_counter::count; i++) {
+      counters[i] = 0;
+    }
+  }
+};
+
+typedef std::shared_ptr<metrics_slot> metrics_handler;
+
+static std::mutex _mutex;
+static std::vector<std::weak_ptr<metrics_slot>> _slots;
+static thread_local metrics_handler _local;
+
+static metrics_slot* local_slot()
+{
+  if (!_local) {
+    _local = std::make_shared<metrics_slot>();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _slots.push_back(_local);
+  }
+  return _local.get();
+}
+
+static std::vector<metrics_handler> all_slots()
+{
+  std::vector<metrics_handler> result;
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (auto iter = _slots.begin(); iter != _slots.end();)
+  {
+    metrics_handler slot = iter->lock();
+    if (!slot) {
+      iter = _slots.erase(iter);
+      continue;
+    }
+    if (slot->ios) {
+      result.push_back(slot);
+    }
+    ++iter;
+  }
+  return result;
+}
+
+/***********************************************************************************/
+
+void luaos_metrics_attach(io_handler ios)
+{
+  metrics_slot* slot = local_slot();
+  std::unique_lock<std::mutex> lock(_mutex);
+  slot->ios = ios;
+  slot->id  = ios->id();
+}
+
+void luaos_metrics_count(metrics_counter which, size_t n)
+{
+  local_add<uint64_t>(local_slot()->counters[(size_t)which], n);
+}
+
+void luaos_metrics_record(metrics_histogram which, size_t us)
+{
+  local_slot()->histograms[(size_t)which].record(us);
+}
+
+void luaos_metrics_heap(size_t bytes)
+{
+  local_slot()->heap.store(bytes, std::memory_order_relaxed);
+}
+
+void luaos_metrics_affinity(const int* cpus, size_t count)
+{
+  uint64_t mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (cpus[i] >= 0 && cpus[i] < 64) {
+      mask |= (uint64_t)1 << cpus[i];
+    }
+  }
+  local_slot()->cpus.store(mask, std::memory_order_relaxed);
+}
+
+/***********************************************************************************/
+
+static void push_histogram(lua_State* L, const histogram_type& h)
+{
+  lua_newtable(L);
+  lua_pushinteger(L, (lua_Integer)h.count.load());
+  lua_setfield(L, -2, "count");
+  lua_pushinteger(L, (lua_Integer)h.sum.load());
+  lua_setfield(L, -2, "sum");
+  lua_pushinteger(L, (lua_Integer)h.max.load());
+  lua_setfield(L, -2, "max");
+  lua_pushinteger(L, (lua_Integer)h.quantile(0.5));
+  lua_setfield(L, -2, "p50");
+  lua_pushinteger(L, (lua_Integer)h.quantile(0.9));
+  lua_setfield(L, -2, "p90");
+  lua_pushinteger(L, (lua_Integer)h.quantile(0.99));
+  lua_setfield(L, -2, "p99");
+}
+
+static std::string cpus_string(uint64_t mask)
+{
+  std::string result;
+  for (int i = 0; i < 64; i++)
+  {
+    if (mask & ((uint64_t)1 << i)) {
+      if (!result.empty()) {
+        result += ',';
+      }
+      result += std::to_string(i);
+    }
+  }
+  return result;
+}
+
+static int stats_table(lua_State* L, const std::vector<metrics_handler>& slots)
+{
+  lua_createtable(L, 0, (int)slots.size());
+  for (auto& slot : slots)
+  {
+    lua_newtable(L);
+    for (size_t i = 0; i < (size_t)metrics_counter::count; i++) {
+      lua_pushinteger(L, (lua_Integer)slot->counters[i].load());
+      lua_setfield(L, -2, counter_names[i]);
+    }
+    for (size_t i = 0; i < (size_t)metrics_histogram::count; i++) {
+      push_histogram(L, slot->histograms[i]);
+      lua_setfield(L, -2, histogram_names[i]);
+    }
+    lua_pushinteger(L, (lua_Integer)slot->ios->pending());
+    lua_setfield(L, -2, "pending");
+    lua_pushinteger(L, (lua_Integer)slot->heap.load());
+    lua_setfield(L, -2, "heap");
+    lua_newtable(L);
+    uint64_t mask = slot->cpus.load();
+    for (int i = 0, n = 0; i < 64; i++) {
+      if (mask & ((uint64_t)1 << i)) {
+        lua_pushinteger(L, i);
+        lua_rawseti(L, -2, ++n);
+      }
+    }
+    lua_setfield(L, -2, "cpus");
+    lua_rawseti(L, -2, slot->id);
+  }
+  return 1;
+}
+
+static int stats_prometheus(lua_State* L, const std::vector<metrics_handler>& slots)
+{
+  char line[256];
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+
+  for (size_t i = 0; i < (size_t)metrics_counter::count; i++)
+  {
+    snprintf(line, sizeof(line), "# TYPE luaos_%s_total counter\n", counter_names[i]);
+    luaL_addstring(&b, line);
+    for (auto& slot : slots) {
+      snprintf(line, sizeof(line), "luaos_%s_total{job=\"%d\"} %llu\n",
+        counter_names[i], slot->id, (unsigned long long)slot->counters[i].load()
+      );
+      luaL_addstring(&b, line);
+    }
+  }
+  luaL_addstring(&b, "# TYPE luaos_pending_messages gauge\n");
+  for (auto& slot : slots) {
+    snprintf(line, sizeof(line), "luaos_pending_messages{job=\"%d\"} %zu\n", slot->id, slot->ios->pending());
+    luaL_addstring(&b, line);
+  }
+  luaL_addstring(&b, "# TYPE luaos_heap_bytes gauge\n");
+  for (auto& slot : slots) {
+    snprintf(line, sizeof(line), "luaos_heap_bytes{job=\"%d\"} %zu\n", slot->id, slot->heap.load());
+    luaL_addstring(&b, line);
+  }
+  luaL_addstring(&b, "# TYPE luaos_affinity_info gauge\n");
+  for (auto& slot : slots)
+  {
+    uint64_t mask = slot->cpus.load();
+    if (mask) {
+      snprintf(line, sizeof(line), "luaos_affinity_info{job=\"%d\",cpus=\"%s\"} 1\n", slot->id, cpus_string(mask).c_str());
+      luaL_addstring(&b, line);
+    }
+  }
+  for (size_t i = 0; i < (size_t)metrics_histogram::count; i++)
+  {
+    const char* name = histogram_names[i];
+    snprintf(line, sizeof(line), "# TYPE luaos_%s_microseconds summary\n", name);
+    luaL_addstring(&b, line);
+    for (auto& slot : slots)
+    {
+      const histogram_type& h = slot->histograms[i];
+      for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++) {
+        snprintf(line, sizeof(line), "luaos_%s_microseconds{job=\"%d\",quantile=\"%g\"} %llu\n",
+          name, slot->id, quantiles[j], (unsigned long long)h.quantile(quantiles[j])
+        );
+        luaL_addstring(&b, line);
+      }
+      snprintf(line, sizeof(line), "luaos_%s_microseconds_sum{job=\"%d\"} %llu\n",
+        name, slot->id, (unsigned long long)h.sum.load()
+      );
+      luaL_addstring(&b, line);
+      snprintf(line, sizeof(line), "luaos_%s_microseconds_count{job=\"%d\"} %llu\n",
+        name, slot->id, (unsigned long long)h.count.load()
+      );
+      luaL_addstring(&b, line);
+    }
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+int luaos_metrics_stats(lua_State* L)
+{
+  const char* format = luaL_optstring(L, 1, "table");
+  std::vector<metrics_handler> slots = all_slots();
+  if (strcmp(format, "prometheus") == 0) {
+    return stats_prometheus(L, slots);
+  }
+  if (strcmp(format, "table") != 0) {
+    luaL_argerror(L, 1, "must be 'table' or 'prometheus'");
+  }
+  return stats_table(L, slots);
+}
+
+/***********************************************************************************/
@@ -0,0 +1,60 @@
+
+/************************************************************************************
+**
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+************************************************************************************/
+
+#pragma once
+
+#include "luaos.h"
+
+/***********************************************************************************/
+
+/*
+** Every thread owns its metrics and is the only writer of them, so an update
+** is a thread local lookup plus a relaxed load/store (no lock, no atomic RMW).
+** Readers (os.stats) only take the registry mutex to walk the threads.
+*/
+
+enum struct metrics_counter {
+  handlers,           /* handlers run by os.wait */
+  publish_sent,       /* messages posted by os.publish */
+  publish_recv,       /* messages delivered to subscribers */
+  rpc_calls,          /* rpcall calls issued */
+  rpc_errors,         /* rpcall handlers that raised an error */
+  pcall_errors,       /* failed luaos_pcall */
+  socket_accepts,     /* accepted connections */
+  socket_connects,    /* successful connects */
+  socket_recv_bytes,  /* bytes delivered to Lua */
+  socket_send_bytes,  /* bytes handed to the socket */
+  count
+};
+
+enum struct metrics_histogram {
+  publish_latency,    /* publish to delivery, us */
+  rpc_latency,        /* rpcall round trip, us */
+  count
+};
+
+void luaos_metrics_attach(io_handler ios);
+
+void luaos_metrics_count(metrics_counter which, size_t n = 1);
+
+void luaos_metrics_record(metrics_histogram which, size_t us);
+
+void luaos_metrics_heap(size_t bytes);
+
+void luaos_metrics_affinity(const int* cpus, size_t count);
+
+int  luaos_metrics_stats(lua_State* L);
+
+/***********************************************************************************/
@@ -66,17 +66,22 @@
 * that swaps a binary string if arch is little endian (and left it untouched
 * otherwise). */
 
-/* Reverse memory bytes if arch is little endian. Given the conceptual
-* simplicity of the Lua build system we prefer check for endianess at runtime.
-* The performance difference should be acceptable. */
-static void memrevifle(void *ptr, size_t len) {
+/* The byte order is known at compile time, every supported target but the
+* big endian ones defining __BYTE_ORDER__ is little endian. */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && \
+  __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MP_BIG_ENDIAN 1
+#else
+#define MP_BIG_ENDIAN 0
+#endif
+
+/* Reverse memory bytes if arch is little endian. */
+static inline void memrevifle(void *ptr, size_t len) {
+#if !MP_BIG_ENDIAN
   unsigned char   *p = (unsigned char *)ptr,
     *e = (unsigned char *)p+len-1,
     aux;
-  int test = 1;
-  unsigned char *testp = (unsigned char*) &test;
 
-  if (testp[0] == 0) return; /* Big endian, nothing to do. */
   len /= 2;
   while(len--) {
     aux = *p;
@@ -85,44 +90,52 @@ static void memrevifle(void *ptr, size_t len) {
     p++;
     e--;
   }
+#endif
 }
 
 /* ---------------------------- String buffer ----------------------------------
 * This is a simple implementation of string buffers. The only operation
 * supported is creating empty buffers and appending bytes to it.
 * The string buffer uses 2x preallocation on every realloc for O(N) append
-* behavior.  */
+* behavior. There is one buffer per thread, reused by every pack call, so
+* steady state encoding does not allocate at all. Buffers grown beyond
+* MP_BUF_KEEP_SIZE are released after use. */
+
+#ifndef MP_BUF_KEEP_SIZE
+#define MP_BUF_KEEP_SIZE  (1024 * 1024)
+#endif
 
 typedef struct mp_buf {
   unsigned char *b;
   size_t len, free;
 } mp_buf;
 
-static void *mp_realloc(lua_State *L, void *target, size_t osize,size_t nsize) {
-  void *(*local_realloc) (void *, void *, size_t osize, size_t nsize) = NULL;
-  void *ud;
+static thread_local struct mp_buf_cache {
+  mp_buf buf = { NULL, 0, 0 };
+  ~mp_buf_cache() { free(buf.b); }
+} mp_local;
 
-  local_realloc = lua_getallocf(L, &ud);
+static mp_buf *mp_buf_new(void) {
+  mp_buf *buf = &mp_local.buf;
 
-  return local_realloc(ud, target, osize, nsize);
-}
-
-static mp_buf *mp_buf_new(lua_State *L) {
-  mp_buf *buf = NULL;
-
-  /* Old size = 0; new size = sizeof(*buf) */
-  buf = (mp_buf*)mp_realloc(L, NULL, 0, sizeof(*buf));
-
-  buf->b = NULL;
-  buf->len = buf->free = 0;
+  /* A previous pack may have been interrupted by an error. */
+  buf->free += buf->len;
+  buf->len = 0;
   return buf;
 }
 
 static void mp_buf_append(lua_State *L, mp_buf *buf, const unsigned char *s, size_t len) {
   if (buf->free < len) {
     size_t newsize = (buf->len+len)*2;
+    unsigned char *b;
 
-    buf->b = (unsigned char*)mp_realloc(L, buf->b, buf->len + buf->free, newsize);
+    if (newsize < 256) newsize = 256;
+    b = (unsigned char*)realloc(buf->b, newsize);
+    if (!b) {
+      luaL_error(L, "not enough memory");
+      return;
+    }
+    buf->b = b;
     buf->free = newsize - buf->len;
   }
   memcpy(buf->b+buf->len,s,len);
@@ -130,9 +143,15 @@ static void mp_buf_append(lua_State *L, mp_buf *buf, const unsigned char *s, siz
   buf->free -= len;
 }
 
-static void mp_buf_free(lua_State *L, mp_buf *buf) {
-  mp_realloc(L, buf->b, buf->len + buf->free, 0); /* realloc to 0 = free */
-  mp_realloc(L, buf, sizeof(*buf), 0);
+static void mp_buf_free(mp_buf *buf) {
+  if (buf->len + buf->free > MP_BUF_KEEP_SIZE) {
+    free(buf->b);
+    buf->b = NULL;
+    buf->len = buf->free = 0;
+    return;
+  }
+  buf->free += buf->len;
+  buf->len = 0;
 }
 
 /* ---------------------------- String cursor ----------------------------------
@@ -380,38 +399,21 @@ static void mp_encode_lua_number(lua_State *L, mp_buf *buf) {
 static void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level);
 
 /* Convert a lua table into a message pack list. */
-static void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level) {
-#if LUA_VERSION_NUM < 502
-  size_t len = lua_objlen(L,-1), j;
-#else
-  size_t len = lua_rawlen(L,-1), j;
-#endif
+static void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level, size_t len) {
+  size_t j;
 
   mp_encode_array(L,buf,len);
   luaL_checkstack(L, 1, "in function mp_encode_lua_table_as_array");
   for (j = 1; j <= len; j++) {
-    lua_pushnumber(L, (lua_Number)j);
-    lua_gettable(L,-2);
+    lua_rawgeti(L,-1,(lua_Integer)j);
     mp_encode_lua_type(L,buf,level+1);
   }
 }
 
-/* Convert a lua table into a message pack key-value map. */
-static void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
-  size_t len = 0;
-
-  /* First step: count keys into table. No other way to do it with the
-  * Lua API, we need to iterate a first time. Note that an alternative
-  * would be to do a single run, and then hack the buffer to insert the
-  * map opcodes for message pack. Too hackish for this lib. */
+/* Convert a lua table into a message pack key-value map, the number of
+* keys is already known from table_classify(). */
+static void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level, size_t len) {
   luaL_checkstack(L, 3, "in function mp_encode_lua_table_as_map");
-  lua_pushnil(L);
-  while(lua_next(L,-2)) {
-    lua_pop(L,1); /* remove value, keep key for next iteration. */
-    len++;
-  }
-
-  /* Step two: actually encoding of the map. */
   mp_encode_map(L,buf,len);
   lua_pushnil(L);
   while(lua_next(L,-2)) {
@@ -424,45 +426,44 @@ static void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
 
 /* Returns true if the Lua table on top of the stack is exclusively composed
 * of keys from numerical keys from 1 up to N, with N being the total number
-* of elements, without any hole in the middle. */
-static int table_is_an_array(lua_State *L) {
-  int count = 0, max = 0;
+* of elements, without any hole in the middle. The number of keys is stored
+* in "count" in both cases, so maps need no second counting pass. */
+static int table_classify(lua_State *L, size_t *count) {
+  size_t n = 0;
+  int array = 1;
 #if LUA_VERSION_NUM < 503
-  lua_Number n;
+  lua_Number k, max = 0;
 #else
-  lua_Integer n;
+  lua_Integer k, max = 0;
 #endif
 
-  /* Stack top on function entry */
-  int stacktop;
-
-  stacktop = lua_gettop(L);
-
+  luaL_checkstack(L, 2, "in function table_classify");
   lua_pushnil(L);
   while(lua_next(L,-2)) {
     /* Stack: ... key value */
     lua_pop(L,1); /* Stack: ... key */
+    n++;
+    if (!array) continue;
                   /* The <= 0 check is valid here because we're comparing indexes. */
 #if LUA_VERSION_NUM < 503
-    if ((LUA_TNUMBER != lua_type(L,-1)) || (n = lua_tonumber(L, -1)) <= 0 ||
-      !IS_INT_EQUIVALENT(n))
+    if ((LUA_TNUMBER != lua_type(L,-1)) || (k = lua_tonumber(L, -1)) <= 0 ||
+      !IS_INT_EQUIVALENT(k))
 #else
-    if (!lua_isinteger(L,-1) || (n = lua_tointeger(L, -1)) <= 0)
+    if (!lua_isinteger(L,-1) || (k = lua_tointeger(L, -1)) <= 0)
 #endif
     {
-      lua_settop(L, stacktop);
-      return 0;
+      array = 0;
+      continue;
     }
-    max = int(n > max ? n : max);
-    count++;
+    if (k > max) max = k;
   }
-  /* We have the total number of elements in "count". Also we have
+  /* We have the total number of elements in "n". Also we have
   * the max index encountered in "max". We can't reach this code
   * if there are indexes <= 0. If you also note that there can not be
-  * repeated keys into a table, you have that if max==count you are sure
-  * that there are all the keys form 1 to count (both included). */
-  lua_settop(L, stacktop);
-  return max == count;
+  * repeated keys into a table, you have that if max==n you are sure
+  * that there are all the keys form 1 to n (both included). */
+  *count = n;
+  return array && (size_t)max == n;
 }
 
 static void mp_encode_lua_null(lua_State *L, mp_buf *buf) {
@@ -489,10 +490,11 @@ static void mp_encode_lua_table(lua_State *L, mp_buf *buf, int level) {
       return;
     }
   }
-  if (table_is_an_array(L))
-    mp_encode_lua_table_as_array(L,buf,level);
+  size_t count;
+  if (table_classify(L, &count))
+    mp_encode_lua_table_as_array(L,buf,level,count);
   else {
-    mp_encode_lua_table_as_map(L,buf,level);
+    mp_encode_lua_table_as_map(L,buf,level,count);
   }
   if (luaos_is_debug()) {
     const void* p = lua_topointer(L, -1);
@@ -541,7 +543,9 @@ int pack_any(lua_State *L) {
   if (!lua_checkstack(L, nargs))
     return luaL_argerror(L, 0, "Too many arguments for MessagePack pack.");
 
-  buf = mp_buf_new(L);
+  /* All arguments are encoded back to back into the same buffer,
+  * which is the concatenation of their separate encodings. */
+  buf = mp_buf_new();
   for(i = 1; i <= nargs; i++) {
     /* Copy argument i to top of stack for _encode processing;
     * the encode function pops it from the stack when complete. */
@@ -550,49 +554,70 @@ int pack_any(lua_State *L) {
 
     readed.clear();
     mp_encode_lua_type(L,buf,0);
+  }
+  lua_pushlstring(L,(char*)buf->b,buf->len);
+  mp_buf_free(buf);
+  return 1;
+}
 
-    lua_pushlstring(L,(char*)buf->b,buf->len);
+/*
+* Same as pack_any, but the result is stored into the std::string passed
+* as light userdata in argument 1 instead of being pushed as a Lua string.
+*/
+int pack_string(lua_State *L) {
+  int nargs = lua_gettop(L);
+  int i;
+  mp_buf *buf;
+  std::string *out = (std::string*)lua_touserdata(L, 1);
 
-    /* Reuse the buffer for the next operation by
-    * setting its free count to the total buffer size
-    * and the current position to zero. */
-    buf->free += buf->len;
-    buf->len = 0;
-  }
-  mp_buf_free(L, buf);
+  if (!out)
+    return luaL_argerror(L, 1, "output buffer expected.");
 
-  /* Concatenate all nargs buffers together */
-  lua_concat(L, nargs);
-  return 1;
+  if (nargs < 2)
+    return luaL_argerror(L, 0, "MessagePack pack needs input.");
+
+  buf = mp_buf_new();
+  for(i = 2; i <= nargs; i++) {
+    luaL_checkstack(L, 1, "in function mp_check");
+    lua_pushvalue(L, i);
+
+    readed.clear();
+    mp_encode_lua_type(L,buf,0);
+  }
+  out->assign((char*)buf->b,buf->len);
+  mp_buf_free(buf);
+  return 0;
 }
 
 /* ------------------------------- Decoding --------------------------------- */
 
 static void mp_decode_to_lua_type(lua_State *L, mp_cur *c);
 
+/* Tables are created with their final size. Every element takes at least
+* one byte of input, so the size hint is bounded by the remaining bytes and
+* a forged length can't make us preallocate more than the input justifies. */
 static void mp_decode_to_lua_array(lua_State *L, mp_cur *c, size_t len) {
   assert(len <= UINT_MAX);
-  int index = 1;
+  lua_Integer index = 1;
 
-  lua_newtable(L);
+  lua_createtable(L, (int)(len < c->left ? len : c->left), 0);
   luaL_checkstack(L, 1, "in function mp_decode_to_lua_array");
   while(len--) {
-    lua_pushnumber(L,index++);
     mp_decode_to_lua_type(L,c);
     if (c->err) return;
-    lua_settable(L,-3);
+    lua_rawseti(L,-2,index++);
   }
 }
 
 static void mp_decode_to_lua_hash(lua_State *L, mp_cur *c, size_t len) {
   assert(len <= UINT_MAX);
-  lua_newtable(L);
+  lua_createtable(L, 0, (int)(len < c->left / 2 ? len : c->left / 2));
   while(len--) {
     mp_decode_to_lua_type(L,c); /* key */
     if (c->err) return;
     mp_decode_to_lua_type(L,c); /* value */
     if (c->err) return;
-    lua_settable(L,-3);
+    lua_rawset(L,-3);
   }
 }
 
@@ -824,10 +849,10 @@ static int mp_unpack_full(lua_State *L, int limit, int offset) {
   if (offset < 0 || limit < 0) /* requesting negative off or lim is invalid */
     return luaL_error(L,
       "Invalid request to unpack with offset of %d and limit of %d.",
-      offset, len);
-  else if (offset > len)
+      offset, limit);
+  else if ((size_t)offset > len)
     return luaL_error(L,
-      "Start offset %d greater than input length %d.", offset, len);
+      "Start offset %d greater than input length %d.", offset, (int)len);
 
   if (decode_all) limit = INT_MAX;
 
@@ -920,7 +945,7 @@ const struct luaL_Reg cmds[] = {
 };
 
 int luaopen_create(lua_State *L) {
-  int i;
+  size_t i;
   /* Manually construct our module table instead of
   * relying on _register or _newlib */
   lua_newtable(L);
@@ -956,7 +981,7 @@ int luaopen_cmsgpack_safe(lua_State *L)
 {
   luaopen_cmsgpack(L);
   /* Wrap all functions in the safe handler */
-  for (int i = 0; i < (sizeof(cmds)/sizeof(*cmds) - 1); i++) {
+  for (size_t i = 0; i < (sizeof(cmds)/sizeof(*cmds) - 1); i++) {
     lua_getfield(L, -1, cmds[i].name);
     lua_pushcclosure(L, mp_safe, 1);
     lua_setfield(L, -2, cmds[i].name);
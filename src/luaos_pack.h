@@ -23,6 +23,8 @@ int luaopen_cmsgpack_safe(lua_State* L);
 
 int pack_any(lua_State* L);
 
+int pack_string(lua_State* L);
+
 int unpack_any(lua_State* L);
 
 /***********************************************************************************/
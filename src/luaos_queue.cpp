@@ -0,0 +1,467 @@
+
+/********************************************************************************
+**
+** Copyright 2021-2022 stanzhao
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+********************************************************************************/
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <socket/mutex.h>
+
+#include "luaos_queue.h"
+
+#define max_queue_capacity (1 << 24)
+
+typedef std::shared_ptr<lua_value> value_type;
+
+/*******************************************************************************/
+
+/*
+** Bounded lock-free ring (D. Vyukov), every cell carries a sequence which
+** tells producers and consumers whose turn it is, so push and pop only
+** contend on their own position counter.
+*/
+class mpmc_ring final {
+  struct cell {
+    std::atomic<size_t> seq;
+    value_type data;
+  };
+  std::unique_ptr<cell[]> _cells;
+  const size_t _mask;
+  std::atomic<size_t> _enqueue;
+  std::atomic<size_t> _dequeue;
+
+  static size_t round_up(size_t n)
+  {
+    size_t size = 2;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+public:
+  mpmc_ring(size_t capacity)
+    : _cells(new cell[round_up(capacity)])
+    , _mask(round_up(capacity) - 1)
+    , _enqueue(0)
+    , _dequeue(0)
+  {
+    for (size_t i = 0; i <= _mask; i++) {
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  inline size_t capacity() const {
+    return _mask + 1;
+  }
+  inline size_t size() const {
+    size_t tail = _dequeue.load(std::memory_order_relaxed);
+    size_t head = _enqueue.load(std::memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+  }
+  bool push(const value_type& value)
+  {
+    cell* c;
+    size_t pos = _enqueue.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      c = &_cells[pos & _mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (diff < 0) {
+        return false; /* full */
+      }
+      else {
+        pos = _enqueue.load(std::memory_order_relaxed);
+      }
+    }
+    c->data = value;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(value_type& value)
+  {
+    cell* c;
+    size_t pos = _dequeue.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      c = &_cells[pos & _mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (diff < 0) {
+        return false; /* empty */
+      }
+      else {
+        pos = _dequeue.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(c->data);
+    c->seq.store(pos + _mask + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+/*******************************************************************************/
+
+class named_queue;
+typedef std::shared_ptr<named_queue> queue_ref;
+
+struct queue_waiter {
+  io_handler ios;
+  int callback;
+};
+
+/*
+** A queue lives as long as the process, any job may open it by name. Pops
+** which find it empty park their job as a waiter and the next push hands
+** the value over to the first waiter's reactor.
+*/
+class named_queue final
+  : public std::enable_shared_from_this<named_queue> {
+  const std::string _name;
+  mpmc_ring _ring;
+  std::atomic<size_t> _waiting;
+  std::mutex _mutex;
+  std::deque<queue_waiter> _waiters;
+
+public:
+  std::atomic<size_t> pushed;
+  std::atomic<size_t> popped;
+  std::atomic<size_t> rejected;
+  std::atomic<size_t> peak;
+
+  named_queue(const std::string& name, size_t capacity)
+    : _name(name), _ring(capacity), _waiting(0)
+    , pushed(0), popped(0), rejected(0), peak(0) {
+  }
+  inline const std::string& name() const {
+    return _name;
+  }
+  inline size_t size() const {
+    return _ring.size();
+  }
+  inline size_t capacity() const {
+    return _ring.capacity();
+  }
+  inline size_t waiting() const {
+    return _waiting.load(std::memory_order_relaxed);
+  }
+  bool push(const value_type& value)
+  {
+    if (!_ring.push(value)) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    pushed.fetch_add(1, std::memory_order_relaxed);
+    size_t depth = _ring.size();
+    size_t top = peak.load(std::memory_order_relaxed);
+    while (depth > top && !peak.compare_exchange_weak(top, depth, std::memory_order_relaxed));
+
+    /* pairs with the fence in wait(), one side always sees the other */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_waiting.load(std::memory_order_relaxed) > 0) {
+      wakeup();
+    }
+    return true;
+  }
+  bool pop(value_type& value)
+  {
+    if (!_ring.pop(value)) {
+      return false;
+    }
+    popped.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  void wait(io_handler ios, int callback)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _waiters.push_back({ ios, callback });
+      _waiting.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wakeup();
+  }
+
+private:
+  void wakeup();
+};
+
+/*
+** Owns a value on its way to a waiter. If the waiter's job is gone before
+** the handler runs, the value goes back into the queue.
+*/
+struct queue_delivery final {
+  queue_ref queue;
+  value_type value;
+  int callback;
+  bool delivered;
+
+  queue_delivery(queue_ref q, value_type v, int r)
+    : queue(q), value(v), callback(r), delivered(false) {
+  }
+  ~queue_delivery() {
+    if (!delivered) {
+      queue->push(value);
+    }
+  }
+};
+
+static void on_delivery(std::shared_ptr<queue_delivery> delivery)
+{
+  delivery->delivered = true;
+  lua_State* L = luaos_local.lua_state();
+  stack_rollback rollback(L);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, delivery->callback);
+  luaL_unref (L, LUA_REGISTRYINDEX, delivery->callback);
+  delivery->value->push(L);
+
+  if (luaos_pcall(L, 1, 0) != LUA_OK) {
+    luaos_error("%s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+}
+
+/*
+** Waiters leave the list under the lock but are released after it. The
+** last reference to a stopped job's reactor may be among them, and the
+** deliveries it still holds push back into this queue when destroyed.
+*/
+void named_queue::wakeup()
+{
+  std::vector<queue_waiter> removed;
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_waiters.empty())
+  {
+    queue_waiter& waiter = _waiters.front();
+    if (!waiter.ios->stopped())
+    {
+      value_type value;
+      if (!pop(value)) {
+        break;
+      }
+      auto delivery = std::make_shared<queue_delivery>(shared_from_this(), value, waiter.callback);
+      waiter.ios->post(std::bind(&on_delivery, delivery));
+    }
+    removed.push_back(std::move(waiter));
+    _waiters.pop_front();
+    _waiting.fetch_sub(1, std::memory_order_relaxed);
+  }
+  lock.unlock();
+}
+
+/*******************************************************************************/
+
+static std::mutex _mutex;
+static std::map<std::string, queue_ref> _queues;
+
+static queue_ref& check_queue(lua_State* L, int i = 1)
+{
+  return *lexget_userdata<queue_ref>(L, i, luaos_queue_name);
+}
+
+static value_type check_value(lua_State* L, int i)
+{
+  int type = lua_type(L, i);
+  luaL_argcheck(L, type != LUA_TNONE && type != LUA_TNIL, i, "value expected");
+  luaL_argcheck(L, type != LUA_TFUNCTION && type != LUA_TTHREAD, i, "function or thread can't cross jobs");
+  return value_type(new lua_value(L, i));
+}
+
+static int lua_os_queue_open(lua_State* L)
+{
+  size_t size = 0;
+  const char* name = luaL_checklstring(L, 1, &size);
+  lua_Integer capacity = luaL_optinteger(L, 2, 1024);
+  luaL_argcheck(L, capacity > 0 && capacity <= max_queue_capacity, 2, "out of range");
+
+  queue_ref queue;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::string key(name, size);
+    auto iter = _queues.find(key);
+    if (iter != _queues.end()) {
+      queue = iter->second;
+    }
+    else {
+      queue = std::make_shared<named_queue>(key, (size_t)capacity);
+      _queues[key] = queue;
+    }
+  }
+  auto userdata = lexnew_userdata<queue_ref>(L, luaos_queue_name);
+  new (userdata) queue_ref(queue);
+  return 1;
+}
+
+static int lua_os_queue_gc(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  self.~queue_ref();
+  return 0;
+}
+
+static int lua_os_queue_push(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  lua_pushboolean(L, self->push(check_value(L, 2)) ? 1 : 0);
+  return 1;
+}
+
+static int lua_os_queue_push_batch(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_Integer count = (lua_Integer)luaL_len(L, 2);
+  lua_Integer pushed = 0;
+  for (lua_Integer i = 1; i <= count; i++, pushed++)
+  {
+    lua_rawgeti(L, 2, i);
+    int type = lua_type(L, -1);
+    if (type == LUA_TNIL || type == LUA_TFUNCTION || type == LUA_TTHREAD) {
+      luaL_error(L, "bad value at index %d (%s)", (int)i, luaL_typename(L, -1));
+    }
+    value_type value(new lua_value(L, -1));
+    lua_pop(L, 1);
+    if (!self->push(value)) {
+      break;
+    }
+  }
+  lua_pushinteger(L, pushed);
+  return 1;
+}
+
+static int lua_os_queue_try_pop(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  value_type value;
+  if (!self->pop(value)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  value->push(L);
+  return 1;
+}
+
+static int lua_os_queue_try_pop_batch(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  lua_Integer count = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, count > 0, 2, "must be greater than 0");
+  lua_newtable(L);
+  for (lua_Integer i = 1; i <= count; i++)
+  {
+    value_type value;
+    if (!self->pop(value)) {
+      break;
+    }
+    value->push(L);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+static int lua_os_queue_pop(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  self->wait(luaos_local.lua_service(), callback);
+  return 0;
+}
+
+static int lua_os_queue_size(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  lua_pushinteger(L, (lua_Integer)self->size());
+  return 1;
+}
+
+static int lua_os_queue_capacity(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  lua_pushinteger(L, (lua_Integer)self->capacity());
+  return 1;
+}
+
+static int lua_os_queue_name(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  lua_pushlstring(L, self->name().c_str(), self->name().size());
+  return 1;
+}
+
+static int lua_os_queue_stats(lua_State* L)
+{
+  queue_ref& self = check_queue(L);
+  lua_newtable(L);
+  lua_pushinteger(L, (lua_Integer)self->size());
+  lua_setfield(L, -2, "depth");
+  lua_pushinteger(L, (lua_Integer)self->peak.load(std::memory_order_relaxed));
+  lua_setfield(L, -2, "peak");
+  lua_pushinteger(L, (lua_Integer)self->capacity());
+  lua_setfield(L, -2, "capacity");
+  lua_pushinteger(L, (lua_Integer)self->waiting());
+  lua_setfield(L, -2, "waiting");
+  lua_pushinteger(L, (lua_Integer)self->pushed.load(std::memory_order_relaxed));
+  lua_setfield(L, -2, "pushed");
+  lua_pushinteger(L, (lua_Integer)self->popped.load(std::memory_order_relaxed));
+  lua_setfield(L, -2, "popped");
+  lua_pushinteger(L, (lua_Integer)self->rejected.load(std::memory_order_relaxed));
+  lua_setfield(L, -2, "rejected");
+  return 1;
+}
+
+/*******************************************************************************/
+
+namespace queue
+{
+  void init_metatable(lua_State* L)
+  {
+    struct luaL_Reg methods[] = {
+      { "__gc",           lua_os_queue_gc             },
+      { "__len",          lua_os_queue_size           },
+      { "push",           lua_os_queue_push           },
+      { "push_batch",     lua_os_queue_push_batch     },
+      { "try_pop",        lua_os_queue_try_pop        },
+      { "try_pop_batch",  lua_os_queue_try_pop_batch  },
+      { "pop",            lua_os_queue_pop            },
+      { "size",           lua_os_queue_size           },
+      { "capacity",       lua_os_queue_capacity       },
+      { "name",           lua_os_queue_name           },
+      { "stats",          lua_os_queue_stats          },
+      { NULL,             NULL                        },
+    };
+    lexnew_metatable(L, luaos_queue_name, methods);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "os");
+    lua_pushcfunction(L, lua_os_queue_open);
+    lua_setfield(L, -2, "queue");
+    lua_pop(L, 1); //pop os from stack
+  }
+}
+
+/*******************************************************************************/
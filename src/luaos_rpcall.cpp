@@ -4,39 +4,128 @@
 #include <map>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
 
 #include "luaos_rpcall.h"
+#include "luaos_metrics.h"
+
+#define luaos_rpcall_name "luaos::rpcall"
 
 /*******************************************************************************/
 
+typedef std::shared_ptr<std::atomic<int>> rpc_pending;
+
 typedef struct {
   int handler;
   io_handler ios;
+  rpc_pending pending;
 } rpc_node;
 
+enum class rpc_balance {
+  round, least
+};
+
+struct rpc_endpoint {
+  std::mutex mutex;
+  size_t next = 0;
+  rpc_balance balance = rpc_balance::round;
+  std::vector<rpc_node> workers;
+};
+
+typedef std::shared_ptr<rpc_endpoint> rpc_handle;
+
 static std::mutex  _mutex;
-static std::map<std::string, rpc_node> _rpc_reged;
+static std::map<std::string, rpc_handle> _rpc_reged;
 
 /*******************************************************************************/
 
-static void invoke(int index, lua_value_array::value_type params, io_handler ios, int callback)
+/* drop the name once its last worker is gone and no handle is bound to it */
+static void remove_endpoint(const char* name)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto iter = _rpc_reged.find(name);
+  if (iter == _rpc_reged.end() || iter->second.use_count() > 1) {
+    return;
+  }
+  std::unique_lock<std::mutex> guard(iter->second->mutex);
+  if (iter->second->workers.empty()) {
+    guard.unlock();
+    _rpc_reged.erase(iter);
+  }
+}
+
+static rpc_handle find_endpoint(const char* name)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto iter = _rpc_reged.find(name);
+  return iter == _rpc_reged.end() ? rpc_handle() : iter->second;
+}
+
+static bool select_worker(rpc_handle endpoint, rpc_node& node)
+{
+  if (!endpoint) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(endpoint->mutex);
+  auto& workers = endpoint->workers;
+  /* a job that exited without cancel leaves its worker behind */
+  for (auto iter = workers.begin(); iter != workers.end();)
+  {
+    if (iter->ios->stopped()) {
+      iter = workers.erase(iter);
+    }
+    else {
+      ++iter;
+    }
+  }
+  if (workers.empty()) {
+    return false;
+  }
+  size_t count = workers.size();
+  size_t index = endpoint->next++ % count;
+
+  if (endpoint->balance == rpc_balance::least)
+  {
+    int depth = workers[index].pending->load();
+    for (size_t i = 1; i < count && depth > 0; i++)
+    {
+      size_t j = (index + i) % count;
+      int n = workers[j].pending->load();
+      if (n < depth) {
+        depth = n, index = j;
+      }
+    }
+  }
+  node = workers[index];
+  return true;
+}
+
+/*******************************************************************************/
+
+static void invoke(rpc_node node, lua_value_array::value_type params, io_handler ios, int callback, size_t begin)
 {
   lua_State* L = luaos_local.lua_state();
   stack_rollback rollback(L);
   int top = lua_gettop(L);
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, index);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, node.handler);
   auto status = luaos_pcall(L, (int)params->push(L), LUA_MULTRET);
+  node.pending->fetch_sub(1);
+  if (status != LUA_OK) {
+    luaos_metrics_count(metrics_counter::rpc_errors);
+  }
 
   lua_value_array::value_type result;
   result = lua_value_array::create();
   result->append(L, lua_value(status == LUA_OK));
   result->append(L, top + 1, 0);
 
-  ios->post([result, callback]()
+  ios->post([result, callback, begin]()
   {
       lua_State* L = luaos_local.lua_state();
       stack_rollback rollback(L);
+      luaos_metrics_record(metrics_histogram::rpc_latency, os::microseconds() - begin);
 
       lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
       luaL_unref (L, LUA_REGISTRYINDEX, callback);
@@ -51,14 +140,18 @@ static void invoke(int index, lua_value_array::value_type params, io_handler ios
 
 /*******************************************************************************/
 
-static void call(int index, lua_value_array::value_type params, lua_value_array::value_type result, io_handler ios)
+static void call(rpc_node node, lua_value_array::value_type params, lua_value_array::value_type result, io_handler ios)
 {
   lua_State* L = luaos_local.lua_state();
   stack_rollback rollback(L);
   int top = lua_gettop(L);
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, index);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, node.handler);
   auto status = luaos_pcall(L, (int)params->push(L), LUA_MULTRET);
+  node.pending->fetch_sub(1);
+  if (status != LUA_OK) {
+    luaos_metrics_count(metrics_counter::rpc_errors);
+  }
 
   result->append(L, lua_value(status == LUA_OK));
   result->append(L, top + 1, 0);
@@ -67,121 +160,209 @@ static void call(int index, lua_value_array::value_type params, lua_value_array:
 
 /*******************************************************************************/
 
-static int lua_rpcall_register(lua_State* L)
+static int rpcall_call(lua_State* L, rpc_handle endpoint, int first)
 {
-  const char* name = luaL_checkstring(L, 1);
-  if (!lua_isfunction(L, 2)) {
-    luaL_argerror(L, 2, "must be a function");
-  }
+  lua_value_array::value_type params;
+  params = lua_value_array::create(L, first, 0);
+
   rpc_node node;
-  node.handler = luaL_ref(L, LUA_REGISTRYINDEX);
-  node.ios = luaos_local.lua_service();
+  if (!select_worker(endpoint, node)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  io_handler wait;
+  try {
+    wait = luaos_ionew();
+  }
+  catch (...) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  auto ios  = luaos_local.lua_service();
+  lua_value_array::value_type result;
+  result = lua_value_array::create();
 
-  std::unique_lock<std::mutex> lock(_mutex);
-  if (_rpc_reged.find(name) == _rpc_reged.end()) {
-    _rpc_reged[name] = node;
-    lua_pushboolean(L, 1);
+  size_t begin = os::microseconds();
+  luaos_metrics_count(metrics_counter::rpc_calls);
+
+  node.pending->fetch_add(1);
+  if (node.ios->id() == ios->id()) {
+    call(node, params, result, wait);
   }
   else {
-    luaL_unref(L, LUA_REGISTRYINDEX, node.handler);
+    node.ios->post(std::bind(&call, node, params, result, wait));
+  }
+  wait->run();
+  luaos_metrics_record(metrics_histogram::rpc_latency, os::microseconds() - begin);
+  return (int)result->push(L);
+}
+
+/*******************************************************************************/
+
+static int rpcall_invoke(lua_State* L, rpc_handle endpoint, int first)
+{
+  int argc = lua_gettop(L);
+  if (argc < first || !lua_isfunction(L, first)) {
+    return rpcall_call(L, endpoint, first);
+  }
+  rpc_node node;
+  if (!select_worker(endpoint, node)) {
     lua_pushboolean(L, 0);
+    return 1;
   }
+  lua_value_array::value_type params;
+  params = lua_value_array::create(L, first + 1, argc);
+
+  lua_pushvalue(L, first);
+  int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  auto ios = luaos_local.lua_service();
+  luaos_metrics_count(metrics_counter::rpc_calls);
+  node.pending->fetch_add(1);
+  node.ios->post(std::bind(&invoke, node, params, ios, callback, os::microseconds()));
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 /*******************************************************************************/
 
-static int lua_rpcall_cancel(lua_State* L)
+static int lua_rpcall_register(lua_State* L)
 {
   const char* name = luaL_checkstring(L, 1);
-  std::unique_lock<std::mutex> lock(_mutex);
+  if (!lua_isfunction(L, 2)) {
+    luaL_argerror(L, 2, "must be a function");
+  }
+  static const char* const options[] = { "round", "least", NULL };
+  bool explicit_balance = !lua_isnoneornil(L, 3);
+  int balance = luaL_checkoption(L, 3, "round", options);
+  lua_settop(L, 2);
 
-  auto iter = _rpc_reged.find(name);
-  if (iter != _rpc_reged.end())
+  int current = -1;
   {
-    auto ios = luaos_local.lua_service();
-    if (iter->second.ios->id() == ios->id())
+    rpc_node node;
+    node.handler = luaL_ref(L, LUA_REGISTRYINDEX);
+    node.ios = luaos_local.lua_service();
+    node.pending = std::make_shared<std::atomic<int>>(0);
+
+    rpc_handle endpoint;
     {
-      luaL_unref(L, LUA_REGISTRYINDEX, iter->second.handler);
-      _rpc_reged.erase(iter);
-      lua_pushboolean(L, 1);
-      return 1;
+      std::unique_lock<std::mutex> lock(_mutex);
+      auto& slot = _rpc_reged[name];
+      if (!slot) {
+        slot = std::make_shared<rpc_endpoint>();
+      }
+      endpoint = slot;
+    }
+    std::unique_lock<std::mutex> lock(endpoint->mutex);
+    for (auto& worker : endpoint->workers)
+    {
+      if (worker.ios->id() == node.ios->id())
+      {
+        luaL_unref(L, LUA_REGISTRYINDEX, node.handler);
+        lua_pushboolean(L, 0);
+        return 1;
+      }
+    }
+    if (endpoint->workers.empty()) {
+      endpoint->balance = (rpc_balance)balance;
+    }
+    else if (explicit_balance && endpoint->balance != (rpc_balance)balance) {
+      current = (int)endpoint->balance;
+      luaL_unref(L, LUA_REGISTRYINDEX, node.handler);
+    }
+    if (current < 0) {
+      endpoint->workers.push_back(node);
     }
   }
-  lua_pushboolean(L, 0);
+  /* raised outside the block above, luaL_error does not unwind the stack */
+  if (current >= 0) {
+    return luaL_error(L, "rpc '%s' is already registered with balance '%s'", name, options[current]);
+  }
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 /*******************************************************************************/
 
-static int lua_rpcall_call(lua_State* L)
+static int lua_rpcall_cancel(lua_State* L)
 {
-  int index = 0;
   const char* name = luaL_checkstring(L, 1);
-  lua_value_array::value_type params;
-  params = lua_value_array::create(L, 2, 0);
-  io_handler regios;
+  rpc_handle endpoint = find_endpoint(name);
+  bool removed = false;
+  if (endpoint)
   {
-    std::unique_lock<std::mutex> lock(_mutex);
-    auto iter = _rpc_reged.find(name);
-    if (iter != _rpc_reged.end())
+    auto ios = luaos_local.lua_service();
+    std::unique_lock<std::mutex> lock(endpoint->mutex);
+    auto& workers = endpoint->workers;
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter)
     {
-      index  = iter->second.handler;
-      regios = iter->second.ios;
+      if (iter->ios->id() == ios->id())
+      {
+        luaL_unref(L, LUA_REGISTRYINDEX, iter->handler);
+        workers.erase(iter);
+        removed = true;
+        break;
+      }
     }
   }
-  if (!index || !regios) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-  auto wait = luaos_ionew();
-  auto ios  = luaos_local.lua_service();
-  lua_value_array::value_type result;
-  result = lua_value_array::create();
-
-  if (regios->id() == ios->id()) {
-    call(index, params, result, wait);
-  }
-  else {
-    regios->post(std::bind(&call, index, params, result, wait));
+  if (removed) {
+    endpoint.reset();
+    remove_endpoint(name);
   }
-  wait->run();
-  return (int)result->push(L);
+  lua_pushboolean(L, removed ? 1 : 0);
+  return 1;
 }
 
 /*******************************************************************************/
 
 static int lua_rpcall_invoke(lua_State* L)
 {
-  int argc = lua_gettop(L);
-  if (argc == 1 || !lua_isfunction(L, 2)) {
-    return lua_rpcall_call(L);
-  }
   const char* name = luaL_checkstring(L, 1);
-  lua_value_array::value_type params;
-  params = lua_value_array::create(L, 3, argc);
+  return rpcall_invoke(L, find_endpoint(name), 2);
+}
 
-  int index = 0;
-  lua_pushvalue(L, 2);
-  int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+/*******************************************************************************/
+
+static rpc_handle* check_handle(lua_State* L)
+{
+  return lexget_userdata<rpc_handle>(L, 1, luaos_rpcall_name);
+}
 
-  io_handler regios;
+static int lua_rpcall_bind(lua_State* L)
+{
+  const char* name = luaL_checkstring(L, 1);
+  rpc_handle endpoint;
   {
     std::unique_lock<std::mutex> lock(_mutex);
-    auto iter = _rpc_reged.find(name);
-    if (iter != _rpc_reged.end())
-    {
-      index = iter->second.handler;
-      regios = iter->second.ios;
+    auto& slot = _rpc_reged[name];
+    if (!slot) {
+      slot = std::make_shared<rpc_endpoint>();
     }
+    endpoint = slot;
   }
-  if (!index || !regios) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-  auto ios = luaos_local.lua_service();
-  regios->post(std::bind(&invoke, index, params, ios, callback));
-  lua_pushboolean(L, 1);
+  auto userdata = lexnew_userdata<rpc_handle>(L, luaos_rpcall_name);
+  new (userdata) rpc_handle(endpoint);
+  return 1;
+}
+
+static int lua_rpcall_handle_gc(lua_State* L)
+{
+  rpc_handle* self = check_handle(L);
+  self->~rpc_handle();
+  return 0;
+}
+
+static int lua_rpcall_handle_call(lua_State* L)
+{
+  rpc_handle* self = check_handle(L);
+  return rpcall_invoke(L, *self, 2);
+}
+
+static int lua_rpcall_handle_size(lua_State* L)
+{
+  rpc_handle* self = check_handle(L);
+  std::unique_lock<std::mutex> lock((*self)->mutex);
+  lua_pushinteger(L, (lua_Integer)(*self)->workers.size());
   return 1;
 }
 
@@ -191,10 +372,21 @@ namespace rpcall
 {
   void init_metatable(lua_State* L)
   {
+    struct luaL_Reg handle[] = {
+      { "__gc",          lua_rpcall_handle_gc   },
+      { "__len",         lua_rpcall_handle_size },
+      { "call",          lua_rpcall_handle_call },
+      { "size",          lua_rpcall_handle_size },
+      { NULL,            NULL                   },
+    };
+    lexnew_metatable(L, luaos_rpcall_name, handle);
+    lua_pop(L, 1);
+
     struct luaL_Reg methods[] = {
       { "register",      lua_rpcall_register  },
       { "call",          lua_rpcall_invoke    },
       { "cancel",        lua_rpcall_cancel    },
+      { "bind",          lua_rpcall_bind      },
       { NULL,            NULL              },
     };
     lua_newtable(L);
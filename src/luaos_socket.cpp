@@ -15,6 +15,7 @@
 
 #include "luaos.h"
 #include "luaos_socket.h"
+#include "luaos_metrics.h"
 
 /*******************************************************************************/
 
@@ -68,37 +69,51 @@ void lua_socket::timeout(size_t milliseconds)
 
 error_code lua_socket::connect(const char* host, unsigned short port, size_t timeout)
 {
-  return _socket->connect(host, port, timeout);
+  error_code ec = _socket->connect(host, port, timeout);
+  if (!ec) {
+    luaos_metrics_count(metrics_counter::socket_connects);
+  }
+  return ec;
 }
 
 size_t lua_socket::receive(char* buf, size_t size, error_code& ec)
 {
-  return _socket->receive(buf, size, ec);
+  size = _socket->receive(buf, size, ec);
+  luaos_metrics_count(metrics_counter::socket_recv_bytes, size);
+  return size;
 }
 
 size_t lua_socket::receive_from(char* buf, size_t size, ip::udp::endpoint& peer, error_code& ec)
 {
-  return _socket->receive_from(buf, size, peer, ec);
+  size = _socket->receive_from(buf, size, peer, ec);
+  luaos_metrics_count(metrics_counter::socket_recv_bytes, size);
+  return size;
 }
 
 void lua_socket::send(const char* data, size_t size)
 {
   _socket->async_send(data, size);
+  luaos_metrics_count(metrics_counter::socket_send_bytes, size);
 }
 
 size_t lua_socket::send(const char* data, size_t size, error_code& ec)
 {
-  return _socket->send(data, size, ec);
+  size = _socket->send(data, size, ec);
+  luaos_metrics_count(metrics_counter::socket_send_bytes, size);
+  return size;
 }
 
 void lua_socket::send_to(const char* data, size_t size, const ip::udp::endpoint& peer)
 {
   _socket->send_to(data, size, peer);
+  luaos_metrics_count(metrics_counter::socket_send_bytes, size);
 }
 
 size_t lua_socket::send_to(const char* data, size_t size, const ip::udp::endpoint& peer, error_code& ec)
 {
-  return _socket->send_to(data, size, peer, ec);
+  size = _socket->send_to(data, size, peer, ec);
+  luaos_metrics_count(metrics_counter::socket_send_bytes, size);
+  return size;
 }
 
 /*******************************************************************************/
@@ -143,6 +158,7 @@ static error_code on_read(size_t size, int index, socket_type peer)
     return error::invalid_argument;
   }
 
+  luaos_metrics_count(metrics_counter::socket_recv_bytes, size);
   lua_pushinteger(L, 0); //no error
   lua_pushlstring(L, peer->receive(), size);
   if (luaos_pcall(L, 2, 0) != LUA_OK) {
@@ -181,7 +197,7 @@ static error_code on_read_from(size_t size, int index, socket_type peer)
   error_code ec;
   ip::udp::endpoint remote;
   size = peer->receive_from((char*)data.c_str(), size, remote, ec);
-  if (ec || size == 0) {
+  if (ec) {
     return ec;
   }
 
@@ -259,6 +275,7 @@ static void on_accept(const error_code& ec, socket_type peer, int index, socket_
     return;
   }
 
+  luaos_metrics_count(metrics_counter::socket_accepts);
   lua_socket* lua_sock = new lua_socket(peer, family_type::tcp);
   if (!lua_sock) {
     return;
@@ -303,6 +320,9 @@ static void on_connect(const error_code& ec, int index, socket_type peer)
   if (!lua_isfunction(L, -1)) {
     return;
   }
+  if (!ec) {
+    luaos_metrics_count(metrics_counter::socket_connects);
+  }
 
   lua_pushinteger(L, ec.value());
   if (luaos_pcall(L, 1, 0) != LUA_OK) {
@@ -505,11 +525,16 @@ static int lua_os_socket_select(lua_State* L)
     );
   }
   else if (type == 2) {
+    /* the socket keeps one write handler, the new one replaces the old */
+    int sndref = (int)(size_t)raw_socket->context();
     lua_sock->async_wait(
       socket::wait_type::wait_write,
       std::bind(&on_send, placeholders1, placeholders2, handler_ref, raw_socket)
     );
     lua_sock->context(handler_ref);
+    if (sndref > 0) {
+      luaL_unref(L, LUA_REGISTRYINDEX, sndref);
+    }
   }
   lua_pushboolean(L, 1);
   return 0;
@@ -557,9 +582,14 @@ static int lua_os_socket_encode(lua_State* L)
 
   std::string packet;
   lua_socket* lua_sock = *mt;
-  lua_sock->encode(opcode, data, size, encrypt, compress, [&](const char* p, size_t n) {
+  bool ok = lua_sock->encode(opcode, data, size, encrypt, compress, [&](const char* p, size_t n) {
     packet.append(p, n);
   });
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushstring(L, "encrypt failed");
+    return 2;
+  }
 
   lua_pushlstring(L, packet.c_str(), packet.size());
   return 1;
@@ -653,6 +683,20 @@ static int lua_os_socket_available(lua_State* L)
   return 1;
 }
 
+static int lua_os_socket_queued(lua_State* L)
+{
+  lua_socket** mt = lua_socket::check_metatable(L);
+  if (!mt) {
+    lua_pushnil(L);
+    lua_pushstring(L, "#1 not a socket object");
+    return 2;
+  }
+  lua_socket* lua_sock = *mt;
+  size_t queued = lua_sock->get_socket()->queued();
+  lua_pushinteger(L, (lua_Integer)queued);
+  return 1;
+}
+
 static int lua_os_socket_nodelay(lua_State* L)
 {
   lua_socket** mt = lua_socket::check_metatable(L);
@@ -673,6 +717,50 @@ static int lua_os_socket_nodelay(lua_State* L)
   return 1;
 }
 
+static const char* const hash_names[] = { "none", "murmur", "crc32c", NULL };
+
+static int lua_os_socket_hash(lua_State* L)
+{
+  lua_socket** mt = lua_socket::check_metatable(L);
+  if (!mt) {
+    lua_pushnil(L);
+    lua_pushstring(L, "#1 not a socket object");
+    return 2;
+  }
+
+  lua_socket* lua_sock = *mt;
+  if (!lua_isnoneornil(L, 2)) {
+    lua_sock->hash(luaL_checkoption(L, 2, NULL, hash_names));
+  }
+  lua_pushstring(L, hash_names[lua_sock->hash()]);
+  return 1;
+}
+
+static const char* const cipher_names[] = { "none", "rc4", "aes-128-gcm", "chacha20-poly1305", NULL };
+
+static int lua_os_socket_cipher(lua_State* L)
+{
+  lua_socket** mt = lua_socket::check_metatable(L);
+  if (!mt) {
+    lua_pushnil(L);
+    lua_pushstring(L, "#1 not a socket object");
+    return 2;
+  }
+
+  lua_socket* lua_sock = *mt;
+  if (!lua_isnoneornil(L, 2)) {
+    int type = luaL_checkoption(L, 2, NULL, cipher_names);
+    luaL_argcheck(L, type != eth::cipher_none, 2, "use encrypt = false instead");
+    if (!lua_sock->cipher(type)) {
+      lua_pushnil(L);
+      lua_pushstring(L, "cipher not supported");
+      return 2;
+    }
+  }
+  lua_pushstring(L, cipher_names[lua_sock->cipher()]);
+  return 1;
+}
+
 static int lua_os_socket_decode(lua_State* L)
 {
   lua_socket** mt = lua_socket::check_metatable(L);
@@ -695,7 +783,9 @@ static int lua_os_socket_decode(lua_State* L)
     lua_pushvalue(L, 3);
     lua_pushlstring(L, p, n);
     lua_pushinteger(L, h->opcode);
-    if (luaos_pcall(L, 2, 0) != LUA_OK) {
+    lua_pushstring(L, hash_names[(int)h->hash]);
+    lua_pushstring(L, cipher_names[(int)h->cipher]);
+    if (luaos_pcall(L, 4, 0) != LUA_OK) {
       luaos_error("%s\n", lua_tostring(L, -1));
       lua_pop(L, 1);
     }
@@ -711,6 +801,9 @@ static int lua_os_socket_decode(lua_State* L)
     case 2:
       lua_pushstring(L, "hash check failed");
       break;
+    case 6:
+      lua_pushstring(L, "cipher not supported");
+      break;
     default:
       lua_pushstring(L, "decompress failed");
       break;
@@ -809,6 +902,46 @@ static int lua_os_socket_timeout(lua_State* L)
   return 1;
 }
 
+static size_t opt_limit(lua_State* L, int i, const char* name, size_t def)
+{
+  lua_getfield(L, i, name);
+  lua_Integer value = luaL_optinteger(L, -1, (lua_Integer)def);
+  lua_pop(L, 1);
+  if (value < 0) {
+    luaL_error(L, "%s must be >= 0", name);
+  }
+  return (size_t)value;
+}
+
+static int lua_os_socket_http_limit(lua_State* L)
+{
+  lua_socket** mt = lua_socket::check_metatable(L);
+  if (!mt) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "#1 not a socket object");
+    return 2;
+  }
+
+  lua_socket* lua_sock = *mt;
+  if (!lua_sock->is_tcp()) {
+    luaL_error(L, "socket must be tcp protocol");
+  }
+
+  http_limits limits;
+  if (!lua_isnoneornil(L, 2))
+  {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    limits.header_timeout  = opt_limit(L, 2, "header_timeout",  limits.header_timeout);
+    limits.body_timeout    = opt_limit(L, 2, "body_timeout",    limits.body_timeout);
+    limits.min_rate        = opt_limit(L, 2, "min_rate",        limits.min_rate);
+    limits.max_headers     = opt_limit(L, 2, "max_headers",     limits.max_headers);
+    limits.max_header_size = opt_limit(L, 2, "max_header_size", limits.max_header_size);
+    limits.max_body_size   = opt_limit(L, 2, "max_body_size",   limits.max_body_size);
+  }
+  lua_pushboolean(L, lua_sock->get_socket()->http_limit(limits) ? 1 : 0);
+  return 1;
+}
+
 static int lua_os_socket_id(lua_State* L)
 {
   lua_socket** mt = lua_socket::check_metatable(L);
@@ -866,20 +999,33 @@ static int lua_os_socket(lua_State* L)
   const char* family = luaL_optstring(L, -1, "tcp");
 
   lua_socket* lua_sock = 0;
+  bool matched = false;
   if (_tinydir_stricmp(family, "tcp") == 0)
   {
+    matched = true;
     sock = socket::create(
       ios, socket::family::sock_stream
     );
-    lua_sock = new lua_socket(sock, family_type::tcp);
+    if (sock) {
+      lua_sock = new lua_socket(sock, family_type::tcp);
+    }
   }
 
   if (_tinydir_stricmp(family, "udp") == 0)
   {
+    matched = true;
     sock = socket::create(
       ios, socket::family::sock_dgram
     );
-    lua_sock = new lua_socket(sock, family_type::udp);
+    if (sock) {
+      lua_sock = new lua_socket(sock, family_type::udp);
+    }
+  }
+
+  if (matched && !sock) {
+    lua_pushnil(L);
+    lua_pushstring(L, "too many sockets");
+    return 2;
   }
 
   if (!lua_sock) {
@@ -913,6 +1059,229 @@ static bool ssl_read_file(const char* filename, std::string& data)
   return true;
 }
 
+#ifdef TLS_SSL_ENABLE
+/*
+** Process wide tls state. Contexts built by tls.cache are kept by name
+** so certificates are parsed once for every job. Server sessions live in
+** one store, keyed by the session id context, and each scope (a cached
+** context name) has its own id context and ticket key, so a client
+** resumes on any job but only with the context that issued its session.
+*/
+typedef std::multimap<time_t, std::string> ssl_expiry_index;
+
+struct ssl_session_entry {
+  std::string data; /* i2d_SSL_SESSION */
+  ssl_expiry_index::iterator expiry;
+};
+
+static std::mutex _ssl_mutex;
+static std::map<std::string, std::shared_ptr<tls::ssl_context>> _ssl_contexts;
+static std::map<std::string, ssl_session_entry> _ssl_sessions;
+static ssl_expiry_index _ssl_expiry; /* earliest first */
+static size_t _ssl_session_limit = 20480;
+
+static int ssl_persistent_index()
+{
+  static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+static void ssl_scope_free(void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*)
+{
+  delete (std::string*)ptr;
+}
+
+/* the session id context of a context with the session cache on */
+static int ssl_scope_index()
+{
+  static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, ssl_scope_free);
+  return index;
+}
+
+/* name, hmac and aes keys; OpenSSL 1.1.0 and later take 80 bytes, older ones 48 */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define ssl_ticket_keys_size 80
+#else
+#define ssl_ticket_keys_size 48
+#endif
+
+/* sha256(secret, scope, tag, counter), the secret is drawn once per process */
+static void ssl_derive(const std::string& scope, char tag, unsigned char* out, size_t size)
+{
+  static unsigned char secret[32];
+  static std::once_flag once;
+  std::call_once(once, []() {
+    RAND_bytes(secret, sizeof(secret));
+  });
+  std::string input((const char*)secret, sizeof(secret));
+  input.append(scope);
+  input.push_back(tag);
+  input.push_back(0);
+  for (size_t i = 0; i < size; i += SHA256_DIGEST_LENGTH)
+  {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    input.back() = (char)(i / SHA256_DIGEST_LENGTH);
+    EVP_Digest(input.data(), input.size(), digest, nullptr, EVP_sha256(), nullptr);
+    memcpy(out + i, digest, std::min<size_t>(SHA256_DIGEST_LENGTH, size - i));
+  }
+}
+
+static std::string ssl_session_key(const unsigned char* sid, size_t sidsize, const unsigned char* id, size_t size)
+{
+  std::string key((const char*)sid, sidsize);
+  key.append((const char*)id, size);
+  return key;
+}
+
+static void ssl_session_erase(std::map<std::string, ssl_session_entry>::iterator iter)
+{
+  _ssl_expiry.erase(iter->second.expiry);
+  _ssl_sessions.erase(iter);
+}
+
+static int ssl_session_new(SSL* ssl, SSL_SESSION* session)
+{
+  unsigned int size = 0, sidsize = 0;
+  const unsigned char* id = SSL_SESSION_get_id(session, &size);
+  const unsigned char* sid = SSL_SESSION_get0_id_context(session, &sidsize);
+  int length = i2d_SSL_SESSION(session, nullptr);
+  if (size == 0 || length <= 0) {
+    return 0;
+  }
+  std::string key = ssl_session_key(sid, sidsize, id, size);
+  ssl_session_entry entry;
+  entry.data.resize((size_t)length);
+  unsigned char* p = (unsigned char*)&entry.data[0];
+  i2d_SSL_SESSION(session, &p);
+  time_t expires = (time_t)(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session));
+
+  std::unique_lock<std::mutex> lock(_ssl_mutex);
+  auto iter = _ssl_sessions.find(key);
+  if (iter != _ssl_sessions.end()) {
+    ssl_session_erase(iter);
+  }
+  time_t now = time(0);
+  while (!_ssl_expiry.empty())
+  {
+    /* expired ones first, then the one closest to expiring */
+    auto first = _ssl_expiry.begin();
+    if (first->first > now && _ssl_sessions.size() < _ssl_session_limit) {
+      break;
+    }
+    ssl_session_erase(_ssl_sessions.find(first->second));
+  }
+  entry.expiry = _ssl_expiry.insert(std::make_pair(expires, key));
+  _ssl_sessions[key] = std::move(entry);
+  return 0; /* not holding a reference */
+}
+
+static SSL_SESSION* ssl_session_get(SSL* ssl, const unsigned char* id, int size, int* copy)
+{
+  *copy = 0;
+  auto scope = (const std::string*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ssl_scope_index());
+  if (!scope) {
+    return nullptr;
+  }
+  std::string key = ssl_session_key((const unsigned char*)scope->data(), scope->size(), id, (size_t)size);
+  std::string data;
+  {
+    std::unique_lock<std::mutex> lock(_ssl_mutex);
+    auto iter = _ssl_sessions.find(key);
+    if (iter == _ssl_sessions.end()) {
+      return nullptr;
+    }
+    if (iter->second.expiry->first <= time(0)) {
+      ssl_session_erase(iter);
+      return nullptr;
+    }
+    data = iter->second.data;
+  }
+  const unsigned char* p = (const unsigned char*)data.data();
+  return d2i_SSL_SESSION(nullptr, &p, (long)data.size());
+}
+
+static void ssl_session_remove(SSL_CTX* ctx, SSL_SESSION* session)
+{
+  unsigned int size = 0, sidsize = 0;
+  const unsigned char* id = SSL_SESSION_get_id(session, &size);
+  const unsigned char* sid = SSL_SESSION_get0_id_context(session, &sidsize);
+  std::string key = ssl_session_key(sid, sidsize, id, size);
+  std::unique_lock<std::mutex> lock(_ssl_mutex);
+  auto iter = _ssl_sessions.find(key);
+  if (iter != _ssl_sessions.end()) {
+    ssl_session_erase(iter);
+  }
+}
+
+/*
+** Resume through the shared store. The scope picks the session id context
+** and the ticket key, contexts of the same scope resume each other's
+** sessions on any job. Without a scope a context keeps the one it has,
+** or gets one of its own.
+*/
+static bool ssl_session_enable(tls::ssl_context& ctx, long timeout, const char* scope)
+{
+  SSL_CTX* handle = ctx.native_handle();
+  auto sid = (std::string*)SSL_CTX_get_ex_data(handle, ssl_scope_index());
+  if (!sid || scope)
+  {
+    static std::atomic<size_t> anonymous(0);
+    unsigned char keys[ssl_ticket_keys_size];
+    std::string name = scope ? std::string("n") + scope : "a" + std::to_string(++anonymous);
+    std::string id(SSL_MAX_SID_CTX_LENGTH, 0);
+    ssl_derive(name, 's', (unsigned char*)&id[0], id.size());
+    ssl_derive(name, 't', keys, sizeof(keys));
+    SSL_CTX_set_session_id_context(handle, (const unsigned char*)id.data(), (unsigned int)id.size());
+    if (SSL_CTX_set_tlsext_ticket_keys(handle, keys, sizeof(keys)) != 1) {
+      luaos_error("tls session tickets can't take the ticket key\n");
+      return false;
+    }
+    delete sid;
+    SSL_CTX_set_ex_data(handle, ssl_scope_index(), new std::string(id));
+  }
+  SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_set_timeout(handle, timeout);
+  SSL_CTX_sess_set_new_cb(handle, ssl_session_new);
+  SSL_CTX_sess_set_get_cb(handle, ssl_session_get);
+  SSL_CTX_sess_set_remove_cb(handle, ssl_session_remove);
+  return true;
+}
+
+static std::shared_ptr<tls::ssl_context> ssl_create()
+{
+  std::shared_ptr<tls::ssl_context> ctx(new tls::ssl_context(ssl::context_base::tlsv12));
+  ctx->set_options(ssl::context::default_workarounds
+    | ssl::context::no_sslv2
+    | ssl::context::no_sslv3
+    | ssl::context::no_tlsv1
+    | ssl::context::single_dh_use
+  );
+  error_code ec;
+  ctx->set_default_verify_paths(ec);
+  return ctx;
+}
+
+static bool ssl_assign(tls::ssl_context& ctx, const char* cert, size_t certsize, const char* key, size_t keysize, const char* pwd)
+{
+  error_code ec;
+  ctx.use_certificate_chain(buffer(cert, certsize), ec);
+  if (ec) {
+    return false;
+  }
+  if (pwd) {
+    std::string cpwd(pwd);
+    ctx.set_password_callback(std::bind([cpwd](size_t, ssl::context::password_purpose) {
+      return cpwd;
+    }, placeholders1, placeholders2), ec);
+    if (ec) {
+      return false;
+    }
+  }
+  ctx.use_private_key(buffer(key, keysize), ssl::context::pem, ec);
+  return !ec;
+}
+#endif
+
 static int ssl_sni_callback(SSL* ssl, int* al, void* arg)
 {
 #ifdef TLS_SSL_ENABLE
@@ -923,16 +1292,31 @@ static int ssl_sni_callback(SSL* ssl, int* al, void* arg)
   if (ref > 0)
   {
     lua_State* L = luaos_local.lua_state();
+    stack_rollback rollback(L);
+    SSL_CTX* ctx_handle = SSL_get_SSL_CTX(ssl);
+    bool persistent = SSL_CTX_get_ex_data(ctx_handle, ssl_persistent_index()) != nullptr;
+
     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
     if (servername) {
       lua_pushstring(L, servername);
     } else {
       lua_pushnil(L);
     }
-    luaL_unref(L, LUA_REGISTRYINDEX, ref);
-    if (luaos_pcall(L, 1, 0) != LUA_OK) {
+    if (!persistent) {
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+    if (luaos_pcall(L, 1, 1) != LUA_OK) {
       luaos_error("%s\n", lua_tostring(L, -1));
-      lua_pop(L, 1);
+      return persistent ? SSL_TLSEXT_ERR_ALERT_FATAL : SSL_TLSEXT_ERR_OK;
+    }
+    /* a persistent callback answers with the context for this name */
+    if (persistent)
+    {
+      shared_ctx** userdata = lua_socket::check_ssl_metatable(L, -1);
+      if (!userdata) {
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+      }
+      SSL_set_SSL_CTX(ssl, (*userdata)->ctx->native_handle());
     }
   }
   return SSL_TLSEXT_ERR_OK;
@@ -941,6 +1325,14 @@ static int ssl_sni_callback(SSL* ssl, int* al, void* arg)
 #endif
 }
 
+#ifdef TLS_SSL_ENABLE
+/* a cached context is shared by every job, none of them may change it */
+static void ssl_check_private(lua_State* L, shared_ctx* shared)
+{
+  luaL_argcheck(L, !shared->cached, 1, "cached context can't be changed");
+}
+#endif
+
 static int lua_os_socket_ssl_sni_callback(lua_State* L)
 {
 #ifdef TLS_SSL_ENABLE
@@ -948,11 +1340,20 @@ static int lua_os_socket_ssl_sni_callback(lua_State* L)
   if (!userdata) {
     return 0;
   }
+  ssl_check_private(L, *userdata);
   luaL_argcheck(L, lua_isfunction(L, 2), 2, "must be function");
+  bool persistent = lua_toboolean(L, 3) != 0;
+  lua_settop(L, 2);
+
   auto ctx = (*userdata)->ctx;
   int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if ((*userdata)->sni_ref) {
+    luaL_unref(L, LUA_REGISTRYINDEX, (*userdata)->sni_ref);
+  }
+  (*userdata)->sni_ref = persistent ? ref : 0;
 
   auto ctx_handle = ctx->native_handle();
+  SSL_CTX_set_ex_data(ctx_handle, ssl_persistent_index(), persistent ? (void*)1 : nullptr);
   SSL_CTX_set_tlsext_servername_callback(ctx_handle, ssl_sni_callback);
   SSL_CTX_set_tlsext_servername_arg(ctx_handle, (void*)(size_t)ref);
   lua_pushboolean(L, 1);
@@ -969,6 +1370,7 @@ static int lua_os_socket_ssl_load_ca(lua_State* L)
   if (!userdata) {
     return 0;
   }
+  ssl_check_private(L, *userdata);
   error_code ec;
   const char* certfile = luaL_checkstring(L, 2);
   auto ctx = (*(userdata))->ctx;
@@ -995,34 +1397,13 @@ static int lua_os_socket_ssl_assign(lua_State* L)
   if (!userdata) {
     return 0;
   }
+  ssl_check_private(L, *userdata);
   auto ctx = (*userdata)->ctx;
   size_t certsize = 0, keysize = 0;
   const char* certfile = luaL_checklstring(L, 2, &certsize);
   const char* key      = luaL_checklstring(L, 3, &keysize);
   const char* pwd      = luaL_optstring(L, 4, nullptr);
-
-  error_code ec;
-  ctx->use_certificate_chain(buffer(certfile, certsize), ec);
-  if (ec) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-  ctx->use_private_key(buffer(key, keysize), ssl::context::pem, ec);
-  if (ec) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-  if (pwd) {
-    std::string cpwd(pwd);
-    ctx->set_password_callback(std::bind([cpwd](size_t, ssl::context::password_purpose) {
-      return cpwd.c_str();
-    }, placeholders1, placeholders2), ec);
-    if (ec) {
-      lua_pushboolean(L, 0);
-      return 1;
-    }
-  }
-  lua_pushboolean(L, 1);
+  lua_pushboolean(L, ssl_assign(*ctx, certfile, certsize, key, keysize, pwd) ? 1 : 0);
 #else
   lua_pushboolean(L, 0);
 #endif
@@ -1036,6 +1417,7 @@ static int lua_os_socket_ssl_load(lua_State* L)
   if (!userdata) {
     return 0;
   }
+  ssl_check_private(L, *userdata);
   std::string certdata;
   if (!ssl_read_file(luaL_checkstring(L, 2), certdata)) {
     lua_pushboolean(L, 0);
@@ -1064,19 +1446,11 @@ static int lua_os_socket_ssl_load(lua_State* L)
 static int lua_os_socket_ssl_context(lua_State* L)
 {
 #ifdef TLS_SSL_ENABLE
-  shared_ctx* shared = new shared_ctx(ssl::context_base::tlsv12);
+  shared_ctx* shared = new shared_ctx(ssl_create());
   if (!shared) {
     return 0;
   }
-  auto ctx = shared->ctx;
-  ctx->set_options(ssl::context::default_workarounds
-    | ssl::context::no_sslv2
-    | ssl::context::no_sslv3
-    | ssl::context::no_tlsv1
-    | ssl::context::single_dh_use
-  );
-  error_code ec;
-  ctx->set_default_verify_paths(ec);
+  shared->cached = false;
   shared_ctx** userdata = lexnew_userdata<shared_ctx*>(L, lua_socket::ssl_metatable_name());
   if (userdata) {
     *userdata = shared;
@@ -1089,6 +1463,93 @@ static int lua_os_socket_ssl_context(lua_State* L)
 #endif
 }
 
+/*
+** tls.cache(name [, certfile, keyfile, passwd])
+** The context registered under name, built from the files and shared
+** by every job on first use. Returns nil when it is missing and no
+** files are given, or when they can't be loaded.
+*/
+static int lua_os_socket_ssl_cache(lua_State* L)
+{
+#ifdef TLS_SSL_ENABLE
+  std::string name(luaL_checkstring(L, 1));
+  std::shared_ptr<tls::ssl_context> ctx;
+  {
+    std::unique_lock<std::mutex> lock(_ssl_mutex);
+    auto iter = _ssl_contexts.find(name);
+    if (iter != _ssl_contexts.end()) {
+      ctx = iter->second;
+    }
+  }
+  if (!ctx)
+  {
+    if (lua_isnoneornil(L, 2)) {
+      return 0;
+    }
+    std::string certdata, keydata;
+    if (!ssl_read_file(luaL_checkstring(L, 2), certdata)) {
+      return 0;
+    }
+    if (!ssl_read_file(luaL_checkstring(L, 3), keydata)) {
+      return 0;
+    }
+    ctx = ssl_create();
+    const char* password = luaL_optstring(L, 4, nullptr);
+    if (!ssl_assign(*ctx, certdata.c_str(), certdata.size(), keydata.c_str(), keydata.size(), password)) {
+      return 0;
+    }
+    if (!ssl_session_enable(*ctx, 300, name.c_str())) {
+      return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(_ssl_mutex);
+    auto result = _ssl_contexts.insert(std::make_pair(name, ctx));
+    ctx = result.first->second; /* another job may have won the race */
+  }
+  shared_ctx* shared = new shared_ctx(ctx);
+  shared_ctx** userdata = lexnew_userdata<shared_ctx*>(L, lua_socket::ssl_metatable_name());
+  if (userdata) {
+    *userdata = shared;
+  } else {
+    delete shared;
+  }
+  return userdata ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+/* tls.uncache(name), drop a cached context so the next use reloads it */
+static int lua_os_socket_ssl_uncache(lua_State* L)
+{
+#ifdef TLS_SSL_ENABLE
+  std::string name(luaL_checkstring(L, 1));
+  std::unique_lock<std::mutex> lock(_ssl_mutex);
+  lua_pushboolean(L, _ssl_contexts.erase(name) ? 1 : 0);
+#else
+  lua_pushboolean(L, 0);
+#endif
+  return 1;
+}
+
+/* context:session_cache([timeout [, scope]]), resume server sessions across jobs */
+static int lua_os_socket_ssl_session_cache(lua_State* L)
+{
+#ifdef TLS_SSL_ENABLE
+  shared_ctx** userdata = lua_socket::check_ssl_metatable(L);
+  if (!userdata) {
+    return 0;
+  }
+  lua_Integer timeout = luaL_optinteger(L, 2, 300);
+  luaL_argcheck(L, timeout > 0, 2, "must be > 0");
+  const char* scope = luaL_optstring(L, 3, nullptr);
+  lua_pushboolean(L, ssl_session_enable(*(*userdata)->ctx, (long)timeout, scope) ? 1 : 0);
+#else
+  lua_pushboolean(L, 0);
+#endif
+  return 1;
+}
+
 static int lua_os_socket_ssl_gc(lua_State* L)
 {
 #ifdef TLS_SSL_ENABLE
@@ -1096,7 +1557,14 @@ static int lua_os_socket_ssl_gc(lua_State* L)
   if (!userdata) {
     return 0;
   }
-  delete *userdata;
+  shared_ctx* shared = *userdata;
+  if (shared->sni_ref)
+  {
+    /* sockets may still hold the context, leave them no stale ref */
+    SSL_CTX_set_tlsext_servername_arg(shared->ctx->native_handle(), nullptr);
+    luaL_unref(L, LUA_REGISTRYINDEX, shared->sni_ref);
+  }
+  delete shared;
   *userdata = nullptr;
 #endif
   return 0;
@@ -1148,6 +1616,77 @@ static int lua_os_socket_ssl_enable(lua_State* L)
   return 1;
 }
 
+/*
+** socket:ktls(enable) before tls_enable asks for kernel tls, returns
+** whether it can be had here. socket:ktls() tells if it is running.
+*/
+static int lua_os_socket_ktls(lua_State* L)
+{
+  lua_socket** mt = lua_socket::check_metatable(L);
+  if (!mt) {
+    return 0;
+  }
+  lua_socket* lua_sock = *mt;
+  if (!lua_sock->is_tcp()) {
+    luaL_error(L, "socket must be tcp protocol");
+  }
+#ifdef TLS_SSL_ENABLE
+  if (lua_isnoneornil(L, 2)) {
+    lua_pushboolean(L, lua_sock->get_socket()->ktls() ? 1 : 0);
+    return 1;
+  }
+  bool enable = lua_toboolean(L, 2) != 0;
+  lua_sock->get_socket()->ktls_enable(enable);
+  lua_pushboolean(L, enable && ktls::supported() ? 1 : 0);
+#else
+  lua_pushboolean(L, 0);
+#endif
+  return 1;
+}
+
+/* socket:sendfile(filename [, offset [, length]]), queued like send(data, true) */
+static int lua_os_socket_sendfile(lua_State* L)
+{
+  lua_socket** mt = lua_socket::check_metatable(L);
+  if (!mt) {
+    lua_pushnil(L);
+    lua_pushstring(L, "#1 not a socket object");
+    return 2;
+  }
+  lua_socket* lua_sock = *mt;
+  if (!lua_sock->is_tcp()) {
+    luaL_error(L, "socket must be tcp protocol");
+  }
+  const char* filename = luaL_checkstring(L, 2);
+  lua_Integer offset = luaL_optinteger(L, 3, 0);
+  lua_Integer length = luaL_optinteger(L, 4, -1);
+  luaL_argcheck(L, offset >= 0, 3, "must be >= 0");
+
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "can't open %s", filename);
+    return 2;
+  }
+  fseek(fp, 0, SEEK_END);
+  lua_Integer size = (lua_Integer)ftell(fp);
+  if (offset > size) {
+    offset = size;
+  }
+  if (length < 0 || length > size - offset) {
+    length = size - offset;
+  }
+  if (length == 0) {
+    fclose(fp);
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  lua_sock->get_socket()->async_send_file(fp, (uint64_t)offset, (size_t)length);
+  luaos_metrics_count(metrics_counter::socket_send_bytes, (size_t)length);
+  lua_pushinteger(L, length);
+  return 1;
+}
+
 static int lua_os_socket_ssl_handshake(lua_State* L)
 {
   lua_socket** mt = lua_socket::check_metatable(L);
@@ -1221,10 +1760,14 @@ void lua_socket::init_metatable(lua_State* L)
     { "id",           lua_os_socket_id            },
     { "nodelay",      lua_os_socket_nodelay       },
     { "available",    lua_os_socket_available     },
+    { "queued",       lua_os_socket_queued        },
     { "timeout",      lua_os_socket_timeout       },
+    { "http_limit",   lua_os_socket_http_limit    },
     { "endpoint",     lua_os_socket_endpoint      },
     { "select",       lua_os_socket_select        },
     { "encode",       lua_os_socket_encode        },
+    { "hash",         lua_os_socket_hash          },
+    { "cipher",       lua_os_socket_cipher        },
     { "send",         lua_os_socket_send          },
     { "send_to",      lua_os_socket_send_to       },
     { "decode",       lua_os_socket_decode        },
@@ -1232,6 +1775,8 @@ void lua_socket::init_metatable(lua_State* L)
     { "receive_from", lua_os_socket_receive_from  },
     { "tls_sni",      lua_os_socket_ssl_sni       },
     { "tls_enable",   lua_os_socket_ssl_enable    },
+    { "ktls",         lua_os_socket_ktls          },
+    { "sendfile",     lua_os_socket_sendfile      },
     { "handshake",    lua_os_socket_ssl_handshake },
     { NULL,           NULL                        },
   };
@@ -1260,6 +1805,10 @@ void lua_socket::init_ssl_metatable(lua_State* L)
   lua_newtable(L);
   lua_pushcfunction(L, lua_os_socket_ssl_context);
   lua_setfield(L, -2, "context");
+  lua_pushcfunction(L, lua_os_socket_ssl_cache);
+  lua_setfield(L, -2, "cache");
+  lua_pushcfunction(L, lua_os_socket_ssl_uncache);
+  lua_setfield(L, -2, "uncache");
   lua_setglobal(L, "tls");
 
   struct luaL_Reg methods[] = {
@@ -1268,6 +1817,7 @@ void lua_socket::init_ssl_metatable(lua_State* L)
     { "ca",           lua_os_socket_ssl_load_ca       },
     { "load",         lua_os_socket_ssl_load          },
     { "sni_callback", lua_os_socket_ssl_sni_callback  },
+    { "session_cache",lua_os_socket_ssl_session_cache },
     { "close",        lua_os_socket_ssl_close         },
     { NULL,           NULL },
   };
@@ -30,9 +30,14 @@ enum struct family_type {
 #ifdef TLS_SSL_ENABLE
 struct shared_ctx {
   shared_ctx(ssl::context_base::method method)
-    : ctx(new tls::ssl_context(method)) {
+    : ctx(new tls::ssl_context(method)), sni_ref(0), cached(false) {
+  }
+  shared_ctx(std::shared_ptr<tls::ssl_context> from)
+    : ctx(from), sni_ref(0), cached(true) {
   }
   std::shared_ptr<tls::ssl_context> ctx;
+  int  sni_ref; /* persistent sni callback, released with the userdata */
+  bool cached;  /* shared with other jobs through tls.cache */
 };
 #endif
 
@@ -110,9 +115,21 @@ public:
     return _socket->decode(data, size, ec, handler);
   }
   template <typename Handler>
-  void encode(int opcode, const char* data, size_t size, bool encrypt, bool compress, Handler handler)
+  bool encode(int opcode, const char* data, size_t size, bool encrypt, bool compress, Handler handler)
   {
-    _socket->encode(opcode, data, size, encrypt, compress, handler);
+    return _socket->encode(opcode, data, size, encrypt, compress, handler);
+  }
+  inline int hash() const {
+    return _socket->hash();
+  }
+  inline void hash(int type) {
+    _socket->hash(type);
+  }
+  inline int cipher() const {
+    return _socket->cipher();
+  }
+  inline bool cipher(int type) {
+    return _socket->cipher(type);
   }
   template <typename Handler>
   error_code bind(unsigned short port, const char* host, Handler handler)
@@ -19,7 +19,10 @@
 #include <vector>
 #include <functional>
 #include <atomic>
+#include <condition_variable>
 #include <chrono>
+#include <thread>
+#include <algorithm>
 #include <conv.h>
 
 #include "luaos.h"
@@ -27,10 +30,16 @@
 #include "rapidjson/rapidjson.h"
 #include "luaos_socket.h"
 #include "luaos_list.h"
+#include "luaos_metrics.h"
 #include "luaos_compile.h"
 #include "luaos_conv.h"
 #include "luaos_pack.h"
 #include "luaos_rpcall.h"
+#include "luaos_async.h"
+#include "luaos_dispatcher.h"
+#include "luaos_queue.h"
+#include "luaos_file.h"
+#include "luaos_frozen.h"
 #include "luaos_storage.h"
 #include "luaos_subscriber.h"
 #include "luaos_traceback.h"
@@ -102,6 +111,9 @@ int luaos_pcall(lua_State* L, int n, int r)
   lua_insert(L, index);
   int status = lua_pcallk(L, n, r, index, 1, finishpcall);
   lua_remove(L, index); /* remove traceback from stack */
+  if (status != LUA_OK) {
+    luaos_metrics_count(metrics_counter::pcall_errors);
+  }
   return status;
 }
 
@@ -962,48 +974,91 @@ int luaos_printf(color_type color, const char* fmt, ...)
 
 /***********************************************************************************/
 
+#define alive_default_timeout 600000
+
+/*
+** Every state owns a heartbeat slot. The job thread only touches its own
+** slot through atomics, alive_mutex just guards the registration.
+*/
+struct profile_session;
+
+struct alive_slot final {
+  lua_State* L;
+  io_handler ios;
+  std::shared_ptr<profile_session> profile;  /* std::atomic_load/atomic_store */
+  std::atomic<size_t> heartbeat;
+  std::atomic<size_t> timeout;
+  std::atomic<bool>   interrupt;
+  std::atomic<bool>   stalled;
+};
+
+typedef std::shared_ptr<alive_slot> alive_handler;
+
 static std::mutex alive_mutex;
-static std::map<lua_State*, size_t> alive_states;
+static std::map<lua_State*, alive_handler> alive_states;
 static std::shared_ptr<std::thread> alive_thread;
+static thread_local alive_handler alive_local;
 
-static void interrupt(lua_State *L, lua_Debug *ar)
+static void stall_hook(lua_State *L, lua_Debug *ar)
 {
   (void)ar;  /* unused arg. */
   lua_sethook(L, NULL, 0, 0);
-  luaL_error(L, "lua run timeout, interrupted!");
+
+  alive_handler slot = alive_local;
+  if (!slot || slot->L != L) {
+    return;
+  }
+  size_t now = os::milliseconds();
+  size_t elapsed = now - slot->heartbeat;
+  if (elapsed < slot->timeout) {
+    return;  /* returned to os.wait in the meantime */
+  }
+  size_t pending = slot->ios ? slot->ios->pending() : 0;
+  luaL_traceback(L, L, NULL, 0);
+  luaos_error("job %d stalled for %zu ms with %zu pending messages\n%s\n",
+    luaos_local.get_pid(), elapsed, pending, lua_tostring(L, -1)
+  );
+  lua_pop(L, 1);
+  if (slot->interrupt) {
+    luaL_error(L, "lua run timeout, interrupted!");
+  }
 }
 
-static void alive_check(size_t now, size_t timeout)
+static void alive_check(size_t now)
 {
   std::unique_lock<std::mutex> lock(alive_mutex);
   for (auto iter = alive_states.begin(); iter != alive_states.end(); iter++)
   {
-    lua_State* L = iter->first;
-    if (lua_gethookmask(L)) {
+    alive_slot* slot = iter->second.get();
+    size_t timeout = slot->timeout;
+    if (!timeout || slot->stalled) {
       continue;
     }
-    if (now < iter->second) {
+    size_t heartbeat = slot->heartbeat;
+    if (now < heartbeat || now - heartbeat < timeout) {
       continue;
     }
-    if (now - iter->second < timeout) {
+    if (lua_gethookmask(slot->L)) {
       continue;
     }
-    iter->second = 0;
-    lua_sethook(L, interrupt, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+    slot->stalled = true;
+    lua_sethook(slot->L, stall_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
   }
 }
 
-static int keep_alive(lua_State* L)
+static void keep_alive(size_t now)
 {
-  std::unique_lock<std::mutex> lock(alive_mutex);
-  auto iter = alive_states.find(L);
-  if (iter != alive_states.end()) {
-    iter->second = os::milliseconds();
+  alive_slot* slot = alive_local.get();
+  if (!slot) {
+    return;
+  }
+  slot->heartbeat.store(now, std::memory_order_relaxed);
+  if (slot->stalled) {
+    slot->stalled = false;
   }
-  return 0;
 }
 
-static void check_thread(size_t timeout)
+static void check_thread()
 {
   size_t last = os::milliseconds();
   while (!alive_exit->stopped())
@@ -1014,8 +1069,216 @@ static void check_thread(size_t timeout)
       continue;
     }
     last = now;
-    alive_check(now, timeout);
+    alive_check(now);
+    storage::expire_check(now);
+  }
+}
+
+static int luaos_watchdog(lua_State* L)
+{
+  alive_slot* slot = alive_local.get();
+  if (!slot) {
+    return 0;
+  }
+  size_t previous = slot->timeout;
+  if (lua_gettop(L) > 0)
+  {
+    lua_Integer timeout = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, timeout >= 0, 1, "must be >= 0");
+    slot->interrupt = luaL_optboolean(L, 2, true);
+    slot->timeout = (size_t)timeout;
+  }
+  lua_pushinteger(L, (lua_Integer)previous);
+  return 1;
+}
+
+/***********************************************************************************/
+
+#define profile_max_depth 64
+
+/*
+** A sampling session: a timer thread arms a one-shot count hook at the
+** requested rate, the hook then runs on the profiled thread and records
+** its Lua stack as a folded line (root;...;leaf).
+*/
+struct profile_session final {
+  size_t hz = 0;
+  size_t samples = 0;
+  lua_State* L = nullptr;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::map<std::string, size_t> stacks;
+  std::atomic<bool> stopped{ false };
+  std::thread thread;
+
+  inline void stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    wakeup.notify_all();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  inline ~profile_session() {
+    stop();
+  }
+};
+
+typedef std::shared_ptr<profile_session> profile_handler;
+
+static std::map<int, profile_handler> profile_sessions;  /* guarded by alive_mutex */
+
+static void profile_hook(lua_State* L, lua_Debug* ar)
+{
+  (void)ar;  /* unused arg. */
+  lua_sethook(L, NULL, 0, 0);
+
+  /* the slot belongs to this thread, only the session pointer is shared */
+  profile_handler session;
+  if (alive_local && alive_local->L == L) {
+    session = std::atomic_load(&alive_local->profile);
+  }
+  if (!session) {
+    return;
+  }
+  std::string frames[profile_max_depth];
+  int depth = 0;
+
+  lua_Debug info;
+  for (int level = 0; depth < profile_max_depth && lua_getstack(L, level, &info); level++)
+  {
+    if (!lua_getinfo(L, "Sn", &info)) {
+      break;
+    }
+    char buffer[LUA_IDSIZE + 128];
+    if (*info.what == 'C') {
+      snprintf(buffer, sizeof(buffer), "[C] %s", info.name ? info.name : "?");
+    }
+    else {
+      snprintf(buffer, sizeof(buffer), "%s (%s:%d)",
+        info.name ? info.name : (*info.what == 'm' ? "main chunk" : "?"),
+        info.short_src, info.linedefined
+      );
+    }
+    frames[depth++] = buffer;
+  }
+  if (depth == 0) {
+    return;
+  }
+  std::string folded;
+  for (int i = depth - 1; i >= 0; i--) {
+    folded.append(frames[i]);
+    if (i) folded.push_back(';');
+  }
+  std::unique_lock<std::mutex> lock(session->mutex);
+  session->stacks[folded]++;
+  session->samples++;
+}
+
+static void profile_thread(profile_handler session)
+{
+  auto interval = std::chrono::microseconds(1000000 / session->hz);
+  auto expires = std::chrono::steady_clock::now();
+  while (true)
+  {
+    expires += interval;
+    std::unique_lock<std::mutex> lock(session->mutex);
+    if (session->wakeup.wait_until(lock, expires, [&session]() { return session->stopped.load(); })) {
+      break;
+    }
+    lock.unlock();
+
+    /* luaos_close stops the session before closing the state */
+    if (!lua_gethookmask(session->L)) {
+      lua_sethook(session->L, profile_hook, LUA_MASKCOUNT, 1);
+    }
+  }
+}
+
+static alive_handler find_slot(int id)
+{
+  for (auto iter = alive_states.begin(); iter != alive_states.end(); iter++) {
+    alive_handler slot = iter->second;
+    if (slot->ios && slot->ios->id() == id) {
+      return slot;
+    }
   }
+  return alive_handler();
+}
+
+static int profile_start(lua_State* L)
+{
+  int id = (int)luaL_optinteger(L, 1, luaos_local.get_id());
+  lua_Integer hz = luaL_optinteger(L, 2, 100);
+  luaL_argcheck(L, hz > 0 && hz <= 10000, 2, "must be in 1-10000");
+
+  std::unique_lock<std::mutex> lock(alive_mutex);
+  alive_handler slot = find_slot(id);
+  if (!slot || slot->profile || profile_sessions.count(id)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  profile_handler session(new profile_session());
+  session->hz = (size_t)hz;
+  session->L  = slot->L;
+  std::atomic_store(&slot->profile, session);
+  profile_sessions[id] = session;
+  session->thread = std::thread(std::bind(profile_thread, session));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int profile_stop(lua_State* L)
+{
+  int id = (int)luaL_optinteger(L, 1, luaos_local.get_id());
+  profile_handler session;
+  {
+    std::unique_lock<std::mutex> lock(alive_mutex);
+    auto iter = profile_sessions.find(id);
+    if (iter == profile_sessions.end()) {
+      lua_pushnil(L);
+      return 1;
+    }
+    session = iter->second;
+    profile_sessions.erase(iter);
+  }
+  session->stop();
+  {
+    std::unique_lock<std::mutex> lock(alive_mutex);
+    auto iter = alive_states.find(session->L);
+    if (iter != alive_states.end() && std::atomic_load(&iter->second->profile) == session) {
+      std::atomic_store(&iter->second->profile, profile_handler());
+      if (lua_gethook(session->L) == profile_hook) {
+        lua_sethook(session->L, NULL, 0, 0);
+      }
+    }
+  }
+  std::vector<std::pair<std::string, size_t>> stacks;
+  {
+    std::unique_lock<std::mutex> lock(session->mutex);
+    stacks.assign(session->stacks.begin(), session->stacks.end());
+  }
+  std::sort(stacks.begin(), stacks.end(),
+    [](const std::pair<std::string, size_t>& a, const std::pair<std::string, size_t>& b) {
+      return a.second > b.second;
+    }
+  );
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t samples = 0;
+  for (auto& v : stacks) {
+    char count[32];
+    snprintf(count, sizeof(count), " %zu\n", v.second);
+    luaL_addlstring(&b, v.first.c_str(), v.first.size());
+    luaL_addstring(&b, count);
+    samples += v.second;
+  }
+  luaL_pushresult(&b);
+  lua_pushinteger(L, (lua_Integer)samples);
+  return 2;
 }
 
 static int luaos_stopped(lua_State* L)
@@ -1025,6 +1288,151 @@ static int luaos_stopped(lua_State* L)
   return 1;
 }
 
+static void update_metrics(lua_State* L, size_t handlers)
+{
+  luaos_metrics_count(metrics_counter::handlers, handlers);
+  luaos_metrics_heap(((size_t)lua_gc(L, LUA_GCCOUNT) << 10) + (size_t)lua_gc(L, LUA_GCCOUNTB));
+}
+
+/* read a cpu or an array of cpus, false if malformed or out of range */
+static bool check_cpus(lua_State* L, int i, std::vector<int>& cpus)
+{
+  i = lua_absindex(L, i);
+  cpus.clear();
+  if (lua_isinteger(L, i)) {
+    cpus.push_back((int)lua_tointeger(L, i));
+  }
+  else if (lua_istable(L, i))
+  {
+    lua_Integer n = luaL_len(L, i);
+    for (lua_Integer j = 1; j <= n; j++)
+    {
+      bool ok = lua_rawgeti(L, i, j) == LUA_TNUMBER && lua_isinteger(L, -1);
+      if (ok) {
+        cpus.push_back((int)lua_tointeger(L, -1));
+      }
+      lua_pop(L, 1);
+      if (!ok) {
+        return false;
+      }
+    }
+  }
+  if (cpus.empty()) {
+    return false;
+  }
+  int limit = (int)std::thread::hardware_concurrency();
+  for (int cpu : cpus) {
+    if (cpu < 0 || (limit > 0 && cpu >= limit)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool bind_cpus(const std::vector<int>& cpus)
+{
+  if (!os::affinity(cpus.data(), cpus.size())) {
+    return false;
+  }
+  luaos_metrics_affinity(cpus.data(), cpus.size());
+  return true;
+}
+
+#define wait_default_spin_us 50
+
+typedef struct {
+  size_t timeout;   /* milliseconds, -1 means forever */
+  size_t spin_us;   /* busy poll window, 0 means block */
+} wait_options;
+
+static void check_wait_options(lua_State* L, wait_options& opts)
+{
+  opts.timeout = -1;
+  opts.spin_us = 0;
+  if (!lua_istable(L, 1)) {
+    if (!lua_isnoneornil(L, 1)) {
+      opts.timeout = (size_t)luaL_checkinteger(L, 1);
+    }
+    return;
+  }
+  if (lua_getfield(L, 1, "timeout") != LUA_TNIL) {
+    luaL_argcheck(L, lua_isinteger(L, -1), 1, "timeout must be an integer");
+    opts.timeout = (size_t)lua_tointeger(L, -1);
+  }
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, 1, "mode") != LUA_TNIL)
+  {
+    const char* mode = lua_tostring(L, -1);
+    if (mode && strcmp(mode, "spin") == 0) {
+      opts.spin_us = wait_default_spin_us;
+    }
+    else if (!mode || strcmp(mode, "block") != 0) {
+      luaL_argerror(L, 1, "mode must be 'block' or 'spin'");
+    }
+  }
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, 1, "spin_us") != LUA_TNIL)
+  {
+    luaL_argcheck(L, lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0, 1, "spin_us must be an integer >= 0");
+    if (opts.spin_us) {
+      opts.spin_us = (size_t)lua_tointeger(L, -1);
+    }
+  }
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, 1, "cpu") != LUA_TNIL)
+  {
+    static thread_local std::vector<int> pinned;
+    std::vector<int> cpus;
+    luaL_argcheck(L, check_cpus(L, -1, cpus), 1, "invalid cpu");
+    if (cpus != pinned)
+    {
+      luaL_argcheck(L, bind_cpus(cpus), 1, "failed to set cpu affinity");
+      pinned.swap(cpus);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+/*
+** Busy poll the reactor for spin_us after the last handler ran, then block
+** for the next one. This trades a core for skipping the epoll/eventfd wakeup
+** on latency sensitive jobs.
+*/
+static size_t spin_wait(lua_State* L, io_handler ios, const wait_options& opts)
+{
+  size_t count = 0;
+  size_t begin = os::milliseconds();
+  size_t idle  = os::microseconds();
+  while (!ios->stopped())
+  {
+    size_t n = ios->poll();
+    size_t now = os::microseconds();
+    if (n == 0 && now - idle >= opts.spin_us)
+    {
+      size_t expires = 100;
+      if (opts.timeout < expires) {
+        expires = opts.timeout;
+      }
+      n = ios->run_one_for(std::chrono::milliseconds(expires));
+      now = os::microseconds();
+    }
+    if (n > 0) {
+      idle = now;
+      count += n;
+      update_metrics(L, n);
+    }
+    size_t ms = now / 1000;
+    keep_alive(ms);
+    if (ms - begin > opts.timeout) {
+      break;
+    }
+  }
+  return count;
+}
+
 static int luaos_wait(lua_State* L)
 {
   lua_State* mainL = luaos_local.lua_state();
@@ -1047,10 +1455,9 @@ static int luaos_wait(lua_State* L)
     lua_pop(L, 1);  /* remove userdata from stack */
   }
   size_t count = 0;
-  size_t timeout = -1;
-  if (lua_gettop(L) > 0) {
-    timeout = (size_t)luaL_checkinteger(L, 1);
-  }
+  wait_options opts;
+  check_wait_options(L, opts);
+  size_t timeout = opts.timeout;
   static bool start_ok = false;
   io_handler ios_local = luaos_local.lua_service();
   if (start_ok == false)
@@ -1060,15 +1467,14 @@ static int luaos_wait(lua_State* L)
       luaos_trace("LuaOS started successfully\n");
     }
   }
-  static thread_local size_t last_alive = 0;
-  size_t interval = 10000;
   size_t begin = os::milliseconds();
+  keep_alive(begin);
   if (timeout == 0) {
-    if (begin - last_alive > interval) {
-      keep_alive(L);
-      last_alive = begin;
-    }
     count = ios_local->poll();
+    update_metrics(L, count);
+  }
+  else if (opts.spin_us > 0) {
+    count = spin_wait(L, ios_local, opts);
   }
   else
   {
@@ -1078,12 +1484,11 @@ static int luaos_wait(lua_State* L)
     }
     while (!ios_local->stopped())
     {
-      count += ios_local->run_for(std::chrono::milliseconds(expires));
+      size_t n = ios_local->run_for(std::chrono::milliseconds(expires));
+      update_metrics(L, n);
+      count += n;
       size_t now = os::milliseconds();
-      if (now - last_alive > interval) {
-        keep_alive(L);
-        last_alive = now;
-      }
+      keep_alive(now);
       if (now - begin > timeout) {
         break;
       }
@@ -1127,7 +1532,9 @@ struct luaos_job final {
   }
   int pid;
   int status;
+  int priority = 0;
   std::string name;
+  std::vector<int> cpus;
   io_handler  ios;
   std::shared_ptr<std::thread> thread;
 };
@@ -1249,6 +1656,34 @@ static int os_pid(lua_State* L)
   return 1;
 }
 
+/* "epoll", "iocp", "kqueue"... whichever the reactors run on */
+static int os_backend(lua_State* L)
+{
+  lua_pushstring(L, eth::reactor::backend());
+  return 1;
+}
+
+static int os_affinity(lua_State* L)
+{
+  if (lua_isnoneornil(L, 1))
+  {
+    int cpus[1024];
+    size_t count = os::get_affinity(cpus, sizeof(cpus) / sizeof(cpus[0]));
+    lua_createtable(L, (int)count, 0);
+    for (size_t i = 0; i < count; i++) {
+      lua_pushinteger(L, cpus[i]);
+      lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    return 1;
+  }
+  std::vector<int> cpus;
+  if (!check_cpus(L, 1, cpus)) {
+    luaL_argerror(L, 1, "must be a cpu or an array of cpus");
+  }
+  lua_pushboolean(L, bind_cpus(cpus) ? 1 : 0);
+  return 1;
+}
+
 static int check_utf8(lua_State* L)
 {
   size_t size = 0;
@@ -1384,6 +1819,16 @@ static int local_pthread(lua_State* L)
 
 static int local_thread(luaos_job* job, lua_value_array::value_type argv, io_handler ios)
 {
+  /*
+  ** Placement is applied before the lua state is created, so the
+  ** first touch of its heap already happens on the pinned cpus.
+  */
+  if (!job->cpus.empty() && !bind_cpus(job->cpus)) {
+    luaos_error("failed to set cpu affinity of '%s'\n", job->name.c_str());
+  }
+  if (job->priority && !os::priority(job->priority)) {
+    luaos_error("failed to set priority of '%s'\n", job->name.c_str());
+  }
   lua_State* L = luaos_local.lua_state();
   job->ios = luaos_local.lua_service();
   luaos_local.set_pid(job->pid);
@@ -1442,18 +1887,91 @@ static int load_stop_gc(lua_State* L)
   return 0;
 }
 
+/* only a table marked by os.options holds the start options */
+static bool is_start_options(lua_State* L, int i)
+{
+  if (i < 2 || !lua_istable(L, i)) {
+    return false;
+  }
+  if (!lua_getmetatable(L, i)) {
+    return false;
+  }
+  luaL_getmetatable(L, luaos_options_name);
+  bool marked = lua_rawequal(L, -1, -2) != 0;
+  lua_pop(L, 2);
+  return marked;
+}
+
+static int load_options(lua_State* L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  luaL_setmetatable(L, luaos_options_name);
+  return 1;
+}
+
+static void check_start_options(lua_State* L, int i, std::vector<int>& cpus, int& priority)
+{
+  lua_pushstring(L, "cpu");
+  if (lua_rawget(L, i) != LUA_TNIL) {
+    if (!check_cpus(L, -1, cpus)) {
+      luaL_argerror(L, i, "cpu must be a cpu or an array of cpus");
+    }
+  }
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "priority");
+  if (lua_rawget(L, i) != LUA_TNIL)
+  {
+    static const char* const options[] = { "low", "normal", "high", NULL };
+    const char* name = lua_tostring(L, -1);
+    int index = -1;
+    for (int j = 0; name && options[j]; j++) {
+      if (strcmp(name, options[j]) == 0) {
+        index = j;
+        break;
+      }
+    }
+    if (index < 0) {
+      luaL_argerror(L, i, "priority must be 'low', 'normal' or 'high'");
+    }
+    priority = index - 1;
+  }
+  lua_pop(L, 1);
+}
+
 static int load_execute(lua_State* L)
 {
+  const char* name = luaL_checkstring(L, 1);
+  int argc = lua_gettop(L);
+
+  std::vector<int> cpus;
+  int priority = 0;
+  if (is_start_options(L, argc)) {
+    check_start_options(L, argc, cpus, priority);
+    argc--;
+  }
   lua_value_array::value_type argv;
-  argv = lua_value_array::create(L, 2, 0);
+  argv = lua_value_array::create(L, 2, argc);
 
+  io_handler ios_wait;
+  try {
+    ios_wait = luaos_ionew();
+  }
+  catch (...) {
+    /* every service id is in use */
+  }
+  if (!ios_wait) {
+    return luaL_error(L, "too many jobs");
+  }
   auto userdata = lexnew_userdata<luaos_job>(L, luaos_job_name);
   luaos_job* newjob = new (userdata) luaos_job();
 
+  newjob->cpus.swap(cpus);
+  newjob->priority = priority;
   newjob->status = LUA_OK;
   newjob->pid    = luaos_local.get_id();
-  newjob->name   = luaL_checkstring(L, 1);
-  io_handler ios_wait = luaos_ionew();
+  newjob->name   = name;
 
   newjob->thread.reset(new std::thread(std::bind(&local_thread, newjob, argv, ios_wait)));
   ios_wait->run();
@@ -1624,13 +2142,26 @@ static int init_luapath(lua_State* L)
 int luaos_close(lua_State* L)
 {
   size_t remainder = 0;
+  std::vector<profile_handler> profiles;
   auto removeL = [&]() {
     std::unique_lock<std::mutex> lock(alive_mutex);
     size_t removed = alive_states.erase(L);
     remainder = alive_states.size();
+    for (auto iter = profile_sessions.begin(); iter != profile_sessions.end();) {
+      if (iter->second->L == L) {
+        profiles.push_back(iter->second);
+        iter = profile_sessions.erase(iter);
+      }
+      else {
+        iter++;
+      }
+    }
     return removed;
   };
   if (removeL()) {
+    for (auto& session : profiles) {
+      session->stop();  /* the timer must not arm a closed state */
+    }
     if (remainder == 0) {
       if (alive_thread && alive_thread->joinable()) {
         alive_exit->poll();
@@ -1731,8 +2262,12 @@ static int luaopen_others(lua_State* L)
   lua_setglobal(L, "require");
 
   rpcall::init_metatable(L);
+  async::init_metatable(L);
   storage::init_metatable(L);
+  frozen::init_metatable(L);
   subscriber::init_metatable(L);
+  queue::init_metatable(L);
+  file::init_metatable(L);
   return 0;
 }
 
@@ -1771,6 +2306,15 @@ static int luaopen_ldebug(lua_State* L)
 static int luaopen_los(lua_State* L)
 {
   lua_getglobal(L, "os");
+  luaL_Reg profile[] = {
+    {"start",         profile_start },
+    {"stop",          profile_stop  },
+    { NULL,           NULL          }
+  };
+  lua_newtable(L);
+  luaL_setfuncs(L, profile, 0);
+  lua_setfield(L, -2, "profile");
+
   luaL_Reg methods[] = {
     {"typename",      os_typename   },
     {"mkdir",         os_mkdir      },
@@ -1778,13 +2322,17 @@ static int luaopen_los(lua_State* L)
     {"chdir",         os_chdir      },
     {"id",            os_id         },
     {"pid",           os_pid        },
+    {"backend",       os_backend    },
+    {"affinity",      os_affinity   },
     {"files",         enum_files    },
     {"snowid",        os_snowid     },
     {"wait",          luaos_wait    },
     {"stopped",       luaos_stopped },
     {"exit",          luaos_exit    },
+    {"watchdog",      luaos_watchdog},
     {"system_clock",  system_clock  },
     {"steady_clock",  steady_clock  },
+    {"stats",         luaos_metrics_stats},
     { NULL,           NULL          }
   };
   luaL_setfuncs(L, methods, 0);
@@ -1833,11 +2381,15 @@ static int luaopen_job(lua_State* L)
   };
   lexnew_metatable(L, luaos_job_name, methods);
   lua_pop(L, 1);
+  luaL_newmetatable(L, luaos_options_name);
+  lua_pop(L, 1);
 
   lua_getglobal(L, "os");
   if (lua_istable(L, -1)) {
     lua_pushcfunction(L, load_execute);
     lua_setfield(L, -2, "start");
+    lua_pushcfunction(L, load_options);
+    lua_setfield(L, -2, "options");
   }
   lua_pop(L, 1);  /* pop os from stack */
   return 0;
@@ -1883,6 +2435,7 @@ int luaos_openlibs(lua_State* L)
   luaL_Reg preload[] = {
     { "msgpack",    luaopen_cmsgpack_safe },
     { "list",       luaopen_list       },
+    { "dispatcher", luaopen_dispatcher },
     { "openssl",    luaopen_openssl    },
     { "rapidjson",  luaopen_rapidjson  },
     { NULL,         NULL               }
@@ -1912,11 +2465,20 @@ lua_State* luaos_newstate(lua_CFunction loader, void* ud)
   lua_gc(L, LUA_GCGEN, 0, 0);
 #endif
 
+  /* states are created by the thread that runs them */
+  alive_local.reset(new alive_slot());
+  alive_local->L = L;
+  alive_local->ios = ((local_values*)ud)->lua_service();  /* findable before the first os.wait */
+  alive_local->heartbeat = os::milliseconds();
+  alive_local->timeout   = alive_default_timeout;
+  alive_local->interrupt = true;
+  alive_local->stalled   = false;
+
   std::unique_lock<std::mutex> lock(alive_mutex);
-  alive_states[L] = os::milliseconds();
+  alive_states[L] = alive_local;
   if (!alive_thread) {
     alive_exit->restart();
-    alive_thread.reset(new std::thread(std::bind(check_thread, 600000)));
+    alive_thread.reset(new std::thread(check_thread));
   }
   return L;
 }
@@ -25,6 +25,7 @@
 #define luaos_fmain         "main"
 #define luaos_waiting_name  "luaos_starting"
 #define luaos_job_name      "luaos_job"
+#define luaos_options_name  "luaos_options"
 #define luaos_timer_name    "luaos_timer"
 
 /***********************************************************************************/
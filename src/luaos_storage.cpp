@@ -13,76 +13,387 @@
 ** 
 ********************************************************************************/
 
-#include <map>
-#include <mutex>
+#include <unordered_map>
+#include <queue>
+#include <vector>
+#include <memory>
+#include <socket/mutex.h>
 #include "luaos_storage.h"
 
-static std::recursive_mutex _mutex;
-static std::map<std::string, lua_value> _storage;
+#define max_shard_count 32
+
+typedef std::shared_ptr<lua_value> value_type;
+
+typedef struct {
+  value_type value;
+  size_t expires;
+} storage_node;
+
+typedef std::pair<size_t, std::string> expiry_entry;
+typedef std::priority_queue<expiry_entry, std::vector<expiry_entry>, std::greater<expiry_entry>> expiry_heap;
+
+/*
+** Deadlines sit in a min heap next to the items, so the watchdog only
+** touches keys which are due. A key's entry is never later than its
+** deadline: a later deadline keeps the old entry, which is pushed again
+** when it comes due, entries of erased keys are dropped at the top.
+*/
+typedef struct {
+  atomic_rwlock mutex;
+  std::unordered_map<std::string, storage_node> items;
+  expiry_heap expiry;
+} storage_shard;
+
+static storage_shard _shards[max_shard_count];
+
+/*******************************************************************************/
+
+static storage_shard& get_shard(const std::string& key)
+{
+  return _shards[std::hash<std::string>()(key) % max_shard_count];
+}
+
+static bool is_expired(const storage_node& node, size_t now)
+{
+  return node.expires && now >= node.expires;
+}
+
+/* with the shard locked exclusively */
+static void set_expires(storage_shard& shard, const std::string& key, storage_node& node, size_t expires)
+{
+  size_t current = node.expires;
+  node.expires = expires;
+  if (!expires || (current && current <= expires)) {
+    return;
+  }
+  shard.expiry.push(expiry_entry(expires, key));
+  if (shard.expiry.size() <= 2 * shard.items.size() + 1024) {
+    return;
+  }
+  /* keys which keep getting new deadlines leave stale entries behind */
+  expiry_heap fresh;
+  for (auto iter = shard.items.begin(); iter != shard.items.end(); ++iter) {
+    if (iter->second.expires) {
+      fresh.push(expiry_entry(iter->second.expires, iter->first));
+    }
+  }
+  shard.expiry.swap(fresh);
+}
+
+static size_t check_expires(lua_State* L, int i)
+{
+  lua_Integer ttl = luaL_optinteger(L, i, 0);
+  luaL_argcheck(L, ttl >= 0, i, "ttl must be >= 0");
+  return ttl ? os::milliseconds() + (size_t)ttl : 0;
+}
+
+static std::string check_key(lua_State* L, int i)
+{
+  size_t size = 0;
+  const char* key = luaL_checklstring(L, i, &size);
+  return std::string(key, size);
+}
+
+/* read the live value of key, nullptr if missing or expired */
+static value_type find_value(storage_shard& shard, const std::string& key)
+{
+  shared_unique_lock<atomic_rwlock> lock(shard.mutex);
+  auto iter = shard.items.find(key);
+  if (iter == shard.items.end()) {
+    return value_type();
+  }
+  if (is_expired(iter->second, os::milliseconds())) {
+    return value_type();
+  }
+  return iter->second.value;
+}
+
+static void push_value(lua_State* L, const value_type& value)
+{
+  if (value) {
+    value->push(L);
+  }
+  else {
+    lua_pushnil(L);
+  }
+}
+
+static bool is_number(const lua_value& v)
+{
+  return v.type() == lua_ctype::integer || v.type() == lua_ctype::number;
+}
+
+static lua_Number to_number(const lua_value& v)
+{
+  if (v.type() == lua_ctype::integer) {
+    return (lua_Number)(lua_Integer)v;
+  }
+  return (lua_Number)v;
+}
+
+static bool is_equal(const lua_value& a, const lua_value& b)
+{
+  if (is_number(a) && is_number(b))
+  {
+    if (a.type() == lua_ctype::integer && b.type() == lua_ctype::integer) {
+      return (lua_Integer)a == (lua_Integer)b;
+    }
+    return to_number(a) == to_number(b);
+  }
+  if (a.type() != b.type()) {
+    return false;
+  }
+  switch (a.type()) {
+  case lua_ctype::nil:
+    return true;
+  case lua_ctype::boolean:
+    return (bool)a == (bool)b;
+  case lua_ctype::string:
+    return a.operator std::string() == b.operator std::string();
+  default:
+    return false;
+  }
+}
 
 /*******************************************************************************/
 
 static int lua_storage_set(lua_State* L)
 {
-  lua_value old_value;
-  std::string key = luaL_checkstring(L, 1);
-  lua_value new_value = lua_value(L, 2);
+  std::string key = check_key(L, 1);
+  int handler = lua_isfunction(L, 3) ? 3 : 0;
+  size_t expires = check_expires(L, handler ? 4 : 3);
+
+  lua_value new_value(L, 2);
+  storage_shard& shard = get_shard(key);
 
-  std::unique_lock<std::recursive_mutex> lock(_mutex);
-  auto iter = _storage.find(key);
-  if (iter != _storage.end()) {
-    old_value = iter->second;
+  /*
+  ** The merge handler runs without any lock held, the result is
+  ** only committed if nobody changed the key in the meantime.
+  */
+  for (;;)
+  {
+    value_type old_value;
+    value_type set_value;
+    if (!handler) {
+      set_value = std::make_shared<lua_value>(new_value);
+    }
+    else {
+      old_value = find_value(shard, key);
+      lua_pushvalue(L, handler);
+      new_value.push(L);
+      push_value(L, old_value);
+      if (luaos_pcall(L, 2, 1) != LUA_OK) {
+        luaos_error("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1); /* pop error from stack */
+        return 0;
+      }
+      set_value = std::make_shared<lua_value>(L, -1);
+      lua_pop(L, 1);
+    }
+    {
+      std::unique_lock<atomic_rwlock> lock(shard.mutex);
+      auto iter = shard.items.find(key);
+      value_type current;
+      if (iter != shard.items.end() && !is_expired(iter->second, os::milliseconds())) {
+        current = iter->second.value;
+      }
+      if (handler && current != old_value) {
+        continue;
+      }
+      old_value = current;
+      if (!set_value->has_value()) {
+        if (iter != shard.items.end()) {
+          shard.items.erase(iter);
+        }
+      }
+      else {
+        storage_node& node = shard.items[key];
+        node.value = set_value;
+        set_expires(shard, key, node, expires);
+      }
+    }
+    push_value(L, old_value);
+    return 1;
   }
-  if (lua_isfunction(L, 3))
+}
+
+static int lua_storage_get(lua_State* L)
+{
+  std::string key = check_key(L, 1);
+  push_value(L, find_value(get_shard(key), key));
+  return 1;
+}
+
+static int lua_storage_incr(lua_State* L)
+{
+  std::string key = check_key(L, 1);
+  luaL_checktype(L, 2, LUA_TNUMBER);
+  lua_value delta(L, 2);
+  value_type result;
   {
-    new_value.push(L);
-    old_value.push(L);
-    if (luaos_pcall(L, 2, 1) != LUA_OK) {
-      luaos_error("%s\n", lua_tostring(L, -1));
-      lua_pop(L, 1); /* pop error from stack */
-      return 0;
+    storage_shard& shard = get_shard(key);
+    std::unique_lock<atomic_rwlock> lock(shard.mutex);
+    storage_node& node = shard.items[key];
+    if (!node.value || is_expired(node, os::milliseconds())) {
+      node.value.reset();
+      node.expires = 0;
+    }
+    if (!node.value) {
+      result = std::make_shared<lua_value>(delta);
+    }
+    else if (!is_number(*node.value)) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "value of '%s' is not a number", key.c_str());
+      return 2;
     }
-    new_value = lua_value(L, -1);
+    else if (node.value->type() == lua_ctype::integer && delta.type() == lua_ctype::integer) {
+      /* wraps around like lua integers instead of overflowing */
+      lua_Unsigned sum = (lua_Unsigned)(lua_Integer)*node.value + (lua_Unsigned)(lua_Integer)delta;
+      result = std::make_shared<lua_value>((lua_Integer)sum);
+    }
+    else {
+      result = std::make_shared<lua_value>(to_number(*node.value) + to_number(delta));
+    }
+    node.value = result;
   }
-  _storage[key] = new_value;
-  old_value.push(L);
+  result->push(L);
   return 1;
 }
 
-static int lua_storage_get(lua_State* L)
+static int lua_storage_append(lua_State* L)
 {
-  std::string key = luaL_checkstring(L, 1);
-  std::unique_lock<std::recursive_mutex> lock(_mutex);
+  std::string key = check_key(L, 1);
+  size_t size = 0;
+  const char* data = luaL_checklstring(L, 2, &size);
+  size_t length = 0;
+  {
+    storage_shard& shard = get_shard(key);
+    std::unique_lock<atomic_rwlock> lock(shard.mutex);
+    storage_node& node = shard.items[key];
+    if (!node.value || is_expired(node, os::milliseconds())) {
+      node.value.reset();
+      node.expires = 0;
+    }
+    std::string value;
+    if (node.value)
+    {
+      if (node.value->type() != lua_ctype::string) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "value of '%s' is not a string", key.c_str());
+        return 2;
+      }
+      value = node.value->operator std::string();
+    }
+    value.append(data, size);
+    length = value.size();
+    node.value = std::make_shared<lua_value>(value);
+  }
+  lua_pushinteger(L, (lua_Integer)length);
+  return 1;
+}
 
-  auto iter = _storage.find(key);
-  if (iter == _storage.end()) {
+static int lua_storage_cas(lua_State* L)
+{
+  std::string key = check_key(L, 1);
+  int type = lua_type(L, 2);
+  luaL_argcheck(L, type != LUA_TTABLE && type != LUA_TFUNCTION, 2, "must be a scalar value");
+
+  lua_value expected(L, 2);
+  value_type set_value = std::make_shared<lua_value>(L, 3);
+  value_type current;
+  bool swapped = false;
+  {
+    storage_shard& shard = get_shard(key);
+    std::unique_lock<atomic_rwlock> lock(shard.mutex);
+    auto iter = shard.items.find(key);
+    if (iter != shard.items.end() && !is_expired(iter->second, os::milliseconds())) {
+      current = iter->second.value;
+    }
+    swapped = is_equal(current ? *current : lua_value(), expected);
+    if (swapped)
+    {
+      if (!set_value->has_value()) {
+        if (iter != shard.items.end()) {
+          shard.items.erase(iter);
+        }
+      }
+      else {
+        storage_node& node = shard.items[key];
+        if (!current) {
+          node.expires = 0;
+        }
+        node.value = set_value;
+      }
+    }
+  }
+  lua_pushboolean(L, swapped ? 1 : 0);
+  push_value(L, swapped ? set_value : current);
+  return 2;
+}
+
+static int lua_storage_expire(lua_State* L)
+{
+  std::string key = check_key(L, 1);
+  size_t expires = check_expires(L, 2);
+
+  storage_shard& shard = get_shard(key);
+  std::unique_lock<atomic_rwlock> lock(shard.mutex);
+  auto iter = shard.items.find(key);
+  if (iter == shard.items.end() || is_expired(iter->second, os::milliseconds())) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  set_expires(shard, key, iter->second, expires);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lua_storage_ttl(lua_State* L)
+{
+  std::string key = check_key(L, 1);
+  size_t now = os::milliseconds();
+
+  storage_shard& shard = get_shard(key);
+  shared_unique_lock<atomic_rwlock> lock(shard.mutex);
+  auto iter = shard.items.find(key);
+  if (iter == shard.items.end() || is_expired(iter->second, now)) {
     lua_pushnil(L);
     return 1;
   }
-  iter->second.push(L);
+  size_t expires = iter->second.expires;
+  lua_pushinteger(L, expires ? (lua_Integer)(expires - now) : -1);
   return 1;
 }
 
 static int lua_storage_erase(lua_State* L)
 {
-  std::string key = luaL_checkstring(L, 1);
-  std::unique_lock<std::recursive_mutex> lock(_mutex);
-
-  lua_value value;
-  auto iter = _storage.find(key);
-  if (iter != _storage.end())
+  std::string key = check_key(L, 1);
+  value_type value;
   {
-    value = iter->second;
-    _storage.erase(iter);
+    storage_shard& shard = get_shard(key);
+    std::unique_lock<atomic_rwlock> lock(shard.mutex);
+    auto iter = shard.items.find(key);
+    if (iter != shard.items.end())
+    {
+      if (!is_expired(iter->second, os::milliseconds())) {
+        value = iter->second.value;
+      }
+      shard.items.erase(iter);
+    }
   }
-  value.push(L);
+  push_value(L, value);
   return 1;
 }
 
 static int lua_storage_clear(lua_State* L)
 {
-  std::unique_lock<std::recursive_mutex> lock(_mutex);
-  _storage.clear();
+  (void)L;  /* not used */
+  for (size_t i = 0; i < max_shard_count; i++)
+  {
+    std::unique_lock<atomic_rwlock> lock(_shards[i].mutex);
+    _shards[i].items.clear();
+    expiry_heap().swap(_shards[i].expiry);
+  }
   return 0;
 }
 
@@ -90,13 +401,48 @@ static int lua_storage_clear(lua_State* L)
 
 namespace storage
 {
+  void expire_check(size_t now)
+  {
+    for (size_t i = 0; i < max_shard_count; i++)
+    {
+      storage_shard& shard = _shards[i];
+      {
+        shared_unique_lock<atomic_rwlock> lock(shard.mutex);
+        if (shard.expiry.empty() || shard.expiry.top().first > now) {
+          continue;
+        }
+      }
+      std::unique_lock<atomic_rwlock> lock(shard.mutex);
+      while (!shard.expiry.empty() && shard.expiry.top().first <= now)
+      {
+        std::string key = shard.expiry.top().second; /* the heap owns it until pop */
+        shard.expiry.pop();
+        auto iter = shard.items.find(key);
+        if (iter == shard.items.end() || !iter->second.expires) {
+          continue;
+        }
+        if (is_expired(iter->second, now)) {
+          shard.items.erase(iter);
+        }
+        else {
+          shard.expiry.push(expiry_entry(iter->second.expires, std::move(key)));
+        }
+      }
+    }
+  }
+
   void init_metatable(lua_State* L)
   {
     struct luaL_Reg methods[] = {
-      { "set",      lua_storage_set   },
-      { "get",      lua_storage_get   },
-      { "erase",    lua_storage_erase },
-      { "clear",    lua_storage_clear },
+      { "set",      lua_storage_set    },
+      { "get",      lua_storage_get    },
+      { "incr",     lua_storage_incr   },
+      { "append",   lua_storage_append },
+      { "cas",      lua_storage_cas    },
+      { "expire",   lua_storage_expire },
+      { "ttl",      lua_storage_ttl    },
+      { "erase",    lua_storage_erase  },
+      { "clear",    lua_storage_clear  },
       { NULL,       NULL },
     };
     lua_newtable(L);
@@ -19,6 +19,7 @@
 
 namespace storage
 {
+  void expire_check(size_t now);
   void init_metatable(lua_State* L);
 }
 
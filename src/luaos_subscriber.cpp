@@ -15,6 +15,7 @@
 
 #include <map>
 #include "luaos.h"
+#include "luaos_metrics.h"
 
 typedef struct {
   int index;
@@ -30,11 +31,14 @@ static topic_array _watchs;
 
 /*******************************************************************************/
 
-static void on_publish(size_t publisher, size_t mask, int index, lua_value_array::value_type params)
+static void on_publish(lua_Unsigned publisher, size_t mask, int index, lua_value_array::value_type params, size_t posted)
 {
   lua_State* L = luaos_local.lua_state();
   stack_rollback rollback(L);
 
+  luaos_metrics_count(metrics_counter::publish_recv);
+  luaos_metrics_record(metrics_histogram::publish_latency, os::microseconds() - posted);
+
   lua_rawgeti(L, LUA_REGISTRYINDEX, index);
   lua_pushinteger(L, (lua_Integer)publisher);
   lua_pushinteger(L, (lua_Integer)mask);
@@ -242,12 +246,12 @@ static int lua_os_publish(lua_State* L)
   }
 
   size_t mask = luaL_checkinteger(L, 2);
-  size_t receiver = luaL_checkinteger(L, 3);
+  lua_Unsigned receiver = (lua_Unsigned)luaL_checkinteger(L, 3);
 
   lua_value_array::value_type params;
   params = lua_value_array::create(L, 4, argc);
 
-  size_t highbits = receiver >> 16;
+  lua_Unsigned highbits = receiver >> 16; /* route beyond the job field, kept as is */
   receiver = receiver & 0xffff;
 
   auto this_ios = luaos_local.lua_service();
@@ -281,7 +285,7 @@ static int lua_os_publish(lua_State* L)
     return 1;
   }
 
-  size_t publisher = self_id;
+  lua_Unsigned publisher = self_id;
   publisher = (highbits << 16) | publisher;
 
   if (mask > 0)
@@ -291,12 +295,14 @@ static int lua_os_publish(lua_State* L)
       i++;
     }
     int index = items[i].index;
-    items[i].ios->post(std::bind(&on_publish, publisher, mask, index, params));
+    items[i].ios->post(std::bind(&on_publish, publisher, mask, index, params, os::microseconds()));
+    luaos_metrics_count(metrics_counter::publish_sent);
     lua_pushinteger(L, 1);
     return 1;
   }
 
   size_t total = 0;
+  size_t posted = os::microseconds();
   auto item = items.begin();
   for (; item != items.end(); ++item)
   {
@@ -309,12 +315,13 @@ static int lua_os_publish(lua_State* L)
       continue;
     }
     total++;
-    item->ios->post(std::bind(&on_publish, publisher, mask, item->index, params));
+    item->ios->post(std::bind(&on_publish, publisher, mask, item->index, params, posted));
     if (receiver > 0) {
       break;
     }
   }
 
+  luaos_metrics_count(metrics_counter::publish_sent, total);
   lua_pushinteger(L, (lua_Integer)total);
   return 1;
 }
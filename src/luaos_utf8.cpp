@@ -0,0 +1,328 @@
+
+/************************************************************************************
+**
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+**
+************************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include <conv.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+# define UTF8_SIMD_X86
+# include <immintrin.h>
+# ifdef _MSC_VER
+#   include <intrin.h>
+#   define UTF8_TARGET(x)
+# else
+#   define UTF8_TARGET(x) __attribute__((target(x)))
+# endif
+#endif
+
+/***********************************************************************************/
+
+/* strict RFC 3629: no overlong forms, no surrogates, nothing above U+10FFFF */
+static bool utf8_scalar(const unsigned char* s, size_t n)
+{
+  size_t i = 0;
+  while (i < n)
+  {
+    /* skip ascii 8 bytes at a time */
+    while (i + 8 <= n)
+    {
+      uint64_t word;
+      memcpy(&word, s + i, sizeof(word));
+      if (word & 0x8080808080808080ull) {
+        break;
+      }
+      i += 8;
+    }
+    if (i == n) {
+      break;
+    }
+    unsigned char c = s[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    size_t len = 0;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+      len = 2;
+    }
+    else if (c >= 0xe0 && c <= 0xef) {
+      len = 3;
+      if (c == 0xe0) lo = 0xa0;
+      if (c == 0xed) hi = 0x9f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4) {
+      len = 4;
+      if (c == 0xf0) lo = 0x90;
+      if (c == 0xf4) hi = 0x8f;
+    }
+    else {
+      return false;
+    }
+    if (n - i < len) {
+      return false;
+    }
+    if (s[i + 1] < lo || s[i + 1] > hi) {
+      return false;
+    }
+    for (size_t j = 2; j < len; j++) {
+      if ((s[i + j] & 0xc0) != 0x80) {
+        return false;
+      }
+    }
+    i += len;
+  }
+  return true;
+}
+
+/***********************************************************************************/
+
+#ifdef UTF8_SIMD_X86
+
+/*
+** Lookup validation (Keiser & Lemire, "Validating UTF-8 in less than one
+** instruction per byte"): the high and low nibble of each byte and the high
+** nibble of the next one index three 16 entry tables, the AND of the results
+** is non zero for every invalid two byte pair. 3 and 4 byte sequences are
+** checked by comparing where continuations must be with where they are.
+*/
+#define TOO_SHORT   (1 << 0)  /* 11______ 0_______ or 11______ 11______ */
+#define TOO_LONG    (1 << 1)  /* 0_______ 10______ */
+#define OVERLONG_3  (1 << 2)  /* 11100000 100_____ */
+#define TOO_LARGE   (1 << 3)  /* 11110100 1001____ and above */
+#define SURROGATE   (1 << 4)  /* 11101101 101_____ */
+#define OVERLONG_2  (1 << 5)  /* 1100000_ 10______ */
+#define TOO_LARGE_1000 (1 << 6) /* 11110101 1000____ and above */
+#define OVERLONG_4  (1 << 6)  /* 11110000 1000____ */
+#define TWO_CONTS   (1 << 7)  /* 10______ 10______ */
+#define CARRY       (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+  TOO_SHORT | OVERLONG_2, \
+  TOO_SHORT, \
+  TOO_SHORT | OVERLONG_3 | SURROGATE, \
+  TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+  CARRY | OVERLONG_2, \
+  CARRY, \
+  CARRY, \
+  CARRY | TOO_LARGE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+static const uint8_t byte_1_high[16] = { BYTE_1_HIGH };
+static const uint8_t byte_1_low [16] = { BYTE_1_LOW  };
+static const uint8_t byte_2_high[16] = { BYTE_2_HIGH };
+
+/* the last 3 bytes of a block must not start a sequence longer than what is left */
+static const uint8_t incomplete_max[32] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+};
+
+/***********************************************************************************/
+
+struct utf8_sse_state {
+  __m128i prev, incomplete, error;
+};
+
+UTF8_TARGET("ssse3")
+static inline void utf8_sse_step(utf8_sse_state& st, __m128i in)
+{
+  if (_mm_movemask_epi8(in) == 0) {
+    st.error = _mm_or_si128(st.error, st.incomplete);
+    st.incomplete = _mm_setzero_si128();
+    st.prev = in;
+    return;
+  }
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i tbl1 = _mm_loadu_si128((const __m128i*)byte_1_high);
+  const __m128i tbl2 = _mm_loadu_si128((const __m128i*)byte_1_low);
+  const __m128i tbl3 = _mm_loadu_si128((const __m128i*)byte_2_high);
+
+  __m128i prev1 = _mm_alignr_epi8(in, st.prev, 15);
+  __m128i b1h = _mm_shuffle_epi8(tbl1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  __m128i b1l = _mm_shuffle_epi8(tbl2, _mm_and_si128(prev1, nibble));
+  __m128i b2h = _mm_shuffle_epi8(tbl3, _mm_and_si128(_mm_srli_epi16(in, 4), nibble));
+  __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+  __m128i prev2 = _mm_alignr_epi8(in, st.prev, 14);
+  __m128i prev3 = _mm_alignr_epi8(in, st.prev, 13);
+  __m128i third  = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+  __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+  __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+  st.error = _mm_or_si128(st.error, _mm_xor_si128(must23, special));
+  st.incomplete = _mm_subs_epu8(in, _mm_loadu_si128((const __m128i*)(incomplete_max + 16)));
+  st.prev = in;
+}
+
+UTF8_TARGET("ssse3")
+static bool utf8_ssse3(const unsigned char* s, size_t n)
+{
+  utf8_sse_state st;
+  st.prev = st.incomplete = st.error = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    utf8_sse_step(st, _mm_loadu_si128((const __m128i*)(s + i)));
+    /* give up on invalid input once per kilobyte instead of at the end */
+    if ((i & 1023) == 1008 && _mm_movemask_epi8(_mm_cmpeq_epi8(st.error, _mm_setzero_si128())) != 0xffff) {
+      return false;
+    }
+  }
+  if (i < n) {
+    unsigned char tail[16] = { 0 };
+    memcpy(tail, s + i, n - i);
+    utf8_sse_step(st, _mm_loadu_si128((const __m128i*)tail));
+  }
+  __m128i error = _mm_or_si128(st.error, st.incomplete);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+
+/***********************************************************************************/
+
+struct utf8_avx_state {
+  __m256i prev, incomplete, error;
+};
+
+UTF8_TARGET("avx2")
+static inline void utf8_avx_step(utf8_avx_state& st, __m256i in)
+{
+  if (_mm256_movemask_epi8(in) == 0) {
+    st.error = _mm256_or_si256(st.error, st.incomplete);
+    st.incomplete = _mm256_setzero_si256();
+    st.prev = in;
+    return;
+  }
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i tbl1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte_1_high));
+  const __m256i tbl2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte_1_low));
+  const __m256i tbl3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)byte_2_high));
+
+  /* bytes shifted in from the previous block, across the 128 bit lanes */
+  __m256i carry = _mm256_permute2x128_si256(st.prev, in, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(in, carry, 15);
+  __m256i b1h = _mm256_shuffle_epi8(tbl1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+  __m256i b1l = _mm256_shuffle_epi8(tbl2, _mm256_and_si256(prev1, nibble));
+  __m256i b2h = _mm256_shuffle_epi8(tbl3, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+  __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+  __m256i prev2 = _mm256_alignr_epi8(in, carry, 14);
+  __m256i prev3 = _mm256_alignr_epi8(in, carry, 13);
+  __m256i third  = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+  __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+  __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+  st.error = _mm256_or_si256(st.error, _mm256_xor_si256(must23, special));
+  st.incomplete = _mm256_subs_epu8(in, _mm256_loadu_si256((const __m256i*)incomplete_max));
+  st.prev = in;
+}
+
+UTF8_TARGET("avx2")
+static bool utf8_avx2(const unsigned char* s, size_t n)
+{
+  utf8_avx_state st;
+  st.prev = st.incomplete = st.error = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    utf8_avx_step(st, _mm256_loadu_si256((const __m256i*)(s + i)));
+    if ((i & 1023) == 992 && !_mm256_testz_si256(st.error, st.error)) {
+      return false;
+    }
+  }
+  if (i < n) {
+    unsigned char tail[32] = { 0 };
+    memcpy(tail, s + i, n - i);
+    utf8_avx_step(st, _mm256_loadu_si256((const __m256i*)tail));
+  }
+  __m256i error = _mm256_or_si256(st.error, st.incomplete);
+  return _mm256_testz_si256(error, error) != 0;
+}
+
+/***********************************************************************************/
+
+typedef bool (*utf8_validator)(const unsigned char*, size_t);
+
+static utf8_validator select_validator()
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  int count = info[0];
+  __cpuid(info, 1);
+  bool ssse3 = (info[2] & (1 << 9)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx2 = false;
+  if (count >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  bool ssse3 = __builtin_cpu_supports("ssse3") != 0;
+  bool avx2  = __builtin_cpu_supports("avx2")  != 0;
+#endif
+  if (avx2) {
+    return utf8_avx2;
+  }
+  if (ssse3) {
+    return utf8_ssse3;
+  }
+  return utf8_scalar;
+}
+
+#endif
+
+/***********************************************************************************/
+
+bool utf8_validate(const char* data, size_t size)
+{
+#ifdef UTF8_SIMD_X86
+  static const utf8_validator validate = select_validator();
+  return validate((const unsigned char*)data, size);
+#else
+  return utf8_scalar((const unsigned char*)data, size);
+#endif
+}
+
+/***********************************************************************************/
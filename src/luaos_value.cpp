@@ -17,19 +17,15 @@ int lua_packany(lua_State* L, int index, int count, std::string& out)
   if (index < 0) {
     index = lua_gettop(L) + index + 1;
   }
-  lua_pushcfunction(L, pack_any);
+  lua_pushcfunction(L, pack_string);
+  lua_pushlightuserdata(L, &out);
   for (int i = index; i < index + count; i++) {
     lua_pushvalue(L, i);
   }
-  int status = luaos_pcall(L, count, 1);
+  int status = luaos_pcall(L, count + 1, 0);
   if (status != LUA_OK) {
     lua_pop(L, 1);  /* pop error from stack */
-    return status;
   }
-  size_t size = 0;
-  const char* data = luaL_checklstring(L, -1, &size);
-  out.assign(data, size);
-  lua_pop(L, 1);
   return status;
 }
 
@@ -428,6 +428,9 @@ public:
     _values.push_back(v);
   }
   inline void append(lua_State* L, int begin, int end) {
+    if (end == 0) {
+      end = lua_gettop(L);
+    }
     for (int i = begin; i <= end; i++) {
       _values.push_back(lua_value(L, i));
     }
@@ -0,0 +1,91 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Lateness of a 1 ms probe timer while the same job hashes 1 MB every
+---10 ms (100 MB/s), once inline on the job thread and once through
+---os.async. An idle run gives the floor of the timer itself.
+---    luaos tools.bench.async -a [seconds=3] [chunk_kb=1024] [interval=10]
+
+local luaos   = require("luaos");
+local bench   = require("common");
+local openssl = require("openssl");
+
+----------------------------------------------------------------------------
+
+---call handler every interval ms until it returns false, the handler gets
+---how many ms the timer fired after its deadline
+local function every(interval, handler)
+    local expect = luaos.steady_clock() + interval;
+    local function on_timer()
+        local now = luaos.steady_clock();
+        if handler(now - expect) then
+            expect = expect + interval;
+            luaos.scheme(math.max(expect - now, 0), on_timer);
+        end
+    end
+    luaos.scheme(interval, on_timer);
+end
+
+local function run(mode, seconds, chunk, interval)
+    local late   = bench.samples();
+    local hashed = 0;
+    local stop   = false;
+    
+    local function on_hashed(ok, digest)
+        if ok then
+            hashed = hashed + #chunk;
+        end
+    end
+    
+    every(1, function(ms)
+        late:add(ms);
+        return not stop;
+    end);
+    every(interval, function()
+        if mode == "inline" then
+            on_hashed(true, openssl.hash.sha256(chunk));
+        elseif mode == "async" then
+            luaos.async("openssl.hash.sha256", chunk, on_hashed);
+        end
+        return not stop;
+    end);
+    
+    local begin = luaos.steady_clock();
+    while luaos.steady_clock() - begin < seconds * 1000 do
+        luaos.wait(10);
+    end
+    stop = true;
+    --let the last async hashes come back before counting
+    luaos.wait(100);
+    
+    bench.report("async", "mode", mode, "probes", #late,
+        "late_p50_ms", late:percentile(50), "late_p99_ms", late:percentile(99),
+        "late_max_ms", late:percentile(100), "mb_per_sec", hashed / 1048.576 / (seconds * 1000)
+    );
+end
+
+function main(seconds, chunk_kb, interval)
+    seconds  = tonumber(seconds)  or 3;
+    chunk_kb = tonumber(chunk_kb) or 1024;
+    interval = tonumber(interval) or 10;
+    local chunk = string.rep("0123456789abcdef", chunk_kb * 64);
+    for _, mode in ipairs({"idle", "inline", "async"}) do
+        run(mode, seconds, chunk, interval);
+    end
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,140 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---A large generated response from an nginx script, buffered whole with
+---headers:write and streamed with headers:write_chunk and on_drain, both
+---plain and gzip. Reports time to the first byte, total time, bytes on the
+---wire and the peak resident memory of the process so far, so the streamed
+---runs go first. Builds without write_chunk measure the buffered mode only.
+---    luaos tools.bench.chunked -a [mb=64] [chunk_kb=16] [port=7750]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local root <const> = "/tmp/luaos-bench-chunked";
+
+----------------------------------------------------------------------------
+
+local script = {};
+
+function script.on_request(request, headers, params)
+    local count = tonumber(params.count);
+    local row   = string.rep("2023-01-01,luaos,chunked,12345,67.89\n", tonumber(params.size) // 37);
+    if params.mode == "buffered" then
+        for i = 1, count do
+            headers:write(row);
+        end
+        headers:finish();
+        return;
+    end
+    local sent = 0;
+    local function pump()
+        while sent < count do
+            sent = sent + 1;
+            if not headers:write_chunk(row) then
+                headers:on_drain(pump);
+                return;
+            end
+        end
+        headers:finish();
+    end
+    pump();
+end
+
+local function server(port)
+    --httpd requires scripts by module name under the web root
+    package.preload[string.gsub(root, "/", ".") .. ".stream"] = function()
+        return script;
+    end
+    local nginx = assert(luaos.nginx.start("127.0.0.1", port, root));
+    luaos.global.set("bench.chunked.ready", 1);
+    while not luaos.stopped() do
+        luaos.wait();
+    end
+    nginx:stop();
+end
+
+local function peak_rss_mb()
+    local file = io.open("/proc/self/status");
+    if not file then
+        return 0;
+    end
+    local status = file:read("a");
+    file:close();
+    return (tonumber(status:match("VmHWM:%s*(%d+)")) or 0) // 1024;
+end
+
+local function fetch(port, mode, gzip, count, size)
+    local peer = luaos.socket("tcp");
+    assert(peer:connect("127.0.0.1", port, 5000));
+    local request = string.format(
+        "GET /stream?mode=%s&count=%d&size=%d HTTP/1.1\r\nHost: 127.0.0.1\r\n%sConnection: close\r\n\r\n",
+        mode, count, size, gzip and "Accept-Encoding: gzip\r\n" or ""
+    );
+    local begin = luaos.steady_clock();
+    local first, bytes, done = nil, 0, false;
+    peer:select(luaos.read, function(ec, data)
+        if ec ~= 0 then
+            done = true;
+            return;
+        end
+        first = first or luaos.steady_clock() - begin;
+        bytes = bytes + #data;
+    end);
+    peer:send(request);
+    while not done and not luaos.stopped() do
+        luaos.wait(1);
+    end
+    peer:close();
+    return first or 0, math.max(luaos.steady_clock() - begin, 1), bytes;
+end
+
+function main(mb, chunk_kb, port)
+    if mb == "server" then
+        server(tonumber(chunk_kb));
+        return;
+    end
+    mb       = tonumber(mb) or 64;
+    chunk_kb = tonumber(chunk_kb) or 16;
+    port     = tonumber(port) or 7750;
+
+    local size  = chunk_kb * 1024;
+    local count = mb * 1048576 // size;
+    luaos.global.set("bench.chunked.ready", 0);
+    local job = luaos.start("chunked", "server", port);
+    while luaos.global.get("bench.chunked.ready") == 0 do
+        luaos.wait(1);
+    end
+
+    local modes = {"buffered"};
+    if string.find(io.open(package.searchpath("luaos.nginx.httpd", package.path)):read("a"), "write_chunk", 1, true) then
+        table.insert(modes, 1, "chunked");
+    end
+    for _, mode in ipairs(modes) do
+        for _, gzip in ipairs({false, true}) do
+            local first, elapsed, bytes = fetch(port, mode, gzip, count, size);
+            bench.report("chunked", "mode", mode, "gzip", gzip, "mb", mb,
+                "first_byte_ms", first, "ms", elapsed, "wire_kb", bytes // 1024,
+                "peak_rss_mb", peak_rss_mb()
+            );
+        end
+    end
+    job:stop();
+    luaos.global.erase("bench.chunked.ready");
+end
+
+----------------------------------------------------------------------------
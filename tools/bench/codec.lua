@@ -0,0 +1,69 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---eth frame codec throughput for every frame hash, without encryption or
+---compression so the hash is the only variable. Frames are encoded by one
+---socket object and decoded by another, nothing goes over the network.
+---    luaos tools.bench.codec -a [mb=256]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function run(hash, size, total)
+    local data  = string.rep("x", size);
+    local count = math.max(total // size, 1);
+    local encoder, decoder = luaos.socket("tcp"), luaos.socket("tcp");
+    encoder:hash(hash);
+    
+    local frames = {};
+    local begin  = luaos.steady_clock();
+    for i = 1, count do
+        frames[i] = encoder:encode(data, 1, false, false);
+    end
+    local encode_ms = math.max(luaos.steady_clock() - begin, 1);
+    
+    local decoded = 0;
+    local on_frame = function(packet)
+        decoded = decoded + 1;
+    end
+    begin = luaos.steady_clock();
+    for i = 1, count do
+        assert(decoder:decode(frames[i], on_frame));
+    end
+    local decode_ms = math.max(luaos.steady_clock() - begin, 1);
+    assert(decoded == count);
+    
+    local mb = size * count / 1048.576;
+    bench.report("codec", "hash", hash, "size", size, "frames", count,
+        "encode_mb_per_sec", mb / encode_ms, "decode_mb_per_sec", mb / decode_ms
+    );
+    encoder:close();
+    decoder:close();
+end
+
+function main(mb)
+    local total = (tonumber(mb) or 256) * 1048576;
+    for _, size in ipairs({64, 1024, 16384}) do
+        for _, hash in ipairs({"none", "murmur", "crc32c"}) do
+            run(hash, size, size < 1024 and total // 8 or total);
+        end
+    end
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,102 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Shared helpers of the benchmarks in tools/bench, luaos switches to this
+---directory when a benchmark starts, so modules are loaded by their file name:
+---    luaos tools.bench.<name> -a [arguments]
+
+local luaos  = require("luaos");
+local format = string.format;
+
+local bench = {};
+
+----------------------------------------------------------------------------
+
+---start count jobs of module with ("worker", tag, ...), every worker calls
+---bench.ready(tag) first and bench.done(tag) when its share is finished,
+---returns the milliseconds between all workers ready and all of them done
+function bench.spawn(module, count, tag, ...)
+    local ready = "bench.ready." .. tag;
+    local done  = "bench.done."  .. tag;
+    luaos.global.set(ready, -count);
+    luaos.global.set(done, 0);
+    local jobs = {};
+    for i = 1, count do
+        jobs[i] = luaos.start(module, "worker", tag, i, ...);
+    end
+    while luaos.global.get(ready) < 0 do
+        luaos.wait(1);
+    end
+    local begin = luaos.steady_clock();
+    while luaos.global.get(done) < count do
+        luaos.wait(1);
+    end
+    local elapsed = luaos.steady_clock() - begin;
+    luaos.global.erase(ready);
+    luaos.global.erase(done);
+    return math.max(elapsed, 1), jobs;
+end
+
+---luaos.start returns once the new job waits, so the worker waits here
+---until all of them are started, they then run side by side
+function bench.ready(tag)
+    local key = "bench.ready." .. tag;
+    luaos.wait(0);
+    luaos.global.incr(key, 1);
+    while luaos.global.get(key) < 0 do
+        luaos.wait(1);
+    end
+end
+
+---called by a worker when its share of the work is finished
+function bench.done(tag)
+    luaos.global.incr("bench.done." .. tag, 1);
+end
+
+---collect latency samples (milliseconds or microseconds, as recorded)
+function bench.samples()
+    local result = {};
+    function result:add(value)
+        self[#self + 1] = value;
+    end
+    function result:percentile(p)
+        if #self == 0 then
+            return 0;
+        end
+        table.sort(self);
+        return self[math.max(1, math.ceil(#self * p / 100))];
+    end
+    return result;
+end
+
+---print one result line: name followed by key=value pairs in the given order
+function bench.report(name, ...)
+    local fields = {...};
+    local cache  = {name};
+    for i = 1, #fields, 2 do
+        local value = fields[i + 1];
+        if math.type(value) == "float" then
+            value = format("%.2f", value);
+        end
+        table.insert(cache, format("%s=%s", fields[i], tostring(value)));
+    end
+    print(table.concat(cache, " "));
+end
+
+return bench;
+
+----------------------------------------------------------------------------
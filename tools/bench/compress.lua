@@ -0,0 +1,87 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---eth codec with compression on (the socket:encode default): heartbeats,
+---compressible json and incompressible bytes. Reports wire bytes per frame
+---and MB/s both ways, runs unchanged on older builds.
+---    luaos tools.bench.compress -a [mb=64]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function json_text(size)
+    local cache, n = {}, 0;
+    while n < size do
+        local item = string.format('{"id":%d,"name":"player_%d","level":%d,"guild":"dragon"},', n, n, n % 100);
+        cache[#cache + 1] = item;
+        n = n + #item;
+    end
+    return table.concat(cache):sub(1, size);
+end
+
+local function random_bytes(size)
+    local cache = {};
+    for i = 1, size do
+        cache[i] = string.char(math.random(0, 255));
+    end
+    return table.concat(cache);
+end
+
+local function run(name, data, total)
+    local count = math.max(total // #data, 1);
+    local encoder, decoder = luaos.socket("tcp"), luaos.socket("tcp");
+    
+    local frames, wire = {}, 0;
+    local begin = luaos.steady_clock();
+    for i = 1, count do
+        frames[i] = encoder:encode(data, 1, false, true);
+    end
+    local encode_ms = math.max(luaos.steady_clock() - begin, 1);
+    for i = 1, count do
+        wire = wire + #frames[i];
+    end
+    
+    local on_frame = function(packet)
+        assert(#packet == #data);
+    end
+    begin = luaos.steady_clock();
+    for i = 1, count do
+        assert(decoder:decode(frames[i], on_frame));
+    end
+    local decode_ms = math.max(luaos.steady_clock() - begin, 1);
+    
+    local mb = #data * count / 1048.576;
+    bench.report("compress", "payload", name, "size", #data, "wire", wire // count,
+        "encode_mb_per_sec", mb / encode_ms, "decode_mb_per_sec", mb / decode_ms
+    );
+    encoder:close();
+    decoder:close();
+end
+
+function main(mb)
+    local total = (tonumber(mb) or 64) * 1048576;
+    math.randomseed(1);
+    run("heartbeat", string.rep("h", 20), total // 64);
+    run("json4k",    json_text(4096), total);
+    run("json60k",   json_text(60000), total);
+    run("random4k",  random_bytes(4096), total);
+    run("random60k", random_bytes(60000), total);
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,89 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Ping-pong over loopback tcp, the report names the reactor backend so runs
+---of differently built binaries can be told apart.
+---    luaos tools.bench.echo -a [clients=64] [rounds=10000] [size=64] [port=7700]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function worker(tag, index, rounds, size, port)
+    bench.ready(tag);
+    local peer = luaos.socket("tcp");
+    assert(peer:connect("127.0.0.1", port, 10000));
+    peer:nodelay();
+    
+    local data = string.rep("x", size);
+    local count, pending = 0, 0;
+    peer:select(luaos.read, function(ec, chunk)
+        if ec ~= 0 then
+            count = rounds;
+            return;
+        end
+        pending = pending + #chunk;
+        while pending >= size do
+            pending = pending - size;
+            count = count + 1;
+            if count < rounds then
+                peer:send(data, true);
+            end
+        end
+    end);
+    peer:send(data, true);
+    
+    while count < rounds and not luaos.stopped() do
+        luaos.wait(10);
+    end
+    peer:close();
+    bench.done(tag);
+end
+
+----------------------------------------------------------------------------
+
+function main(role, rounds, size, port, ...)
+    if role == "worker" then
+        worker(rounds, size, port, ...);
+        return;
+    end
+    local clients = tonumber(role) or 64;
+    rounds = tonumber(rounds) or 10000;
+    size   = tonumber(size)   or 64;
+    port   = tonumber(port)   or 7700;
+    
+    local acceptor = luaos.socket("tcp");
+    assert(acceptor:listen("127.0.0.1", port, function(peer)
+        peer:nodelay();
+        peer:select(luaos.read, function(ec, data)
+            if ec == 0 then
+                peer:send(data, true);
+            end
+        end);
+    end));
+    
+    local elapsed = bench.spawn("echo", clients, "echo", rounds, size, port);
+    local total   = clients * rounds;
+    acceptor:close();
+    
+    bench.report("echo", "backend", luaos.backend(), "clients", clients,
+        "size", size, "msgs", total, "ms", elapsed, "msgs_per_sec", total * 1000 // elapsed
+    );
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,125 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Lateness of a 1 ms probe timer while the same job writes 1 MB every
+---10 ms (100 MB/s) to a log file, through Lua's io library on the job
+---thread and through os.file on the I/O pool, then through os.file with an
+---fsync after every 10 writes. An idle run gives the floor of the timer.
+---    luaos tools.bench.file -a [seconds=3] [chunk_kb=1024] [interval=10] [filename]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local max_pending <const> = 8;  --writes in flight before os.file skips a tick
+
+----------------------------------------------------------------------------
+
+---call handler every interval ms until it returns false, the handler gets
+---how many ms the timer fired after its deadline
+local function every(interval, handler)
+    local expect = luaos.steady_clock() + interval;
+    local function on_timer()
+        local now = luaos.steady_clock();
+        if handler(now - expect) then
+            expect = expect + interval;
+            luaos.scheme(math.max(expect - now, 0), on_timer);
+        end
+    end
+    luaos.scheme(interval, on_timer);
+end
+
+local function run(mode, seconds, chunk, interval, filename)
+    local late    = bench.samples();
+    local written = 0;
+    local pending = 0;
+    local writes  = 0;
+    local stop    = false;
+
+    local file;
+    if mode == "io" then
+        file = assert(io.open(filename, "wb"));
+    elseif mode ~= "idle" then
+        file = luaos.file(filename, "wb");
+    end
+
+    local function on_written(ec, bytes)
+        pending = pending - 1;
+        if ec == 0 then
+            written = written + bytes;
+        end
+    end
+
+    every(1, function(ms)
+        late:add(ms);
+        return not stop;
+    end);
+    every(interval, function()
+        if stop then
+            return false;
+        end
+        if mode == "io" then
+            file:write(chunk);
+            file:flush();
+            written = written + #chunk;
+        elseif mode ~= "idle" and pending < max_pending then
+            pending = pending + 1;
+            file:append(chunk, on_written);
+            writes = writes + 1;
+            if mode == "os_file_fsync" and writes % 10 == 0 then
+                file:fsync();
+            end
+        end
+        return true;
+    end);
+
+    local begin = luaos.steady_clock();
+    while luaos.steady_clock() - begin < seconds * 1000 do
+        luaos.wait(10);
+    end
+    stop = true;
+    --let the writes in flight come back before counting
+    while pending > 0 do
+        luaos.wait(10);
+    end
+    if file then
+        file:close();
+    end
+    os.remove(filename);
+
+    bench.report("file", "mode", mode, "probes", #late,
+        "late_p50_ms", late:percentile(50), "late_p99_ms", late:percentile(99),
+        "late_max_ms", late:percentile(100), "mb_per_sec", written / 1048.576 / (seconds * 1000)
+    );
+end
+
+function main(seconds, chunk_kb, interval, filename)
+    seconds  = tonumber(seconds)  or 3;
+    chunk_kb = tonumber(chunk_kb) or 1024;
+    interval = tonumber(interval) or 10;
+    filename = filename or "/tmp/luaos-bench-file.log";
+    local chunk = string.rep("0123456789abcdef", chunk_kb * 64);
+    local modes = {"idle", "io"};
+    if os.file then
+        table.insert(modes, "os_file");
+        table.insert(modes, "os_file_fsync");
+    end
+    for _, mode in ipairs(modes) do
+        run(mode, seconds, chunk, interval, filename);
+    end
+end
+
+----------------------------------------------------------------------------
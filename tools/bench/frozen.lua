@@ -0,0 +1,115 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Read-only configuration shared by every job: global.freeze once and
+---global.frozen in each job, against global.set once and a global.get copy
+---in each job. Reports the cost of attaching, the Lua heap every job spends
+---on its view, and random nested lookups through each.
+---    luaos tools.bench.frozen -a [items=200000] [workers=4] [lookups=1000000]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function build(items)
+    local data = {};
+    for i = 1, items do
+        data["item_" .. i] = {
+            id    = i,
+            name  = "name_" .. (i % 1000),
+            level = i % 100,
+            attrs = {i % 7, i % 11, i % 13},
+        };
+    end
+    return data;
+end
+
+local function lookup(data, items, lookups)
+    local sum = 0;
+    for i = 1, lookups do
+        local item = data["item_" .. ((i * 7919) % items + 1)];
+        sum = sum + item.level + item.attrs[2];
+    end
+    return sum;
+end
+
+local function worker(tag, index, mode, items, lookups)
+    bench.ready(tag);
+    collectgarbage();
+    local heap  = collectgarbage("count");
+    local begin = luaos.steady_clock();
+    local data;
+    if mode == "frozen" then
+        data = luaos.global.frozen("bench.frozen");
+    else
+        data = luaos.global.get("bench.frozen");
+    end
+    local attach = luaos.steady_clock() - begin;
+    collectgarbage();
+    heap = collectgarbage("count") - heap;
+    begin = luaos.steady_clock();
+    lookup(data, items, lookups);
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    luaos.global.incr("bench.attach." .. tag, attach);
+    luaos.global.incr("bench.heap." .. tag, math.floor(heap));
+    luaos.global.incr("bench.lookup." .. tag, lookups * 1000 // elapsed);
+    bench.done(tag);
+end
+
+function main(items, workers, lookups, ...)
+    if items == "worker" then
+        worker(workers, lookups, ...);
+        return;
+    end
+    items   = tonumber(items) or 200000;
+    workers = tonumber(workers) or 4;
+    lookups = tonumber(lookups) or 1000000;
+
+    local data = build(items);
+    for _, mode in ipairs({"global", "frozen"}) do
+        local begin = luaos.steady_clock();
+        if mode == "frozen" then
+            luaos.global.freeze("bench.frozen", data);
+        else
+            luaos.global.set("bench.frozen", data);
+        end
+        local publish = luaos.steady_clock() - begin;
+        local tag = "frozen." .. mode;
+        for _, name in ipairs({"attach", "heap", "lookup"}) do
+            luaos.global.set("bench." .. name .. "." .. tag, 0);
+        end
+        local elapsed = bench.spawn("frozen", workers, tag, mode, items, lookups);
+        bench.report("frozen", "mode", mode, "items", items, "workers", workers,
+            "publish_ms", publish,
+            "attach_ms", luaos.global.get("bench.attach." .. tag) // workers,
+            "heap_kb_per_job", luaos.global.get("bench.heap." .. tag) // workers,
+            "lookups_per_sec", luaos.global.get("bench.lookup." .. tag) // workers,
+            "ms", elapsed
+        );
+        for _, name in ipairs({"attach", "heap", "lookup"}) do
+            luaos.global.erase("bench." .. name .. "." .. tag);
+        end
+        if mode == "frozen" then
+            luaos.global.unfreeze("bench.frozen");
+        else
+            luaos.global.erase("bench.frozen");
+        end
+    end
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,163 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Bulk transfer over loopback from a server job to a client job, plain tcp
+---and tls, with send() of in-memory chunks and with sendfile(), and tls with
+---kernel tls asked for. The ktls column says whether the kernel took the
+---session; without the tls ulp the socket stays on the user space stream.
+---    luaos tools.bench.ktls -a [mb=512] [file_mb=64] [port=7730] [certfile] [keyfile]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local chunk_size <const> = 65536;
+local max_queued <const> = 4 * 1048576;
+
+----------------------------------------------------------------------------
+
+local function server(port, mode, filename, rounds, certfile, keyfile)
+    local context;
+    if mode ~= "tcp_send" and mode ~= "tcp_sendfile" then
+        context = luaos.tls.cache("bench.ktls", certfile, keyfile);
+    end
+    local file  = io.open(filename, "rb");
+    local chunk = file:read(chunk_size);
+    local size  = file:seek("end");
+    file:close();
+
+    local stream, ktls;
+    local acceptor = luaos.socket("tcp");
+    assert(acceptor:listen("127.0.0.1", port, function(peer)
+        if mode == "ktls_sendfile" then
+            peer:ktls(true);
+        end
+        if context then
+            peer:tls_enable(context);
+        end
+        peer:handshake(function(ec)
+            if ec == 0 then
+                ktls = peer:ktls();
+                stream = peer;
+            end
+        end);
+    end));
+    luaos.global.set("bench.ktls.ready", 1);
+
+    while not stream and not luaos.stopped() do
+        luaos.wait(1);
+    end
+    local total = rounds * size;
+    local sent  = 0;
+    while sent < total and not luaos.stopped() do
+        if stream:queued() >= max_queued then
+            luaos.wait(1);
+        elseif mode == "tcp_send" or mode == "tls_send" then
+            sent = sent + stream:send(chunk, true);
+        else
+            sent = sent + stream:sendfile(filename);
+        end
+    end
+    luaos.global.set("bench.ktls.active", ktls and 1 or 0);
+    while not luaos.stopped() do
+        luaos.wait();
+    end
+    stream:close();
+    acceptor:close();
+end
+
+local function client(port, mode, total)
+    local peer = luaos.socket("tcp");
+    if mode ~= "tcp_send" and mode ~= "tcp_sendfile" then
+        peer:tls_enable(luaos.tls.context());
+    end
+    assert(peer:connect("127.0.0.1", port, 10000));
+    assert(peer:handshake());
+    local received = 0;
+    local begin = luaos.steady_clock();
+    peer:select(luaos.read, function(ec, data)
+        if ec ~= 0 then
+            received = total;
+            return;
+        end
+        received = received + #data;
+    end);
+    while received < total and not luaos.stopped() do
+        luaos.wait(1);
+    end
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    peer:close();
+    return elapsed;
+end
+
+local function certificate(certfile, keyfile)
+    if certfile and keyfile then
+        return certfile, keyfile;
+    end
+    certfile = "/tmp/luaos-bench-tls.crt";
+    keyfile  = "/tmp/luaos-bench-tls.key";
+    local command = string.format(
+        "openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost " ..
+        "-days 1 -keyout %s -out %s >/dev/null 2>&1", keyfile, certfile
+    );
+    assert(os.execute(command), "openssl req failed");
+    return certfile, keyfile;
+end
+
+function main(mb, file_mb, port, certfile, keyfile, ...)
+    if mb == "server" then
+        server(tonumber(file_mb), port, certfile, tonumber(keyfile), ...);
+        return;
+    end
+    mb      = tonumber(mb) or 512;
+    file_mb = tonumber(file_mb) or 64;
+    port    = tonumber(port) or 7730;
+    certfile, keyfile = certificate(certfile, keyfile);
+
+    local filename = "/tmp/luaos-bench-ktls.bin";
+    local file  = assert(io.open(filename, "wb"));
+    local block = string.rep("luaos-bench-ktls", chunk_size // 16);
+    for i = 1, file_mb * 1048576 // chunk_size do
+        file:write(block);
+    end
+    file:close();
+
+    local rounds = math.max(mb // file_mb, 1);
+    local total  = rounds * file_mb * 1048576;
+    for _, mode in ipairs({"tcp_send", "tcp_sendfile", "tls_send", "tls_sendfile", "ktls_sendfile"}) do
+        luaos.global.set("bench.ktls.ready", 0);
+        luaos.global.set("bench.ktls.active", -1);
+        local job = luaos.start("ktls", "server", port, mode, filename, rounds, certfile, keyfile);
+        while luaos.global.get("bench.ktls.ready") == 0 do
+            luaos.wait(1);
+        end
+        local elapsed = client(port, mode, total);
+        while luaos.global.get("bench.ktls.active") < 0 do
+            luaos.wait(1);
+        end
+        bench.report("ktls", "mode", mode, "mb", total // 1048576,
+            "ktls", luaos.global.get("bench.ktls.active") == 1,
+            "ms", elapsed, "mb_per_sec", total / 1048.576 / elapsed
+        );
+        job:stop();
+        port = port + 1;
+    end
+    os.remove(filename);
+    luaos.global.erase("bench.ktls.ready");
+    luaos.global.erase("bench.ktls.active");
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,74 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---msgpack encode and decode rates on payloads shaped like the ones that go
+---through publish, rpcall and cluster frames. Single job, runs unchanged on
+---older builds, so the same command compares two binaries.
+---    luaos tools.bench.msgpack -a [rounds=200000]
+
+local luaos = require("luaos");
+local bench = require("common");
+local pack  = require("msgpack");
+
+----------------------------------------------------------------------------
+
+local function make_payloads()
+    local record = {
+        id = 10001, name = "player_10001", level = 68, exp = 1234567.5,
+        vip = true, guild = "dragon", x = 1024.25, y = -77.5, hp = 8800,
+        items = {1001, 1002, 1003, 2001, 2002}, tags = {"pvp", "daily"},
+    };
+    local array, map = {}, {};
+    for i = 1, 1000 do
+        array[i] = i * 3;
+        map["key" .. i] = i + 0.5;
+    end
+    return {
+        {"heartbeat", {type = 1}, 1},
+        {"publish",   {type = 4, topic = 1001, mask = 0, publisher = 65537, argv = string.rep("x", 200)}, 1},
+        {"record",    record, 1},
+        {"array1k",   array, 100},
+        {"map1k",     map, 200},
+    };
+end
+
+function main(rounds)
+    rounds = tonumber(rounds) or 200000;
+    for _, v in ipairs(make_payloads()) do
+        local name, value, scale = v[1], v[2], v[3];
+        local count = math.max(rounds // scale, 1);
+        
+        local begin = luaos.steady_clock();
+        local data;
+        for i = 1, count do
+            data = pack.encode(value);
+        end
+        local encode_ms = math.max(luaos.steady_clock() - begin, 1);
+        
+        begin = luaos.steady_clock();
+        for i = 1, count do
+            pack.decode(data);
+        end
+        local decode_ms = math.max(luaos.steady_clock() - begin, 1);
+        
+        bench.report("msgpack", "payload", name, "bytes", #data, "count", count,
+            "encode_per_sec", count * 1000 // encode_ms, "decode_per_sec", count * 1000 // decode_ms
+        );
+    end
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,86 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Publish ping-pong between two jobs, once blocking in os.wait and once
+---with the spin run mode. Latency is the publish to handler histogram of
+---the pong job in os.stats(), the rate is round trips per second. Spinning
+---only pays off when both jobs have a cpu of their own.
+---    luaos tools.bench.pingpong -a [rounds=100000] [spin_us=50] [cpu_ping] [cpu_pong]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local topic_ping <const> = 0x7101;
+local topic_pong <const> = 0x7102;
+
+----------------------------------------------------------------------------
+
+local function wait_options(mode, spin_us, cpu)
+    return {mode = mode, spin_us = spin_us, timeout = 10, cpu = cpu};
+end
+
+local function pong(mode, spin_us, cpu)
+    luaos.subscribe(topic_ping, function(publisher, mask, value)
+        luaos.publish(topic_pong, 0, 0, value);
+    end);
+    local options = wait_options(mode, spin_us, cpu);
+    while not luaos.stopped() do
+        luaos.wait(options);
+    end
+end
+
+local function run(mode, rounds, spin_us, cpu_ping, cpu_pong)
+    local job = luaos.start("pingpong", "pong", mode, spin_us, cpu_pong);
+    local count = 0;
+    luaos.subscribe(topic_pong, function(publisher, mask, value)
+        count = count + 1;
+        if count < rounds then
+            luaos.publish(topic_ping, 0, 0, count);
+        end
+    end);
+    
+    local options = wait_options(mode, spin_us, cpu_ping);
+    local begin = luaos.steady_clock();
+    luaos.publish(topic_ping, 0, 0, 0);
+    while count < rounds do
+        luaos.wait(options);
+    end
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    
+    --the pong job is new for every run, its histogram holds this run only
+    local latency = luaos.stats()[job:id()].publish_latency;
+    bench.report("pingpong", "mode", mode, "rounds", rounds, "ms", elapsed,
+        "rtt_per_sec", rounds * 1000 // elapsed,
+        "p50_us", latency.p50, "p99_us", latency.p99, "max_us", latency.max
+    );
+    luaos.cancel(topic_pong);
+    job:stop();
+end
+
+function main(role, a, b, c)
+    if role == "pong" then
+        pong(a, b, c);
+        return;
+    end
+    local rounds  = tonumber(role) or 100000;
+    local spin_us = tonumber(a) or 50;
+    local cpu_ping, cpu_pong = tonumber(b), tonumber(c);
+    run("block", rounds, spin_us, cpu_ping, cpu_pong);
+    run("spin", rounds, spin_us, cpu_ping, cpu_pong);
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,69 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Cost of os.profile on the profiled jobs: every worker runs the same
+---recursive workload without sampling, then at 100 Hz and at 1000 Hz.
+---    luaos tools.bench.profile -a [workers=4] [depth=32]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function fib(n)
+    if n < 2 then
+        return n;
+    end
+    return fib(n - 1) + fib(n - 2);
+end
+
+local function worker(tag, index, hz, depth)
+    bench.ready(tag);
+    if hz > 0 then
+        assert(luaos.profile.start(luaos.id(), hz));
+    end
+    fib(depth);
+    if hz > 0 then
+        local _, samples = luaos.profile.stop(luaos.id());
+        luaos.global.incr("bench.samples." .. tag, samples);
+    end
+    bench.done(tag);
+end
+
+function main(role, depth, ...)
+    if role == "worker" then
+        worker(depth, ...);
+        return;
+    end
+    local workers = tonumber(role) or 4;
+    depth = tonumber(depth) or 32;
+    
+    local baseline;
+    for _, hz in ipairs({0, 100, 1000}) do
+        local tag = "profile" .. hz;
+        luaos.global.set("bench.samples." .. tag, 0);
+        local elapsed = bench.spawn("profile", workers, tag, hz, depth);
+        local samples = luaos.global.get("bench.samples." .. tag);
+        luaos.global.erase("bench.samples." .. tag);
+        baseline = baseline or elapsed;
+        bench.report("profile", "workers", workers, "hz", hz, "samples", samples,
+            "ms", elapsed, "overhead_pct", (elapsed - baseline) * 100.0 / baseline
+        );
+    end
+end
+
+----------------------------------------------------------------------------
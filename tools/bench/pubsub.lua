@@ -0,0 +1,93 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Publish throughput from one job to another, the path every metrics
+---update sits on (publish_sent, publish_recv, handlers, publish_latency).
+---Run it on builds with and without metrics to see their cost, then the
+---cost of reading os.stats() itself is reported when the build has it.
+---    luaos tools.bench.pubsub -a [messages=1000000] [batch=1000]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local topic <const> = 0x7001;
+
+----------------------------------------------------------------------------
+
+local function subscriber(messages)
+    local count = 0;
+    luaos.subscribe(topic, function(publisher, mask, value)
+        count = count + 1;
+        if count == messages then
+            luaos.global.set("bench.pubsub.done", 1);
+        end
+    end);
+    while not luaos.stopped() do
+        luaos.wait();
+    end
+end
+
+function main(role, batch)
+    if role == "subscriber" then
+        subscriber(batch);
+        return;
+    end
+    local messages = tonumber(role)  or 1000000;
+    batch          = tonumber(batch) or 1000;
+    
+    luaos.global.set("bench.pubsub.done", 0);
+    local job = luaos.start("pubsub", "subscriber", messages);
+    
+    local begin = luaos.steady_clock();
+    local sent  = 0;
+    while sent < messages do
+        for i = 1, math.min(batch, messages - sent) do
+            luaos.publish(topic, 0, 0, i);
+        end
+        sent = sent + batch;
+        luaos.wait(0);
+    end
+    while luaos.global.get("bench.pubsub.done") == 0 do
+        luaos.wait(1);
+    end
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    bench.report("pubsub", "messages", messages, "batch", batch,
+        "ms", elapsed, "msgs_per_sec", messages * 1000 // elapsed
+    );
+    
+    if os.stats then
+        local rounds = 10000;
+        begin = luaos.steady_clock();
+        for i = 1, rounds do
+            os.stats();
+        end
+        local stats_us = (luaos.steady_clock() - begin) * 1000.0 / rounds;
+        local latency = {};
+        for _, v in pairs(os.stats()) do
+            if v.publish_latency and v.publish_latency.count > 0 then
+                latency = v.publish_latency;
+            end
+        end
+        bench.report("pubsub", "latency_p50_us", latency.p50 or 0,
+            "latency_p99_us", latency.p99 or 0, "stats_call_us", stats_us
+        );
+    end
+    job:stop();
+    luaos.global.erase("bench.pubsub.done");
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,85 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Event bus dispatch through luaos.pump_message: steady dispatches to a fixed
+---set of handlers, then dispatches while handlers come and go. Single job,
+---runs unchanged on older builds.
+---    luaos tools.bench.pump -a [handlers=5] [dispatches=200000]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function measure(case, handlers, count, func)
+    local begin = luaos.steady_clock();
+    func();
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    bench.report("pump", "case", case, "handlers", handlers, "dispatches", count,
+        "ms", elapsed, "dispatches_per_sec", count * 1000 // elapsed
+    );
+end
+
+function main(handlers, dispatches)
+    handlers   = tonumber(handlers) or 5;
+    dispatches = tonumber(dispatches) or 200000;
+
+    local total = 0;
+    local pump  = luaos.pump_message();
+    for i = 1, handlers do
+        pump:register("tick", function(a, b)
+            total = total + a + b;
+        end, i % 3);
+    end
+
+    measure("steady", handlers, dispatches, function()
+        for i = 1, dispatches do
+            pump:dispatch("tick", i, 1);
+        end
+    end);
+
+    --one handler is added and removed again every 10 dispatches
+    local extra = function(a, b)
+        total = total - b;
+    end
+    measure("churn", handlers, dispatches, function()
+        for i = 1, dispatches do
+            local slot = i % 10;
+            if slot == 0 then
+                pump:register("tick", extra, 1);
+            elseif slot == 5 then
+                pump:unregister("tick", extra);
+            end
+            pump:dispatch("tick", i, 1);
+        end
+    end);
+
+    --the handler removes itself while the dispatch is running
+    local once;
+    once = function()
+        pump:unregister("tick", once);
+    end
+    measure("self_unregister", handlers, dispatches, function()
+        for i = 1, dispatches do
+            pump:register("tick", once, 2);
+            pump:dispatch("tick", i, 1);
+        end
+    end);
+    assert(total ~= 0);
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,147 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Work distribution from producer jobs to consumer jobs: through os.queue
+---with try_pop_batch polling, through os.queue with pop(callback), and
+---through os.publish with the mask picking one subscriber, the way work was
+---handed out before the queue existed.
+---    luaos tools.bench.queue -a [items=200000] [producers=2] [consumers=2] [batch=64]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local topic <const> = 0x7043;
+
+----------------------------------------------------------------------------
+
+local function consumed(tag)
+    return luaos.global.get("bench.consumed." .. tag);
+end
+
+local function produce(tag, index, mode, items, producers, batch)
+    local share = items // producers;
+    if index == producers then
+        share = items - share * (producers - 1);
+    end
+    if mode == "publish" then
+        for i = 1, share do
+            luaos.publish(topic, i, 0, i);
+            if i % batch == 0 then
+                luaos.wait(0);
+            end
+        end
+        return;
+    end
+    local queue = os.queue("bench." .. tag);
+    local chunk = {};
+    local sent  = 0;
+    while sent < share do
+        local count = math.min(batch, share - sent);
+        for i = 1, count do
+            chunk[i] = sent + i;
+        end
+        for i = count + 1, #chunk do
+            chunk[i] = nil;
+        end
+        local pushed = queue:push_batch(chunk);
+        sent = sent + pushed;
+        if pushed < count then
+            luaos.wait(0); --full, let the consumers catch up
+        end
+    end
+end
+
+local function consume(tag, mode, items, batch)
+    local key   = "bench.consumed." .. tag;
+    local count = 0;
+    local function flush()
+        if count > 0 then
+            luaos.global.incr(key, count);
+            count = 0;
+        end
+    end
+    if mode == "try_pop" then
+        local queue = os.queue("bench." .. tag);
+        while consumed(tag) < items do
+            local values = queue:try_pop_batch(batch);
+            if #values == 0 then
+                flush();
+                luaos.wait(0);
+            else
+                count = count + #values;
+            end
+        end
+        return;
+    end
+    if mode == "pop" then
+        local queue = os.queue("bench." .. tag);
+        local function on_value(value)
+            count = count + 1;
+            queue:pop(on_value);
+        end
+        queue:pop(on_value);
+    else
+        luaos.subscribe(topic, function(publisher, mask, value)
+            count = count + 1;
+        end);
+    end
+    while consumed(tag) < items do
+        flush();
+        luaos.wait(1);
+    end
+end
+
+local function worker(tag, index, mode, items, producers, consumers, batch)
+    bench.ready(tag);
+    if index <= producers then
+        produce(tag, index, mode, items, producers, batch);
+    else
+        consume(tag, mode, items, batch);
+    end
+    bench.done(tag);
+end
+
+function main(items, producers, consumers, batch, ...)
+    if items == "worker" then
+        local tag, index, mode = producers, consumers, batch;
+        worker(tag, index, mode, ...);
+        return;
+    end
+    items     = tonumber(items) or 200000;
+    producers = tonumber(producers) or 2;
+    consumers = tonumber(consumers) or 2;
+    batch     = tonumber(batch) or 64;
+
+    for _, mode in ipairs({"try_pop", "pop", "publish"}) do
+        local tag = "queue." .. mode;
+        luaos.global.set("bench.consumed." .. tag, 0);
+        if mode ~= "publish" then
+            os.queue("bench." .. tag, 4096);
+        end
+        local elapsed = bench.spawn("queue", producers + consumers, tag,
+            mode, items, producers, consumers, batch
+        );
+        local stats = mode ~= "publish" and os.queue("bench." .. tag):stats() or {};
+        luaos.global.erase("bench.consumed." .. tag);
+        bench.report("queue", "mode", mode, "items", items, "producers", producers,
+            "consumers", consumers, "ms", elapsed, "items_per_sec", items * 1000 // elapsed,
+            "peak", stats.peak or "-", "rejected", stats.rejected or "-"
+        );
+    end
+end
+
+----------------------------------------------------------------------------
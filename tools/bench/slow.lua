@@ -0,0 +1,181 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Latency of well-behaved http requests to luaos.nginx while thousands of
+---slow clients trickle their request headers one byte per second. Slow
+---connections the server drops are opened again unless reconnect is 0.
+---Runs unchanged on builds without the native request limits.
+---    luaos tools.bench.slow -a [slow=2000] [seconds=10] [port=7740] [reconnect=1]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local request <const> = "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+local trickle <const> = "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Slow: " .. string.rep("x", 4096);
+
+----------------------------------------------------------------------------
+
+local function server(port, root)
+    local nginx = assert(luaos.nginx.start("127.0.0.1", port, root));
+    luaos.global.set("bench.slow.ready", 1);
+    while not luaos.stopped() do
+        luaos.wait();
+    end
+    nginx:stop();
+end
+
+---keep count connections open, each one sends the next byte of its
+---request once a second and never finishes it
+local function slow(port, count, reconnect)
+    local peers   = {};
+    local dropped = 0;
+
+    local function open(i)
+        local peer = luaos.socket("tcp");
+        peers[i] = {peer = peer, sent = 0};
+        peer:connect("127.0.0.1", port, function(ec)
+            if ec ~= 0 then
+                peers[i] = nil;
+                return;
+            end
+            peer:select(luaos.read, function(ec, data)
+                if ec ~= 0 then
+                    dropped = dropped + 1;
+                    peer:close();
+                    peers[i] = nil;
+                end
+            end);
+        end);
+    end
+
+    for i = 1, count do
+        open(i);
+        if i % 100 == 0 then
+            luaos.wait(0);
+        end
+    end
+    luaos.global.set("bench.slow.opened", 1);
+
+    local tick = 0;
+    while not luaos.stopped() do
+        luaos.wait(100);
+        tick = tick + 1;
+        for i = tick % 10 + 1, count, 10 do
+            local v = peers[i];
+            if not v then
+                if reconnect then
+                    open(i);
+                end
+            elseif v.peer:is_open() and v.sent < #trickle then
+                v.sent = v.sent + 1;
+                v.peer:send(trickle:sub(v.sent, v.sent), true);
+            end
+        end
+        luaos.global.set("bench.slow.dropped", dropped);
+    end
+    for _, v in pairs(peers) do
+        v.peer:close();
+    end
+end
+
+---sequential requests on fresh connections, returns the latency samples
+local function measure(port, seconds)
+    local late  = bench.samples();
+    local begin = luaos.steady_clock();
+    local failed = 0;
+    while luaos.steady_clock() - begin < seconds * 1000 do
+        local start = luaos.steady_clock();
+        local peer  = luaos.socket("tcp");
+        local done, size = false, 0;
+        if peer:connect("127.0.0.1", port, 5000) then
+            peer:select(luaos.read, function(ec, data)
+                if ec ~= 0 then
+                    done = true;
+                    return;
+                end
+                size = size + #data;
+            end);
+            peer:send(request);
+            while not done and luaos.steady_clock() - start < 5000 do
+                luaos.wait(1);
+            end
+        end
+        peer:close();
+        if size > 0 then
+            late:add(luaos.steady_clock() - start);
+        else
+            failed = failed + 1;
+        end
+    end
+    return late, failed;
+end
+
+local function report(phase, slow_count, late, failed, seconds, dropped)
+    bench.report("slow", "phase", phase, "slow_clients", slow_count,
+        "requests", #late, "failed", failed, "requests_per_sec", #late / seconds,
+        "p50_ms", late:percentile(50), "p99_ms", late:percentile(99),
+        "max_ms", late:percentile(100), "slow_dropped", dropped
+    );
+end
+
+function main(count, seconds, port, ...)
+    if count == "server" then
+        server(tonumber(seconds), port);
+        return;
+    end
+    if count == "slow" then
+        slow(tonumber(seconds), tonumber(port), tonumber((...)) ~= 0);
+        return;
+    end
+    count   = tonumber(count) or 2000;
+    seconds = tonumber(seconds) or 10;
+    port    = tonumber(port) or 7740;
+    local reconnect = tonumber((...)) or 1;
+
+    local root = "/tmp/luaos-bench-www";
+    os.execute("mkdir -p " .. root);
+    local file = assert(io.open(root .. "/index.html", "wb"));
+    file:write(string.rep("<p>luaos</p>\n", 100));
+    file:close();
+
+    luaos.global.set("bench.slow.ready", 0);
+    luaos.global.set("bench.slow.opened", 0);
+    luaos.global.set("bench.slow.dropped", 0);
+    local server_job = luaos.start("slow", "server", port, root);
+    while luaos.global.get("bench.slow.ready") == 0 do
+        luaos.wait(1);
+    end
+
+    local late, failed = measure(port, seconds);
+    report("quiet", 0, late, failed, seconds, 0);
+
+    local slow_job = luaos.start("slow", "slow", port, count, reconnect);
+    while luaos.global.get("bench.slow.opened") == 0 do
+        luaos.wait(1);
+    end
+    late, failed = measure(port, seconds);
+    report(reconnect == 0 and "loaded_once" or "loaded", count, late, failed, seconds, luaos.global.get("bench.slow.dropped"));
+
+    slow_job:stop();
+    server_job:stop();
+    os.remove(root .. "/index.html");
+    for _, key in ipairs({"ready", "opened", "dropped"}) do
+        luaos.global.erase("bench.slow." .. key);
+    end
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,67 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Contention on luaos.global: every job mixes get, set with ttl and incr
+---over a shared key space while the watchdog expires keys.
+---    luaos tools.bench.storage -a [jobs=32] [ops=200000] [keys=10000]
+
+local luaos  = require("luaos");
+local bench  = require("common");
+local global = luaos.global;
+
+----------------------------------------------------------------------------
+
+local function worker(tag, index, ops, keys)
+    local random = math.random;
+    math.randomseed(index);
+    bench.ready(tag);
+    for i = 1, ops do
+        local key = "bench.storage." .. random(keys);
+        local op  = i % 10;
+        if op == 0 then
+            global.set(key, i, nil, random(100, 2000));
+        elseif op == 1 then
+            global.incr("bench.storage.counter", 1);
+        else
+            global.get(key);
+        end
+    end
+    bench.done(tag);
+end
+
+----------------------------------------------------------------------------
+
+function main(role, ops, keys, ...)
+    if role == "worker" then
+        worker(ops, keys, ...);
+        return;
+    end
+    local jobs = tonumber(role) or 32;
+    ops  = tonumber(ops)  or 200000;
+    keys = tonumber(keys) or 10000;
+    
+    global.set("bench.storage.counter", 0);
+    local elapsed = bench.spawn("storage", jobs, "storage", ops, keys);
+    local total   = jobs * ops;
+    assert(global.get("bench.storage.counter") == jobs * ((ops + 9) // 10));
+    
+    bench.report("storage", "jobs", jobs, "keys", keys, "ops", total,
+        "ms", elapsed, "ops_per_sec", total * 1000 // elapsed
+    );
+end
+
+----------------------------------------------------------------------------
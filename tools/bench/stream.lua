@@ -0,0 +1,150 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Socket send queue and frame decoder under load, runs unchanged on older
+---builds. The memory phase opens many connections, pushes a burst of
+---frames through each of them and reports the resident memory that stays
+---per connection once they are idle. The stream phase measures framed
+---throughput over one connection with a window of frames in flight.
+---    luaos tools.bench.stream -a [connections=500] [burst_kb=256] [stream_mb=512] [port=7710]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+local frame_size <const> = 16384;
+local window     <const> = 64;
+
+----------------------------------------------------------------------------
+
+local function resident_kb()
+    local file = io.open("/proc/self/status", "r");
+    if not file then
+        return 0;
+    end
+    local text = file:read("a");
+    file:close();
+    return tonumber(text:match("VmRSS:%s*(%d+)")) or 0;
+end
+
+local function wait_until(key, value)
+    while luaos.global.get(key) ~= value do
+        luaos.wait(10);
+    end
+end
+
+---client job: burst_kb of frames over every connection, then one stream
+local function client(connections, burst_kb, stream_mb, port)
+    --luaos.start holds the server job until this one waits
+    luaos.wait(0);
+    local data  = string.rep("x", frame_size);
+    local peers = {};
+    for i = 1, connections do
+        local peer = luaos.socket("tcp");
+        assert(peer:connect("127.0.0.1", port, 10000));
+        peers[i] = peer;
+        for j = 1, burst_kb * 1024 // frame_size do
+            peer:send(peer:encode(data, 1, false, false), true);
+        end
+    end
+    collectgarbage("collect");
+    luaos.global.set("bench.stream.phase", "memory");
+    wait_until("bench.stream.phase", "stream");
+    for i = 1, connections do
+        peers[i]:close();
+    end
+    
+    local peer = luaos.socket("tcp");
+    assert(peer:connect("127.0.0.1", port, 10000));
+    local frames  = stream_mb * 1048576 // frame_size;
+    local sent    = 0;
+    local function send_window()
+        for i = 1, math.min(window, frames - sent) do
+            peer:send(peer:encode(data, 1, false, false), true);
+            sent = sent + 1;
+        end
+    end
+    --the server answers one byte per window
+    peer:select(luaos.read, function(ec, ack)
+        if ec == 0 and sent < frames then
+            send_window();
+        end
+    end);
+    send_window();
+    wait_until("bench.stream.phase", "done");
+    peer:close();
+end
+
+function main(role, ...)
+    if role == "client" then
+        client(...);
+        return;
+    end
+    local connections = tonumber(role) or 500;
+    local burst_kb, stream_mb, port = ...;
+    burst_kb  = tonumber(burst_kb)  or 256;
+    stream_mb = tonumber(stream_mb) or 512;
+    port      = tonumber(port)      or 7710;
+    
+    local received, stream_frames = 0, 0;
+    local acceptor = luaos.socket("tcp");
+    assert(acceptor:listen("127.0.0.1", port, function(peer)
+        peer:select(luaos.read, function(ec, data)
+            if ec ~= 0 then
+                return;
+            end
+            peer:decode(data, function(packet)
+                received = received + #packet;
+                stream_frames = stream_frames + 1;
+                if stream_frames % window == 0 then
+                    peer:send("!", true);
+                end
+            end);
+        end);
+    end));
+    
+    luaos.global.set("bench.stream.phase", "burst");
+    local before = resident_kb();
+    local job = luaos.start("stream", "client", connections, burst_kb, stream_mb, port);
+    local expect = connections * (burst_kb * 1024 // frame_size) * frame_size;
+    while received < expect do
+        luaos.wait(10);
+    end
+    wait_until("bench.stream.phase", "memory");
+    luaos.wait(200);
+    --only buffers the sockets still hold should count, not lua garbage
+    collectgarbage("collect");
+    local per_connection = (resident_kb() - before) / connections;
+    bench.report("stream", "connections", connections, "burst_kb", burst_kb,
+        "resident_kb_per_connection", per_connection
+    );
+    
+    received, stream_frames = 0, 0;
+    expect = stream_mb * 1048576 // frame_size * frame_size;
+    luaos.global.set("bench.stream.phase", "stream");
+    local begin = luaos.steady_clock();
+    while received < expect do
+        luaos.wait(1);
+    end
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    bench.report("stream", "frame", frame_size, "window", window, "mb", stream_mb,
+        "ms", elapsed, "mb_per_sec", stream_mb * 1000.0 / elapsed
+    );
+    luaos.global.set("bench.stream.phase", "done");
+    acceptor:close();
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,120 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---TLS handshakes per second against a luaos server, driven by
+---`openssl s_time` with new sessions and with resumed ones. The server
+---either loads a context per connection, the way nginx did before contexts
+---were cached, or shares one cached context with the session cache on.
+---A self-signed certificate is created when none is given.
+---    luaos tools.bench.tls -a [seconds=5] [port=7720] [certfile] [keyfile]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function server(port, mode, certfile, keyfile)
+    local context;
+    if mode == "cached" then
+        context = luaos.tls.cache("bench.tls", certfile, keyfile);
+        assert(context:session_cache());
+    end
+    local acceptor = luaos.socket("tcp");
+    assert(acceptor:listen("127.0.0.1", port, function(peer)
+        local sslctx = context;
+        if not sslctx then
+            sslctx = luaos.tls.context();
+            sslctx:load(certfile, keyfile);
+        end
+        peer:tls_enable(sslctx);
+        peer:handshake(function(ec)
+            if ec ~= 0 then
+                peer:close();
+                return;
+            end
+            peer:select(luaos.read, function(ec, data)
+                if ec ~= 0 then
+                    peer:close();
+                end
+            end);
+        end);
+    end));
+    luaos.global.set("bench.tls.ready", 1);
+    while not luaos.stopped() do
+        luaos.wait();
+    end
+    acceptor:close();
+end
+
+local function s_time(port, seconds, reuse)
+    local command = string.format(
+        "openssl s_time -connect 127.0.0.1:%d -time %d %s 2>&1",
+        port, seconds, reuse and "-reuse" or "-new"
+    );
+    local file   = io.popen(command);
+    local output = file:read("a");
+    file:close();
+    --the last summary line counts wall clock, the one before it client cpu
+    local count, elapsed;
+    for c, e in output:gmatch("(%d+) connections in ([%d%.]+) real seconds") do
+        count, elapsed = c, e;
+    end
+    return tonumber(count) or 0, tonumber(elapsed) or seconds;
+end
+
+local function certificate(certfile, keyfile)
+    if certfile and keyfile then
+        return certfile, keyfile;
+    end
+    certfile = "/tmp/luaos-bench-tls.crt";
+    keyfile  = "/tmp/luaos-bench-tls.key";
+    local command = string.format(
+        "openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost " ..
+        "-days 1 -keyout %s -out %s >/dev/null 2>&1", keyfile, certfile
+    );
+    assert(os.execute(command), "openssl req failed");
+    return certfile, keyfile;
+end
+
+function main(seconds, port, certfile, keyfile, ...)
+    if seconds == "server" then
+        server(tonumber(port), certfile, keyfile, ...);
+        return;
+    end
+    seconds = tonumber(seconds) or 5;
+    port    = tonumber(port) or 7720;
+    certfile, keyfile = certificate(certfile, keyfile);
+
+    for _, mode in ipairs({"per_connection", "cached"}) do
+        luaos.global.set("bench.tls.ready", 0);
+        local job = luaos.start("tls", "server", port, mode, certfile, keyfile);
+        while luaos.global.get("bench.tls.ready") == 0 do
+            luaos.wait(1);
+        end
+        for _, reuse in ipairs({false, true}) do
+            local count, elapsed = s_time(port, seconds, reuse);
+            bench.report("tls", "server", mode, "client", reuse and "resume" or "new",
+                "connections", count, "handshakes_per_sec", count / elapsed
+            );
+        end
+        job:stop();
+        port = port + 1;
+    end
+    luaos.global.erase("bench.tls.ready");
+end
+
+----------------------------------------------------------------------------
@@ -0,0 +1,70 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---utf8.check throughput on ASCII, CJK-heavy, mixed chat text and random
+---bytes. Single job, runs unchanged on older builds.
+---    luaos tools.bench.utf8 -a [size_kb=64] [mb=256]
+
+local luaos = require("luaos");
+local bench = require("common");
+
+----------------------------------------------------------------------------
+
+local function fill(pattern, size)
+    local data = string.rep(pattern, size // #pattern + 1);
+    --cut on a character boundary so the valid inputs stay valid
+    local cut = size;
+    while cut > 0 and (data:byte(cut + 1) or 0) & 0xc0 == 0x80 do
+        cut = cut - 1;
+    end
+    return data:sub(1, cut);
+end
+
+local function random_bytes(size)
+    local cache = {};
+    for i = 1, size do
+        cache[i] = string.char(math.random(0, 255));
+    end
+    return table.concat(cache);
+end
+
+function main(size_kb, mb)
+    local size  = (tonumber(size_kb) or 64) * 1024;
+    local total = (tonumber(mb) or 256) * 1048576;
+    math.randomseed(1);
+    local inputs = {
+        {"ascii",  fill("GET /index.html HTTP/1.1 Host: example.com ", size)},
+        {"cjk",    fill("\u{670D}\u{52A1}\u{5668}\u{542F}\u{52A8}\u{6210}\u{529F}\u{FF0C}\u{6B22}\u{8FCE}\u{4F7F}\u{7528}", size)},
+        {"mixed",  fill("{\"msg\":\"\u{4F60}\u{597D} world\",\"id\":12345}", size)},
+        {"random", random_bytes(size)},
+    };
+    for _, v in ipairs(inputs) do
+        local name, data = v[1], v[2];
+        local count = math.max(total // #data, 1);
+        local valid;
+        local begin = luaos.steady_clock();
+        for i = 1, count do
+            valid = utf8.check(data);
+        end
+        local elapsed = math.max(luaos.steady_clock() - begin, 1);
+        bench.report("utf8", "input", name, "bytes", #data, "valid", valid,
+            "mb_per_sec", #data * count / 1048.576 / elapsed
+        );
+    end
+end
+
+----------------------------------------------------------------------------
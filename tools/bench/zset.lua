@@ -0,0 +1,131 @@
+﻿
+--[[
+*********************************************************************************
+** 
+** Copyright 2021-2023 LuaOS
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+** SOFTWARE.
+** 
+*********************************************************************************
+]]--
+
+---Leaderboard operations on skiplist.zset against skiplist.new with a Lua
+---comparator, both ordered by score descending and then by member.
+---    luaos tools.bench.zset -a [members=200000] [top=100]
+
+local luaos    = require("luaos");
+local skiplist = require("skiplist");
+local bench    = require("common");
+
+----------------------------------------------------------------------------
+
+local function compare(a, b, sa, sb)
+    if sa ~= sb then
+        return sb - sa;
+    end
+    return a - b;
+end
+
+local function measure(name, op, count, func)
+    local begin = luaos.steady_clock();
+    func();
+    local elapsed = math.max(luaos.steady_clock() - begin, 1);
+    bench.report("zset", "impl", name, "op", op, "count", count,
+        "ms", elapsed, "ops_per_sec", count * 1000 // elapsed
+    );
+end
+
+local function run_skiplist(scores, updates, top)
+    local n  = #scores;
+    local sl = skiplist.new(compare);
+    measure("skiplist", "insert", n, function()
+        for i = 1, n do
+            sl:insert(i, scores[i]);
+        end
+    end);
+    measure("skiplist", "update", n, function()
+        for i = 1, n do
+            sl:update(i, updates[i]);
+        end
+    end);
+    measure("skiplist", "rank_of", n, function()
+        for i = 1, n do
+            sl:rank_of(i);
+        end
+    end);
+    local rounds = n // top;
+    measure("skiplist", "top", rounds, function()
+        for i = 1, rounds do
+            for _, member in ipairs(sl:rank_range(1, top)) do
+                sl:get_score(member);
+            end
+        end
+    end);
+    measure("skiplist", "delete", n, function()
+        for i = 1, n do
+            sl:delete(i);
+        end
+    end);
+end
+
+local function run_zset(scores, updates, top)
+    local n  = #scores;
+    local zs = skiplist.zset(true);
+    measure("zset", "insert", n, function()
+        for i = 1, n do
+            zs:insert(i, scores[i]);
+        end
+    end);
+    measure("zset", "update", n, function()
+        for i = 1, n do
+            zs:insert(i, updates[i]);
+        end
+    end);
+    measure("zset", "rank_of", n, function()
+        for i = 1, n do
+            zs:rank_of(i);
+        end
+    end);
+    local rounds = n // top;
+    measure("zset", "top", rounds, function()
+        for i = 1, rounds do
+            for rank, member, score in zs:range_by_rank(1, top) do
+            end
+        end
+    end);
+    measure("zset", "delete", n, function()
+        for i = 1, n do
+            zs:delete(i);
+        end
+    end);
+    local bulk = {};
+    for i = 1, n do
+        bulk[i] = scores[i];
+    end
+    zs:clear();
+    measure("zset", "insert_many", n, function()
+        zs:insert_many(bulk);
+    end);
+end
+
+function main(members, top)
+    local n = tonumber(members) or 200000;
+    top = tonumber(top) or 100;
+    math.randomseed(1);
+    local scores, updates = {}, {};
+    for i = 1, n do
+        scores[i]  = math.random(0, 1000000);
+        updates[i] = scores[i] + math.random(-1000, 1000);
+    end
+    run_skiplist(scores, updates, top);
+    collectgarbage();
+    run_zset(scores, updates, top);
+end
+
+----------------------------------------------------------------------------